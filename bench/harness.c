@@ -0,0 +1,196 @@
+// pthread_setaffinity_np is a GNU extension
+#define _GNU_SOURCE
+
+#include "harness.h"
+#include "fs/betterassert.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void bench_pin_thread(int cpu) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET((size_t)(cpu % cpus), &set);
+    // best effort: a restricted affinity mask leaves the thread where it is
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+size_t bench_parse_sizes(char const *list, size_t *values, size_t max) {
+    size_t n = 0;
+    char const *p = list;
+    for (;;) {
+        char *end;
+        unsigned long long value = strtoull(p, &end, 10);
+        if (end == p || value == 0 || n == max) {
+            return 0;
+        }
+        values[n++] = (size_t)value;
+        if (*end == '\0') {
+            return n;
+        }
+        if (*end != ',') {
+            return 0;
+        }
+        p = end + 1;
+    }
+}
+
+int bench_parse_format(char const *name, bench_format_t *format) {
+    if (strcmp(name, "csv") == 0) {
+        *format = BENCH_CSV;
+    } else if (strcmp(name, "json") == 0) {
+        *format = BENCH_JSON;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+void bench_latencies_init(bench_latencies_t *lat, size_t capacity) {
+    lat->ls_samples = malloc(capacity * sizeof(uint64_t));
+    ALWAYS_ASSERT(lat->ls_samples != NULL,
+                  "bench_latencies_init: failed to allocate samples");
+    lat->ls_capacity = capacity;
+    bench_latencies_reset(lat);
+}
+
+void bench_latencies_destroy(bench_latencies_t *lat) {
+    free(lat->ls_samples);
+    lat->ls_samples = NULL;
+    lat->ls_capacity = 0;
+    lat->ls_count = 0;
+}
+
+void bench_latencies_reset(bench_latencies_t *lat) {
+    lat->ls_count = 0;
+    lat->ls_total_ns = 0;
+}
+
+void bench_latencies_record(bench_latencies_t *lat, uint64_t ns) {
+    lat->ls_total_ns += ns;
+    // past the capacity, only the total counts
+    if (lat->ls_count < lat->ls_capacity) {
+        lat->ls_samples[lat->ls_count] = ns;
+    }
+    lat->ls_count++;
+}
+
+static int compare_samples(void const *a, void const *b) {
+    uint64_t x = *(uint64_t const *)a;
+    uint64_t y = *(uint64_t const *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * The sample below which a share of the (sorted) samples falls.
+ */
+static uint64_t percentile(uint64_t const *sorted, size_t count,
+                           double share) {
+    if (count == 0) {
+        return 0;
+    }
+    size_t rank = (size_t)(share * (double)count);
+    return sorted[rank < count ? rank : count - 1];
+}
+
+void bench_summarize(bench_result_t *result, bench_latencies_t *lats,
+                     int threads) {
+    size_t kept = 0;
+    result->br_ops = 0;
+    result->br_ops_per_second = 0;
+    for (int t = 0; t < threads; t++) {
+        bench_latencies_t const *lat = &lats[t];
+        result->br_ops += lat->ls_count;
+        if (lat->ls_total_ns > 0) {
+            result->br_ops_per_second +=
+                (double)lat->ls_count * 1e9 / (double)lat->ls_total_ns;
+        }
+        kept += lat->ls_count < lat->ls_capacity ? lat->ls_count
+                                                 : lat->ls_capacity;
+    }
+
+    uint64_t *all = malloc((kept > 0 ? kept : 1) * sizeof(uint64_t));
+    ALWAYS_ASSERT(all != NULL, "bench_summarize: failed to allocate samples");
+    size_t n = 0;
+    for (int t = 0; t < threads; t++) {
+        bench_latencies_t const *lat = &lats[t];
+        size_t count = lat->ls_count < lat->ls_capacity ? lat->ls_count
+                                                        : lat->ls_capacity;
+        memcpy(all + n, lat->ls_samples, count * sizeof(uint64_t));
+        n += count;
+    }
+    qsort(all, n, sizeof(uint64_t), compare_samples);
+    result->br_p50_ns = percentile(all, n, 0.5);
+    result->br_p99_ns = percentile(all, n, 0.99);
+    result->br_p999_ns = percentile(all, n, 0.999);
+    free(all);
+}
+
+// rows written since bench_report_begin (JSON needs commas between them)
+static size_t rows;
+
+void bench_report_begin(FILE *out, bench_format_t format) {
+    rows = 0;
+    switch (format) {
+    case BENCH_CSV:
+        fprintf(out, "benchmark,block_size,block_count,threads,ops,"
+                     "ops_per_sec,p50_ns,p99_ns,p999_ns\n");
+        break;
+    case BENCH_JSON:
+        fprintf(out, "[\n");
+        break;
+    default:
+        PANIC("bench_report_begin: unknown format");
+    }
+}
+
+void bench_report(FILE *out, bench_format_t format,
+                  bench_result_t const *r) {
+    switch (format) {
+    case BENCH_CSV:
+        fprintf(out, "%s,%zu,%zu,%d,%llu,%.0f,%llu,%llu,%llu\n", r->br_name,
+                r->br_block_size, r->br_block_count, r->br_threads,
+                (unsigned long long)r->br_ops, r->br_ops_per_second,
+                (unsigned long long)r->br_p50_ns,
+                (unsigned long long)r->br_p99_ns,
+                (unsigned long long)r->br_p999_ns);
+        break;
+    case BENCH_JSON:
+        fprintf(out,
+                "%s  {\"benchmark\": \"%s\", \"block_size\": %zu, "
+                "\"block_count\": %zu, \"threads\": %d, \"ops\": %llu, "
+                "\"ops_per_sec\": %.0f, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+                "\"p999_ns\": %llu}",
+                rows > 0 ? ",\n" : "", r->br_name, r->br_block_size,
+                r->br_block_count, r->br_threads,
+                (unsigned long long)r->br_ops, r->br_ops_per_second,
+                (unsigned long long)r->br_p50_ns,
+                (unsigned long long)r->br_p99_ns,
+                (unsigned long long)r->br_p999_ns);
+        break;
+    default:
+        PANIC("bench_report: unknown format");
+    }
+    rows++;
+    fflush(out);
+}
+
+void bench_report_end(FILE *out, bench_format_t format) {
+    if (format == BENCH_JSON) {
+        fprintf(out, "%s]\n", rows > 0 ? "\n" : "");
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Shared plumbing of the benchmarks: clock, thread pinning, latency samples
+ * and their percentiles, and the CSV/JSON report (one row per result).
+ */
+
+typedef enum {
+    BENCH_CSV = 0,
+    BENCH_JSON,
+} bench_format_t;
+
+/**
+ * Latency samples (in nanoseconds) of one thread.
+ */
+typedef struct {
+    uint64_t *ls_samples;
+    size_t ls_count;
+    size_t ls_capacity;
+    uint64_t ls_total_ns; // sum of the samples
+} bench_latencies_t;
+
+/**
+ * A row of the report.
+ */
+typedef struct {
+    char const *br_name;
+    size_t br_block_size;
+    size_t br_block_count;
+    int br_threads;
+    uint64_t br_ops;
+    double br_ops_per_second;
+    uint64_t br_p50_ns;
+    uint64_t br_p99_ns;
+    uint64_t br_p999_ns;
+} bench_result_t;
+
+uint64_t bench_now_ns(void);
+
+/**
+ * Pin the calling thread to a CPU (cpu modulo the CPUs online), so that
+ * results do not depend on the scheduler moving threads around.
+ */
+void bench_pin_thread(int cpu);
+
+/**
+ * Parse a comma separated list of sizes, such as "512,1024,4096".
+ * Returns the number of sizes stored in values (at most max), or 0 if the
+ * list is invalid.
+ */
+size_t bench_parse_sizes(char const *list, size_t *values, size_t max);
+
+/**
+ * Parse "csv" or "json". Returns 0 if successful, -1 otherwise.
+ */
+int bench_parse_format(char const *name, bench_format_t *format);
+
+void bench_latencies_init(bench_latencies_t *lat, size_t capacity);
+void bench_latencies_destroy(bench_latencies_t *lat);
+void bench_latencies_reset(bench_latencies_t *lat);
+void bench_latencies_record(bench_latencies_t *lat, uint64_t ns);
+
+/**
+ * Fill in the operation count, throughput and percentiles of a result from
+ * the samples of its threads. The throughput adds up that of every thread,
+ * counting the time spent in the measured operations only.
+ */
+void bench_summarize(bench_result_t *result, bench_latencies_t *lats,
+                     int threads);
+
+void bench_report_begin(FILE *out, bench_format_t format);
+void bench_report(FILE *out, bench_format_t format,
+                  bench_result_t const *result);
+void bench_report_end(FILE *out, bench_format_t format);
+
+#endif // HARNESS_H
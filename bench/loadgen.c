@@ -0,0 +1,400 @@
+#include "fs/operations.h"
+#include "harness.h"
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Mixed-workload load generator: threads (pinned to their own CPUs) run a mix
+ * of create, open, read, write, link and unlink operations for a fixed time,
+ * on files picked with a Zipf distribution (a few hot files take most of the
+ * operations), for every thread count of a sweep. Each thread count gives a
+ * point of the throughput-vs-threads curve ("mix", counting wall clock time),
+ * and the latencies of each operation of the mix.
+ *
+ * The files, /f<i>, are created (with FILE_BLOCKS blocks) and opened up front:
+ *   - create opens /n<i> with TFS_O_CREAT (creating it if it is not there);
+ *   - open opens /f<i>, and closes it;
+ *   - read and write transfer a block at a random offset, with tfs_pread and
+ *     tfs_pwrite on the handle of /f<i> shared by all threads;
+ *   - link links /l<i> to /f<i>, and unlink removes /l<i> or /n<i>.
+ * Creates, links and unlinks fail when another thread gets to the name first
+ * (or the name is there already, or missing), and count all the same.
+ *
+ * Usage: loadgen [-t max threads] [-d seconds] [-F files] [-s zipf skew]
+ *                [-m mix] [-b block size] [-f csv|json] [-T trace file]
+ * where the mix gives the weight of each operation, e.g.
+ * -m create=5,open=20,read=40,write=25,link=5,unlink=5 (the default), and the
+ * sweep goes through the powers of two up to the maximum thread count (the
+ * CPUs online, by default). With -T, the latest TRACE_EVENTS events of every
+ * thread of the last point are written to the trace file (see
+ * tfs_trace_dump).
+ * */
+
+#define MAX_THREADS 64
+#define FILE_BLOCKS 8
+#define SAMPLES_PER_OP (1 << 16)
+#define TRACE_EVENTS (1 << 16)
+
+typedef enum {
+    OP_CREATE = 0,
+    OP_OPEN,
+    OP_READ,
+    OP_WRITE,
+    OP_LINK,
+    OP_UNLINK,
+    OP_COUNT,
+} load_op_t;
+
+static char const *const op_names[OP_COUNT] = {"create", "open", "read",
+                                               "write",  "link", "unlink"};
+
+static unsigned mix[OP_COUNT] = {5, 20, 40, 25, 5, 5};
+static unsigned mix_total;
+static size_t files = 256;
+static size_t block_size = 1024;
+static char const *trace_path; // or NULL
+static double *zipf_cdf; // of the file ranks
+static int *handles;     // of /f<i>, shared by all threads
+static atomic_bool stop;
+
+typedef struct {
+    int t;
+    uint64_t seed;
+    bench_latencies_t lat[OP_COUNT];
+    pthread_barrier_t *start;
+} worker_t;
+
+// splitmix64: small, fast, and good enough to pick files and operations
+static uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+static double next_unit(uint64_t *state) {
+    return (double)(next_random(state) >> 11) / (double)(1ULL << 53);
+}
+
+static void zipf_init(double skew) {
+    zipf_cdf = malloc(files * sizeof(double));
+    assert(zipf_cdf != NULL);
+    double sum = 0;
+    for (size_t i = 0; i < files; i++) {
+        sum += 1.0 / pow((double)(i + 1), skew);
+        zipf_cdf[i] = sum;
+    }
+    for (size_t i = 0; i < files; i++) {
+        zipf_cdf[i] /= sum;
+    }
+}
+
+static size_t zipf_next(uint64_t *state) {
+    double u = next_unit(state);
+    size_t lo = 0, hi = files - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static load_op_t pick_op(uint64_t *state) {
+    unsigned r = (unsigned)(next_random(state) % mix_total);
+    load_op_t op = 0;
+    while (r >= mix[op]) {
+        r -= mix[op];
+        op++;
+    }
+    return op;
+}
+
+static void run_op(load_op_t op, size_t file, uint64_t *state,
+                   uint8_t *buffer) {
+    char path[32];
+    size_t offset = (size_t)(next_random(state) % FILE_BLOCKS) * block_size;
+    switch (op) {
+    case OP_CREATE: {
+        snprintf(path, sizeof(path), "/n%zu", file);
+        int fh = tfs_open(path, TFS_O_CREAT);
+        if (fh != -1) {
+            assert(tfs_close(fh) != -1);
+        }
+        break;
+    }
+    case OP_OPEN: {
+        snprintf(path, sizeof(path), "/f%zu", file);
+        int fh = tfs_open(path, 0);
+        assert(fh != -1);
+        assert(tfs_close(fh) != -1);
+        break;
+    }
+    case OP_READ:
+        assert(tfs_pread(handles[file], buffer, block_size, offset) ==
+               (ssize_t)block_size);
+        break;
+    case OP_WRITE:
+        assert(tfs_pwrite(handles[file], buffer, block_size, offset) ==
+               (ssize_t)block_size);
+        break;
+    case OP_LINK: {
+        char target[32];
+        snprintf(target, sizeof(target), "/f%zu", file);
+        snprintf(path, sizeof(path), "/l%zu", file);
+        tfs_link(target, path);
+        break;
+    }
+    case OP_UNLINK:
+        snprintf(path, sizeof(path), next_random(state) % 2 ? "/l%zu" : "/n%zu",
+                 file);
+        tfs_unlink(path);
+        break;
+    case OP_COUNT:
+    default:
+        assert(false);
+    }
+}
+
+static void *worker(void *ptr) {
+    worker_t *w = ptr;
+    bench_pin_thread(w->t);
+    uint8_t *buffer = malloc(block_size);
+    assert(buffer != NULL);
+    memset(buffer, w->t, block_size);
+    uint64_t state = w->seed;
+
+    pthread_barrier_wait(w->start);
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        load_op_t op = pick_op(&state);
+        size_t file = zipf_next(&state);
+        uint64_t start = bench_now_ns();
+        run_op(op, file, &state, buffer);
+        bench_latencies_record(&w->lat[op], bench_now_ns() - start);
+    }
+    free(buffer);
+    return NULL;
+}
+
+static void setup_files(void) {
+    uint8_t *buffer = calloc(1, block_size);
+    assert(buffer != NULL);
+    for (size_t i = 0; i < files; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/f%zu", i);
+        handles[i] = tfs_open(path, TFS_O_CREAT);
+        assert(handles[i] != -1);
+        for (size_t b = 0; b < FILE_BLOCKS; b++) {
+            assert(tfs_write(handles[i], buffer, block_size) ==
+                   (ssize_t)block_size);
+        }
+    }
+    free(buffer);
+}
+
+static void run_threads(int threads, double seconds, bench_format_t format) {
+    tfs_params params = tfs_default_params();
+    params.block_size = block_size;
+    // the files, and as much again for the directory
+    params.max_block_count = 2 * files * FILE_BLOCKS + 1024;
+    params.max_inode_count = 2 * files + 16;
+    params.max_open_files_count = files + (size_t)threads;
+    params.trace_events = trace_path != NULL ? TRACE_EVENTS : 0;
+    assert(tfs_init(&params) != -1);
+    setup_files();
+
+    worker_t *workers = calloc((size_t)threads, sizeof(worker_t));
+    assert(workers != NULL);
+    pthread_barrier_t start;
+    assert(pthread_barrier_init(&start, NULL, (unsigned)threads + 1) == 0);
+    atomic_store(&stop, false);
+    pthread_t tid[MAX_THREADS];
+    for (int t = 0; t < threads; t++) {
+        workers[t].t = t;
+        workers[t].seed = 0x5eed + (uint64_t)t;
+        workers[t].start = &start;
+        for (load_op_t op = 0; op < OP_COUNT; op++) {
+            bench_latencies_init(&workers[t].lat[op], SAMPLES_PER_OP);
+        }
+        assert(pthread_create(&tid[t], NULL, worker, &workers[t]) == 0);
+    }
+    pthread_barrier_wait(&start);
+    uint64_t begin = bench_now_ns();
+    struct timespec duration = {
+        .tv_sec = (time_t)seconds,
+        .tv_nsec = (long)((seconds - (double)(time_t)seconds) * 1e9)};
+    nanosleep(&duration, NULL);
+    atomic_store(&stop, true);
+    for (int t = 0; t < threads; t++) {
+        assert(pthread_join(tid[t], NULL) == 0);
+    }
+    double elapsed = (double)(bench_now_ns() - begin) / 1e9;
+    pthread_barrier_destroy(&start);
+
+    // the whole mix, and then each of its operations
+    bench_latencies_t lats[MAX_THREADS * OP_COUNT];
+    int n = 0;
+    for (int t = 0; t < threads; t++) {
+        for (load_op_t op = 0; op < OP_COUNT; op++) {
+            lats[n++] = workers[t].lat[op];
+        }
+    }
+    bench_result_t result = {.br_name = "mix",
+                             .br_block_size = block_size,
+                             .br_block_count = params.max_block_count,
+                             .br_threads = threads};
+    bench_summarize(&result, lats, n);
+    result.br_ops_per_second = (double)result.br_ops / elapsed;
+    bench_report(stdout, format, &result);
+    for (load_op_t op = 0; op < OP_COUNT; op++) {
+        if (mix[op] == 0) {
+            continue;
+        }
+        for (int t = 0; t < threads; t++) {
+            lats[t] = workers[t].lat[op];
+        }
+        result.br_name = op_names[op];
+        bench_summarize(&result, lats, threads);
+        result.br_ops_per_second = (double)result.br_ops / elapsed;
+        bench_report(stdout, format, &result);
+    }
+
+    for (int t = 0; t < threads; t++) {
+        for (load_op_t op = 0; op < OP_COUNT; op++) {
+            bench_latencies_destroy(&workers[t].lat[op]);
+        }
+    }
+    free(workers);
+    assert(tfs_destroy() != -1);
+    if (trace_path != NULL && tfs_trace_dump(trace_path) == -1) {
+        perror(trace_path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Parse a mix such as "read=80,write=20" (operations left out get no weight).
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int parse_mix(char const *list) {
+    unsigned weights[OP_COUNT] = {0};
+    char const *p = list;
+    for (;;) {
+        char const *eq = strchr(p, '=');
+        if (eq == NULL) {
+            return -1;
+        }
+        load_op_t op = 0;
+        while (op < OP_COUNT && (strlen(op_names[op]) != (size_t)(eq - p) ||
+                                 strncmp(p, op_names[op], (size_t)(eq - p)))) {
+            op++;
+        }
+        char *end;
+        unsigned long weight = strtoul(eq + 1, &end, 10);
+        if (op == OP_COUNT || end == eq + 1) {
+            return -1;
+        }
+        weights[op] = (unsigned)weight;
+        if (*end == '\0') {
+            break;
+        }
+        if (*end != ',') {
+            return -1;
+        }
+        p = end + 1;
+    }
+    memcpy(mix, weights, sizeof(mix));
+    return 0;
+}
+
+static void usage(char const *prog) {
+    fprintf(stderr,
+            "usage: %s [-t max threads] [-d seconds] [-F files] "
+            "[-s zipf skew] [-m mix] [-b block size] [-f csv|json] "
+            "[-T trace file]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cpus > MAX_THREADS ? MAX_THREADS : (int)cpus;
+    double seconds = 2;
+    double skew = 0.99;
+    bench_format_t format = BENCH_CSV;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:d:F:s:m:b:f:T:")) != -1) {
+        switch (opt) {
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'd':
+            seconds = strtod(optarg, NULL);
+            break;
+        case 'F':
+            files = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            skew = strtod(optarg, NULL);
+            break;
+        case 'm':
+            if (parse_mix(optarg) != 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'b':
+            block_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            if (bench_parse_format(optarg, &format) != 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    mix_total = 0;
+    for (load_op_t op = 0; op < OP_COUNT; op++) {
+        mix_total += mix[op];
+    }
+    if (max_threads < 1 || max_threads > MAX_THREADS || seconds <= 0 ||
+        files == 0 || skew < 0 || block_size == 0 || mix_total == 0) {
+        usage(argv[0]);
+    }
+
+    zipf_init(skew);
+    handles = malloc(files * sizeof(int));
+    assert(handles != NULL);
+    bench_report_begin(stdout, format);
+    for (int threads = 1;; threads *= 2) {
+        if (threads > max_threads) {
+            threads = max_threads; // the last point of the curve
+        }
+        run_threads(threads, seconds, format);
+        if (threads == max_threads) {
+            break;
+        }
+    }
+    bench_report_end(stdout, format);
+    free(handles);
+    free(zipf_cdf);
+
+    return 0;
+}
@@ -0,0 +1,345 @@
+#include "fs/operations.h"
+#include "harness.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Micro-benchmarks of the TécnicoFS operations: each runs one operation in a
+ * tight loop (after a warmup), on every thread (pinned to its own CPU, and
+ * working on its own files), for every block size and block count of the
+ * sweep. Only the operation itself is timed: the handles reopened at the end
+ * of a file, and the links removed to make room for more, are not.
+ *
+ * Usage: micro [-b block sizes] [-c block counts] [-t threads]
+ *              [-n iterations] [-w warmup iterations] [-o operation]...
+ *              [-f csv|json] [-s]
+ * with comma separated sweeps (e.g. -b 512,4096), -o repeated to run some of
+ * open, read, write, link and unlink (all of them by default), and -s to run
+ * with tfs_params.collect_stats set (to measure its overhead).
+ * */
+
+#define MAX_SWEEP 16
+#define MAX_THREADS 64
+#define FILE_BLOCKS 16
+#define LINK_BATCH 64
+
+typedef enum {
+    OP_OPEN = 0,
+    OP_READ,
+    OP_WRITE,
+    OP_LINK,
+    OP_UNLINK,
+    OP_COUNT,
+} micro_op_t;
+
+static char const *const op_names[OP_COUNT] = {"open", "read", "write",
+                                               "link", "unlink"};
+
+typedef struct {
+    int t;
+    micro_op_t op;
+    size_t block_size;
+    size_t iterations;
+    size_t warmup;
+    bench_latencies_t *lat;
+    pthread_barrier_t *start;
+} worker_arg_t;
+
+static void record(bench_latencies_t *lat, uint64_t start) {
+    uint64_t end = bench_now_ns();
+    if (lat != NULL) {
+        bench_latencies_record(lat, end - start);
+    }
+}
+
+static void bench_open(int t, size_t n, bench_latencies_t *lat) {
+    char path[32];
+    snprintf(path, sizeof(path), "/r%d", t);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t start = bench_now_ns();
+        int fh = tfs_open(path, 0);
+        record(lat, start);
+        assert(fh != -1);
+        assert(tfs_close(fh) != -1);
+    }
+}
+
+static void bench_read(int t, size_t n, size_t block_size,
+                       bench_latencies_t *lat) {
+    char path[32];
+    snprintf(path, sizeof(path), "/r%d", t);
+    uint8_t *buffer = malloc(block_size);
+    assert(buffer != NULL);
+    int fh = tfs_open(path, 0);
+    assert(fh != -1);
+    for (size_t i = 0; i < n;) {
+        uint64_t start = bench_now_ns();
+        ssize_t r = tfs_read(fh, buffer, block_size);
+        if (r == 0) { // back to the start of the file
+            assert(tfs_close(fh) != -1);
+            fh = tfs_open(path, 0);
+            assert(fh != -1);
+            continue;
+        }
+        record(lat, start);
+        assert(r == (ssize_t)block_size);
+        i++;
+    }
+    assert(tfs_close(fh) != -1);
+    free(buffer);
+}
+
+static void bench_write(int t, size_t n, size_t block_size,
+                        bench_latencies_t *lat) {
+    char path[32];
+    snprintf(path, sizeof(path), "/w%d", t);
+    uint8_t *buffer = malloc(block_size);
+    assert(buffer != NULL);
+    memset(buffer, t, block_size);
+    int fh = -1;
+    for (size_t i = 0; i < n; i++) {
+        if (i % FILE_BLOCKS == 0) { // start the file over
+            if (fh != -1) {
+                assert(tfs_close(fh) != -1);
+            }
+            fh = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+            assert(fh != -1);
+        }
+        uint64_t start = bench_now_ns();
+        ssize_t w = tfs_write(fh, buffer, block_size);
+        record(lat, start);
+        assert(w == (ssize_t)block_size);
+    }
+    assert(tfs_close(fh) != -1);
+    free(buffer);
+}
+
+/**
+ * Link (and unlink) batches of names to a file, timing the links or the
+ * unlinks.
+ */
+static void bench_links(int t, size_t n, micro_op_t op,
+                        bench_latencies_t *lat) {
+    char target[32];
+    snprintf(target, sizeof(target), "/r%d", t);
+    char names[LINK_BATCH][32];
+    for (size_t i = 0; i < LINK_BATCH; i++) {
+        snprintf(names[i], sizeof(names[i]), "/l%d_%zu", t, i);
+    }
+    for (size_t done = 0; done < n;) {
+        size_t batch = n - done < LINK_BATCH ? n - done : LINK_BATCH;
+        for (size_t i = 0; i < batch; i++) {
+            uint64_t start = bench_now_ns();
+            int r = tfs_link(target, names[i]);
+            record(op == OP_LINK ? lat : NULL, start);
+            assert(r != -1);
+        }
+        for (size_t i = 0; i < batch; i++) {
+            uint64_t start = bench_now_ns();
+            int r = tfs_unlink(names[i]);
+            record(op == OP_UNLINK ? lat : NULL, start);
+            assert(r != -1);
+        }
+        done += batch;
+    }
+}
+
+static void run_op(worker_arg_t const *arg, size_t n, bench_latencies_t *lat) {
+    switch (arg->op) {
+    case OP_OPEN:
+        bench_open(arg->t, n, lat);
+        break;
+    case OP_READ:
+        bench_read(arg->t, n, arg->block_size, lat);
+        break;
+    case OP_WRITE:
+        bench_write(arg->t, n, arg->block_size, lat);
+        break;
+    case OP_LINK:
+    case OP_UNLINK:
+        bench_links(arg->t, n, arg->op, lat);
+        break;
+    case OP_COUNT:
+    default:
+        assert(false);
+    }
+}
+
+static void *worker(void *ptr) {
+    worker_arg_t const *arg = ptr;
+    bench_pin_thread(arg->t);
+    run_op(arg, arg->warmup, NULL);
+    pthread_barrier_wait(arg->start);
+    run_op(arg, arg->iterations, arg->lat);
+    return NULL;
+}
+
+/**
+ * Give every thread a file of FILE_BLOCKS blocks to read (and link to).
+ */
+static void setup_files(int threads, size_t block_size) {
+    uint8_t *buffer = malloc(block_size);
+    assert(buffer != NULL);
+    for (int t = 0; t < threads; t++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/r%d", t);
+        memset(buffer, t, block_size);
+        int fh = tfs_open(path, TFS_O_CREAT);
+        assert(fh != -1);
+        for (size_t b = 0; b < FILE_BLOCKS; b++) {
+            assert(tfs_write(fh, buffer, block_size) == (ssize_t)block_size);
+        }
+        assert(tfs_close(fh) != -1);
+    }
+    free(buffer);
+}
+
+static void run_config(size_t block_size, size_t block_count, int threads,
+                       size_t iterations, size_t warmup, bool const *ops,
+                       bool collect_stats, bench_format_t format) {
+    tfs_params params = tfs_default_params();
+    params.block_size = block_size;
+    params.max_block_count = block_count;
+    params.max_inode_count = (size_t)(2 * threads + 8);
+    params.max_open_files_count = (size_t)(2 * threads);
+    params.collect_stats = collect_stats;
+    assert(tfs_init(&params) != -1);
+    setup_files(threads, block_size);
+
+    bench_latencies_t lats[MAX_THREADS];
+    for (int t = 0; t < threads; t++) {
+        bench_latencies_init(&lats[t], iterations);
+    }
+    for (micro_op_t op = 0; op < OP_COUNT; op++) {
+        if (!ops[op]) {
+            continue;
+        }
+        pthread_barrier_t start;
+        assert(pthread_barrier_init(&start, NULL, (unsigned)threads) == 0);
+        pthread_t tid[MAX_THREADS];
+        worker_arg_t args[MAX_THREADS];
+        for (int t = 0; t < threads; t++) {
+            bench_latencies_reset(&lats[t]);
+            args[t] = (worker_arg_t){.t = t,
+                                     .op = op,
+                                     .block_size = block_size,
+                                     .iterations = iterations,
+                                     .warmup = warmup,
+                                     .lat = &lats[t],
+                                     .start = &start};
+            assert(pthread_create(&tid[t], NULL, worker, &args[t]) == 0);
+        }
+        for (int t = 0; t < threads; t++) {
+            assert(pthread_join(tid[t], NULL) == 0);
+        }
+        pthread_barrier_destroy(&start);
+
+        bench_result_t result = {.br_name = op_names[op],
+                                 .br_block_size = block_size,
+                                 .br_block_count = block_count,
+                                 .br_threads = threads};
+        bench_summarize(&result, lats, threads);
+        bench_report(stdout, format, &result);
+    }
+    for (int t = 0; t < threads; t++) {
+        bench_latencies_destroy(&lats[t]);
+    }
+    assert(tfs_destroy() != -1);
+}
+
+static void usage(char const *prog) {
+    fprintf(stderr,
+            "usage: %s [-b block sizes] [-c block counts] [-t threads] "
+            "[-n iterations] [-w warmup] [-o operation]... [-f csv|json] "
+            "[-s]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    size_t block_sizes[MAX_SWEEP] = {512, 1024, 4096};
+    size_t n_sizes = 3;
+    size_t block_counts[MAX_SWEEP] = {1024, 8192};
+    size_t n_counts = 2;
+    int threads = 1;
+    size_t iterations = 20000;
+    size_t warmup = 2000;
+    bench_format_t format = BENCH_CSV;
+    bool ops[OP_COUNT] = {false};
+    bool some_ops = false;
+    bool collect_stats = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:c:t:n:w:o:f:s")) != -1) {
+        switch (opt) {
+        case 'b':
+            n_sizes = bench_parse_sizes(optarg, block_sizes, MAX_SWEEP);
+            if (n_sizes == 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'c':
+            n_counts = bench_parse_sizes(optarg, block_counts, MAX_SWEEP);
+            if (n_counts == 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 't':
+            threads = atoi(optarg);
+            if (threads < 1 || threads > MAX_THREADS) {
+                usage(argv[0]);
+            }
+            break;
+        case 'n':
+            iterations = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            warmup = strtoul(optarg, NULL, 10);
+            break;
+        case 'o': {
+            micro_op_t op = 0;
+            while (op < OP_COUNT && strcmp(optarg, op_names[op]) != 0) {
+                op++;
+            }
+            if (op == OP_COUNT) {
+                usage(argv[0]);
+            }
+            ops[op] = true;
+            some_ops = true;
+            break;
+        }
+        case 'f':
+            if (bench_parse_format(optarg, &format) != 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 's':
+            collect_stats = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!some_ops) {
+        for (micro_op_t op = 0; op < OP_COUNT; op++) {
+            ops[op] = true;
+        }
+    }
+
+    bench_report_begin(stdout, format);
+    for (size_t s = 0; s < n_sizes; s++) {
+        for (size_t c = 0; c < n_counts; c++) {
+            run_config(block_sizes[s], block_counts[c], threads, iterations,
+                       warmup, ops, collect_stats, format);
+        }
+    }
+    bench_report_end(stdout, format);
+
+    return 0;
+}
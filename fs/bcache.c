@@ -0,0 +1,991 @@
+#include "bcache.h"
+#include "betterassert.h"
+#include "config.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * The cache is split in shards (blocks go to shard block % shard_count), each
+ * with its own lock, hash chains, share of the memory budget and CLOCK-Pro
+ * state.
+ *
+ * CLOCK-Pro keeps hot and cold resident blocks, plus non-resident cold blocks
+ * still in their test period, on a single clock with three hands:
+ *   - hand_cold evicts cold blocks: those referenced since it last passed are
+ *     promoted to hot, the others lose their buffer and stay on the clock as
+ *     test entries;
+ *   - hand_hot demotes the hot blocks not referenced since it last passed, as
+ *     long as there are more hot blocks than the hot target allows;
+ *   - hand_test drops the test entries, as long as there are more of them
+ *     than resident blocks.
+ * A miss on a block in its test period means that it was evicted too soon:
+ * the cold target grows, and the block comes back as hot. A test period that
+ * ends without one shrinks the cold target. Blocks used once (a scan) thus
+ * only go through the cold blocks, without pushing out the hot ones.
+ *
+ * Pinned and dirty blocks are never evicted. When every cold block is either,
+ * a miss writes back one of the dirty ones itself (the flusher is behind),
+ * with the shard unlocked, and tries again. Only when every cold block is
+ * pinned is a miss served by an overflow buffer, outside the clock and the
+ * budget, which is written through (if dirty) and dropped when unpinned.
+ * Readahead does neither: it skips the blocks it finds no room for.
+ *
+ * A block missing from the cache is pinned before its contents are read; the
+ * first pinner reads it (or overwrites it entirely) and marks it ready, and
+ * the others wait for that.
+ *
+ * Writes stay in the cache: the blocks are marked dirty (with the time they
+ * became so), and written back by a flusher thread. It wakes up every
+ * BCACHE_FLUSH_INTERVAL_MS, or when more than BCACHE_DIRTY_RATIO percent of
+ * the cache is dirty, and writes back the blocks dirty for longer than
+ * BCACHE_DIRTY_AGE_MS (or, over the ratio, every dirty block until half of it
+ * is left). Write-backs pick up to BCACHE_FLUSH_BLOCKS dirty blocks, sort them
+ * and write every run of adjacent ones with a single device transfer.
+ *
+ * A block being written back stays pinned, so it cannot be evicted; it is
+ * marked clean before its contents are copied out, so that any change made in
+ * the meantime marks it dirty again.
+ *
+ * Readahead adds the missing blocks right away, pinned and invalid, and queues
+ * them for a reader thread, which reads them in batches of up to
+ * BCACHE_BATCH_BLOCKS. A thread reaching one of them before it is read waits
+ * for it like for any block being filled. Blocks that would need an overflow
+ * buffer (or a full queue) are not read ahead. The first use of a block read
+ * ahead is not a reference, so that scans still only go through the cold
+ * blocks.
+ */
+typedef enum { CE_HOT, CE_COLD, CE_TEST } cache_entry_type_t;
+
+typedef struct cache_entry {
+    size_t ce_block;
+    cache_entry_type_t ce_type;
+    char *ce_data; // NULL for test entries
+    unsigned ce_pins;
+    bool ce_ref;      // referenced since a hand last passed
+    bool ce_valid;    // contents read (or written)
+    bool ce_dirty;    // contents changed since written back
+    uint64_t ce_dirtied; // when it became dirty (CLOCK_MONOTONIC, in ns)
+    bool ce_overflow; // outside the clock
+    bool ce_ahead;    // read ahead, and not used since
+    struct cache_entry *ce_hash_next;
+    struct cache_entry *ce_prev; // clock
+    struct cache_entry *ce_next;
+} cache_entry_t;
+
+typedef struct {
+    pthread_mutex_t cs_lock;
+    pthread_cond_t cs_ready; // signaled when a block becomes valid
+    cache_entry_t **cs_chains;
+    size_t cs_chain_count; // a power of two
+
+    cache_entry_t *cs_hand_hot;
+    cache_entry_t *cs_hand_cold;
+    cache_entry_t *cs_hand_test;
+    size_t cs_capacity;    // resident blocks
+    size_t cs_cold_target; // resident cold blocks aimed for (adaptive)
+    size_t cs_hot;
+    size_t cs_cold;
+    size_t cs_test;
+
+    char **cs_free; // unused buffers
+    size_t cs_free_count;
+    size_t cs_dirty;
+
+    uint64_t cs_hits;
+    uint64_t cs_misses;
+    uint64_t cs_readahead;
+} cache_shard_t;
+
+static block_device_t *cache_device;
+static char *arena;
+static cache_shard_t *shards;
+static size_t shard_count;
+
+static atomic_size_t dirty_blocks;
+static size_t dirty_limit; // dirty blocks that wake up the flusher
+
+static pthread_t flusher;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+static bool flusher_running;
+static bool flusher_kicked;
+static bool flusher_stopping;
+
+// blocks pinned by readahead, in a ring, for the reader thread
+static size_t readahead_queue[BCACHE_READAHEAD_QUEUE];
+static size_t readahead_head;
+static size_t readahead_count;
+static pthread_t reader;
+static pthread_mutex_t reader_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reader_wake = PTHREAD_COND_INITIALIZER;
+static bool reader_running;
+static bool reader_stopping;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Wake up the flusher ahead of time.
+ */
+static void flusher_kick(void) {
+    pthread_mutex_lock(&flusher_lock);
+    flusher_kicked = true;
+    pthread_cond_signal(&flusher_wake);
+    pthread_mutex_unlock(&flusher_lock);
+}
+
+/**
+ * Mark a block (in a locked shard) dirty.
+ */
+static void cache_set_dirty(cache_shard_t *shard, cache_entry_t *entry,
+                            uint64_t since) {
+    if (entry->ce_dirty) {
+        return;
+    }
+    entry->ce_dirty = true;
+    entry->ce_dirtied = since;
+    shard->cs_dirty++;
+    atomic_fetch_add(&dirty_blocks, 1);
+}
+
+/**
+ * Mark a block (in a locked shard) clean.
+ */
+static void cache_clear_dirty(cache_shard_t *shard, cache_entry_t *entry) {
+    if (!entry->ce_dirty) {
+        return;
+    }
+    entry->ce_dirty = false;
+    shard->cs_dirty--;
+    atomic_fetch_sub(&dirty_blocks, 1);
+}
+
+static cache_shard_t *cache_shard(size_t block) {
+    return &shards[block % shard_count];
+}
+
+static cache_entry_t **cache_chain(cache_shard_t *shard, size_t block) {
+    size_t chain = (block / shard_count) & (shard->cs_chain_count - 1);
+    return &shard->cs_chains[chain];
+}
+
+static cache_entry_t *cache_find(cache_shard_t *shard, size_t block) {
+    for (cache_entry_t *e = *cache_chain(shard, block); e != NULL;
+         e = e->ce_hash_next) {
+        if (e->ce_block == block) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void cache_unchain(cache_shard_t *shard, cache_entry_t *entry) {
+    cache_entry_t **it = cache_chain(shard, entry->ce_block);
+    while (*it != entry) {
+        it = &(*it)->ce_hash_next;
+    }
+    *it = entry->ce_hash_next;
+}
+
+/**
+ * Put an entry on the clock, behind hand_hot (where the hands get last).
+ */
+static void clock_insert(cache_shard_t *shard, cache_entry_t *entry) {
+    cache_entry_t *hot = shard->cs_hand_hot;
+    if (hot == NULL) {
+        entry->ce_prev = entry;
+        entry->ce_next = entry;
+        shard->cs_hand_hot = entry;
+        shard->cs_hand_cold = entry;
+        shard->cs_hand_test = entry;
+        return;
+    }
+
+    entry->ce_next = hot;
+    entry->ce_prev = hot->ce_prev;
+    hot->ce_prev->ce_next = entry;
+    hot->ce_prev = entry;
+    if (shard->cs_hand_cold == hot) {
+        shard->cs_hand_cold = entry;
+    }
+}
+
+/**
+ * Take an entry off the clock; the hands pointing at it step back.
+ */
+static void clock_remove(cache_shard_t *shard, cache_entry_t *entry) {
+    if (entry->ce_next == entry) {
+        shard->cs_hand_hot = NULL;
+        shard->cs_hand_cold = NULL;
+        shard->cs_hand_test = NULL;
+        return;
+    }
+
+    if (shard->cs_hand_hot == entry) {
+        shard->cs_hand_hot = entry->ce_prev;
+    }
+    if (shard->cs_hand_cold == entry) {
+        shard->cs_hand_cold = entry->ce_prev;
+    }
+    if (shard->cs_hand_test == entry) {
+        shard->cs_hand_test = entry->ce_prev;
+    }
+    entry->ce_prev->ce_next = entry->ce_next;
+    entry->ce_next->ce_prev = entry->ce_prev;
+}
+
+static void run_hand_cold(cache_shard_t *shard);
+
+static void run_hand_test(cache_shard_t *shard) {
+    if (shard->cs_hand_test == shard->cs_hand_cold) {
+        run_hand_cold(shard);
+    }
+
+    cache_entry_t *entry = shard->cs_hand_test;
+    if (entry->ce_type == CE_TEST) {
+        // its test period ends without a reuse
+        shard->cs_hand_test = entry->ce_prev;
+        clock_remove(shard, entry);
+        cache_unchain(shard, entry);
+        free(entry);
+        shard->cs_test--;
+        if (shard->cs_cold_target > 1) {
+            shard->cs_cold_target--;
+        }
+    }
+    shard->cs_hand_test = shard->cs_hand_test->ce_next;
+}
+
+static void run_hand_hot(cache_shard_t *shard) {
+    if (shard->cs_hand_hot == shard->cs_hand_test) {
+        run_hand_test(shard);
+    }
+
+    cache_entry_t *entry = shard->cs_hand_hot;
+    if (entry->ce_type == CE_HOT) {
+        if (entry->ce_ref) {
+            entry->ce_ref = false;
+        } else {
+            entry->ce_type = CE_COLD;
+            shard->cs_hot--;
+            shard->cs_cold++;
+        }
+    }
+    shard->cs_hand_hot = shard->cs_hand_hot->ce_next;
+}
+
+static void run_hand_cold(cache_shard_t *shard) {
+    cache_entry_t *entry = shard->cs_hand_cold;
+    if (entry->ce_type == CE_COLD) {
+        if (entry->ce_ref) {
+            entry->ce_type = CE_HOT;
+            entry->ce_ref = false;
+            shard->cs_cold--;
+            shard->cs_hot++;
+        } else if (entry->ce_pins == 0 && !entry->ce_dirty) {
+            // evicted, into its test period
+            entry->ce_type = CE_TEST;
+            shard->cs_free[shard->cs_free_count++] = entry->ce_data;
+            entry->ce_data = NULL;
+            shard->cs_cold--;
+            shard->cs_test++;
+            while (shard->cs_test > shard->cs_capacity) {
+                run_hand_test(shard);
+            }
+        }
+    }
+    shard->cs_hand_cold = shard->cs_hand_cold->ce_next;
+
+    while (shard->cs_hot > shard->cs_capacity - shard->cs_cold_target) {
+        run_hand_hot(shard);
+    }
+}
+
+/**
+ * Free a buffer for a new resident block.
+ *
+ * Returns true if successful, false if every cold block is pinned or dirty.
+ */
+static bool cache_evict(cache_shard_t *shard) {
+    // a few turns of the clock: the hot blocks demoted on the way can be
+    // evicted in the next one
+    size_t steps = 3 * (shard->cs_hot + shard->cs_cold + shard->cs_test);
+    while (shard->cs_free_count == 0) {
+        if (steps-- == 0) {
+            if (shard->cs_dirty > 0) {
+                flusher_kick(); // clean blocks would do
+            }
+            return false;
+        }
+        run_hand_cold(shard);
+    }
+    return true;
+}
+
+/**
+ * Write back a cold block (of a locked shard) that only its being dirty keeps
+ * from eviction, pinned while the shard is unlocked for the write, and point
+ * hand_cold at it.
+ *
+ * Returns true if one was written back (the shard was unlocked meanwhile),
+ * false if there is none, or the write failed.
+ */
+static bool cache_write_back_cold(cache_shard_t *shard) {
+    cache_entry_t *start = shard->cs_hand_cold;
+    cache_entry_t *entry = start;
+    while (entry != NULL && !(entry->ce_type == CE_COLD &&
+                              entry->ce_pins == 0 && entry->ce_dirty)) {
+        entry = entry->ce_next != start ? entry->ce_next : NULL;
+    }
+    if (entry == NULL) {
+        return false;
+    }
+
+    // like the flusher: marked clean first, so that a change made during the
+    // write marks it dirty again
+    uint64_t dirtied = entry->ce_dirtied;
+    entry->ce_pins++;
+    cache_clear_dirty(shard, entry);
+    pthread_mutex_unlock(&shard->cs_lock);
+    int result = cache_device->write_block(cache_device, entry->ce_block, 1,
+                                           entry->ce_data);
+    pthread_mutex_lock(&shard->cs_lock);
+    entry->ce_pins--;
+    if (result != 0) {
+        cache_set_dirty(shard, entry, dirtied);
+        return false;
+    }
+    shard->cs_hand_cold = entry;
+    return true;
+}
+
+/**
+ * Add a missing block (to a locked shard), pinned and with invalid contents.
+ *
+ * Input:
+ *   - shard: the shard of the block
+ *   - block: the block number
+ *   - entry: the entry of the block, if in its test period, or NULL
+ *   - overflow: whether to use an overflow buffer when no block can be
+ *     evicted
+ *
+ * Returns the entry, or NULL if no block could be evicted (and !overflow).
+ */
+static cache_entry_t *cache_add(cache_shard_t *shard, size_t block,
+                                cache_entry_t *entry, bool overflow) {
+    cache_entry_type_t type = CE_COLD;
+    if (entry != NULL) {
+        // reused within its test period: it comes back as hot, and cold
+        // blocks get more room
+        if (shard->cs_cold_target < shard->cs_capacity) {
+            shard->cs_cold_target++;
+        }
+        clock_remove(shard, entry);
+        cache_unchain(shard, entry);
+        shard->cs_test--;
+        type = CE_HOT;
+    } else {
+        entry = malloc(sizeof(cache_entry_t));
+        ALWAYS_ASSERT(entry != NULL, "bcache_pin: failed to allocate entry");
+    }
+
+    entry->ce_block = block;
+    entry->ce_pins = 1;
+    entry->ce_ref = false;
+    entry->ce_valid = false;
+    entry->ce_dirty = false;
+    entry->ce_ahead = false;
+    if (cache_evict(shard)) {
+        entry->ce_type = type;
+        entry->ce_data = shard->cs_free[--shard->cs_free_count];
+        entry->ce_overflow = false;
+        clock_insert(shard, entry);
+        if (type == CE_HOT) {
+            shard->cs_hot++;
+        } else {
+            shard->cs_cold++;
+        }
+    } else if (overflow) {
+        entry->ce_type = CE_COLD;
+        entry->ce_data = malloc(cache_device->bd_block_size);
+        ALWAYS_ASSERT(entry->ce_data != NULL,
+                      "bcache_pin: failed to allocate overflow buffer");
+        entry->ce_overflow = true;
+    } else {
+        free(entry);
+        return NULL;
+    }
+    cache_entry_t **chain = cache_chain(shard, block);
+    entry->ce_hash_next = *chain;
+    *chain = entry;
+    return entry;
+}
+
+/**
+ * Pin a block, adding it to the cache if missing.
+ *
+ * Input:
+ *   - block: the block number
+ *   - valid: set to whether the contents are there; if not, the caller must
+ *     read the block (or overwrite it entirely) and call bcache_ready
+ *
+ * Returns the buffer holding the block, until bcache_unpin.
+ */
+void *bcache_pin(size_t block, bool *valid) {
+    cache_shard_t *shard = cache_shard(block);
+    pthread_mutex_lock(&shard->cs_lock);
+
+    cache_entry_t *entry;
+    for (;;) {
+        entry = cache_find(shard, block);
+        if (entry != NULL && entry->ce_type != CE_TEST) {
+            shard->cs_hits++;
+            // the first use of a block read ahead is not a reuse
+            entry->ce_ref = !entry->ce_ahead;
+            entry->ce_ahead = false;
+            entry->ce_pins++;
+            while (!entry->ce_valid) {
+                pthread_cond_wait(&shard->cs_ready, &shard->cs_lock);
+            }
+            pthread_mutex_unlock(&shard->cs_lock);
+            *valid = true;
+            return entry->ce_data;
+        }
+        // rather than leave the block out of the cache for the flusher being
+        // behind, make room with a write-back (after which the block must be
+        // looked up again)
+        if (cache_evict(shard) || !cache_write_back_cold(shard)) {
+            break;
+        }
+    }
+
+    shard->cs_misses++;
+    // the eviction may have ended the test period of the block
+    entry = cache_find(shard, block);
+    entry = cache_add(shard, block, entry, true);
+    pthread_mutex_unlock(&shard->cs_lock);
+    *valid = false;
+    return entry->ce_data;
+}
+
+/**
+ * Mark a block pinned with invalid contents as filled, waking up the threads
+ * waiting for it.
+ */
+void bcache_ready(size_t block) {
+    cache_shard_t *shard = cache_shard(block);
+    pthread_mutex_lock(&shard->cs_lock);
+    cache_entry_t *entry = cache_find(shard, block);
+    ALWAYS_ASSERT(entry != NULL && entry->ce_pins > 0,
+                  "bcache_ready: block not pinned");
+    entry->ce_valid = true;
+    pthread_cond_broadcast(&shard->cs_ready);
+    pthread_mutex_unlock(&shard->cs_lock);
+}
+
+/**
+ * Release a pin on a block.
+ *
+ * Input:
+ *   - block: the block number
+ *   - dirty: whether the contents were changed through this pin, in which
+ *     case the block is left to the flusher (or, for an overflow buffer,
+ *     written back when the last pin is released)
+ */
+void bcache_unpin(size_t block, bool dirty) {
+    cache_shard_t *shard = cache_shard(block);
+    pthread_mutex_lock(&shard->cs_lock);
+    cache_entry_t *entry = cache_find(shard, block);
+    ALWAYS_ASSERT(entry != NULL && entry->ce_pins > 0 && entry->ce_valid,
+                  "bcache_unpin: block not pinned");
+
+    if (dirty) {
+        cache_set_dirty(shard, entry, now_ns());
+    }
+    while (entry->ce_overflow && entry->ce_pins == 1 && entry->ce_dirty) {
+        // still pinned while written, so that it cannot be dropped (and read
+        // again before the write is done); written again if someone changes
+        // it in the meantime
+        cache_clear_dirty(shard, entry);
+        pthread_mutex_unlock(&shard->cs_lock);
+        ALWAYS_ASSERT(cache_device->write_block(cache_device, block, 1,
+                                                entry->ce_data) == 0,
+                      "bcache_unpin: failed to write block");
+        pthread_mutex_lock(&shard->cs_lock);
+    }
+
+    if (--entry->ce_pins == 0 && entry->ce_overflow) {
+        cache_unchain(shard, entry);
+        free(entry->ce_data);
+        free(entry);
+    }
+    pthread_mutex_unlock(&shard->cs_lock);
+
+    if (dirty && atomic_load(&dirty_blocks) > dirty_limit) {
+        flusher_kick();
+    }
+}
+
+/**
+ * Forget the changes to blocks that no longer hold data (e.g. freed), so that
+ * they are not written back.
+ *
+ * Input:
+ *   - block: the first block number
+ *   - count: number of blocks
+ */
+void bcache_discard(size_t block, size_t count) {
+    for (size_t b = block; b < block + count; b++) {
+        cache_shard_t *shard = cache_shard(b);
+        pthread_mutex_lock(&shard->cs_lock);
+        cache_entry_t *entry = cache_find(shard, b);
+        if (entry != NULL && entry->ce_pins == 0) {
+            cache_clear_dirty(shard, entry);
+        }
+        pthread_mutex_unlock(&shard->cs_lock);
+    }
+}
+
+/*
+ * A dirty block picked for write-back (and pinned until written).
+ */
+typedef struct {
+    size_t fi_block;
+    char *fi_data;
+    uint64_t fi_dirtied;
+} flush_item_t;
+
+/**
+ * Pick a block (in a locked shard) for write-back, if it has been dirty since
+ * cutoff or earlier.
+ *
+ * Returns true if it was picked.
+ */
+static bool flush_pick(cache_shard_t *shard, cache_entry_t *entry,
+                       uint64_t cutoff, flush_item_t *item) {
+    if (!entry->ce_dirty || entry->ce_overflow || entry->ce_dirtied > cutoff) {
+        return false;
+    }
+    entry->ce_pins++;
+    *item = (flush_item_t){.fi_block = entry->ce_block,
+                           .fi_data = entry->ce_data,
+                           .fi_dirtied = entry->ce_dirtied};
+    cache_clear_dirty(shard, entry);
+    return true;
+}
+
+static int flush_item_cmp(void const *a, void const *b) {
+    size_t x = ((flush_item_t const *)a)->fi_block;
+    size_t y = ((flush_item_t const *)b)->fi_block;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Write back picked blocks, with one device transfer per run of adjacent
+ * blocks, and release them.
+ *
+ * Returns 0 if successful, -1 otherwise (the blocks are then dirty again).
+ */
+static int flush_items(flush_item_t *items, size_t n) {
+    size_t block_size = cache_device->bd_block_size;
+    qsort(items, n, sizeof(flush_item_t), flush_item_cmp);
+
+    // the runs are staged in one buffer, in the same order
+    char *staging = malloc(n * block_size);
+    block_io_t *ios = malloc(n * sizeof(block_io_t));
+    int result = -1;
+    if (staging != NULL && ios != NULL) {
+        size_t n_ios = 0;
+        for (size_t i = 0; i < n; i++) {
+            char *at = staging + i * block_size;
+            memcpy(at, items[i].fi_data, block_size);
+            if (i > 0 && items[i].fi_block == items[i - 1].fi_block + 1) {
+                ios[n_ios - 1].bio_count++;
+            } else {
+                ios[n_ios++] = (block_io_t){.bio_block = items[i].fi_block,
+                                            .bio_count = 1,
+                                            .bio_buffer = at,
+                                            .bio_write = true};
+            }
+        }
+        result = cache_device->submit(cache_device, ios, n_ios);
+    }
+    free(ios);
+    free(staging);
+
+    for (size_t i = 0; i < n; i++) {
+        cache_shard_t *shard = cache_shard(items[i].fi_block);
+        pthread_mutex_lock(&shard->cs_lock);
+        cache_entry_t *entry = cache_find(shard, items[i].fi_block);
+        if (result != 0) {
+            cache_set_dirty(shard, entry, items[i].fi_dirtied);
+        }
+        entry->ce_pins--;
+        pthread_mutex_unlock(&shard->cs_lock);
+    }
+    return result;
+}
+
+/**
+ * Write back up to BCACHE_FLUSH_BLOCKS blocks dirty since cutoff or earlier,
+ * from the whole cache.
+ *
+ * Returns the number of blocks written back, or -1 if the write failed.
+ */
+static ssize_t flush_pass(uint64_t cutoff) {
+    flush_item_t items[BCACHE_FLUSH_BLOCKS];
+    size_t n = 0;
+    for (size_t i = 0; i < shard_count && n < BCACHE_FLUSH_BLOCKS; i++) {
+        cache_shard_t *shard = &shards[i];
+        pthread_mutex_lock(&shard->cs_lock);
+        for (size_t c = 0; c < shard->cs_chain_count && shard->cs_dirty > 0 &&
+                           n < BCACHE_FLUSH_BLOCKS;
+             c++) {
+            for (cache_entry_t *e = shard->cs_chains[c];
+                 e != NULL && n < BCACHE_FLUSH_BLOCKS; e = e->ce_hash_next) {
+                if (flush_pick(shard, e, cutoff, &items[n])) {
+                    n++;
+                }
+            }
+        }
+        pthread_mutex_unlock(&shard->cs_lock);
+    }
+
+    if (n == 0) {
+        return 0;
+    }
+    return flush_items(items, n) == 0 ? (ssize_t)n : -1;
+}
+
+/**
+ * Write back every block dirty since now or earlier, waiting for the writes
+ * to complete (but not for them to reach the disk: see the device's flush).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int bcache_sync(void) {
+    uint64_t cutoff = now_ns();
+    ssize_t r;
+    while ((r = flush_pass(cutoff)) > 0) {
+    }
+    return r == 0 ? 0 : -1;
+}
+
+/**
+ * Write back the dirty blocks in a range, like bcache_sync.
+ *
+ * Input:
+ *   - block: the first block number
+ *   - count: number of blocks
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int bcache_sync_range(size_t block, size_t count) {
+    uint64_t cutoff = now_ns();
+    flush_item_t items[BCACHE_FLUSH_BLOCKS];
+    size_t n = 0;
+    int result = 0;
+
+    for (size_t b = block; b < block + count; b++) {
+        cache_shard_t *shard = cache_shard(b);
+        pthread_mutex_lock(&shard->cs_lock);
+        cache_entry_t *entry = cache_find(shard, b);
+        if (entry != NULL && flush_pick(shard, entry, cutoff, &items[n])) {
+            n++;
+        }
+        pthread_mutex_unlock(&shard->cs_lock);
+
+        if (n == BCACHE_FLUSH_BLOCKS || (n > 0 && b + 1 == block + count)) {
+            if (flush_items(items, n) != 0) {
+                result = -1;
+            }
+            n = 0;
+        }
+    }
+    return result;
+}
+
+/**
+ * Read ahead the blocks of a range missing from the cache, in the background.
+ *
+ * Input:
+ *   - block: the first block number
+ *   - count: number of blocks
+ */
+void bcache_readahead(size_t block, size_t count) {
+    pthread_mutex_lock(&reader_lock);
+    size_t queued = readahead_count;
+    for (size_t b = block;
+         b < block + count && readahead_count < BCACHE_READAHEAD_QUEUE; b++) {
+        cache_shard_t *shard = cache_shard(b);
+        pthread_mutex_lock(&shard->cs_lock);
+        cache_entry_t *entry = cache_find(shard, b);
+        if (entry == NULL || entry->ce_type == CE_TEST) {
+            entry = cache_add(shard, b, entry, false);
+        } else {
+            entry = NULL; // already there (or on its way)
+        }
+        if (entry != NULL) {
+            entry->ce_ahead = true;
+            shard->cs_readahead++;
+            size_t tail =
+                (readahead_head + readahead_count) % BCACHE_READAHEAD_QUEUE;
+            readahead_queue[tail] = b;
+            readahead_count++;
+        }
+        pthread_mutex_unlock(&shard->cs_lock);
+    }
+    if (readahead_count > queued) {
+        pthread_cond_signal(&reader_wake);
+    }
+    pthread_mutex_unlock(&reader_lock);
+}
+
+/**
+ * Read blocks pinned by bcache_readahead, with a single device batch, and
+ * release them.
+ */
+static void readahead_items(size_t const *blocks, size_t n) {
+    block_io_t ios[BCACHE_BATCH_BLOCKS];
+    for (size_t i = 0; i < n; i++) {
+        cache_shard_t *shard = cache_shard(blocks[i]);
+        pthread_mutex_lock(&shard->cs_lock);
+        cache_entry_t *entry = cache_find(shard, blocks[i]);
+        pthread_mutex_unlock(&shard->cs_lock);
+        ALWAYS_ASSERT(entry != NULL, "bcache_readahead: block not pinned");
+        ios[i] = (block_io_t){.bio_block = blocks[i],
+                              .bio_count = 1,
+                              .bio_buffer = entry->ce_data,
+                              .bio_write = false};
+    }
+
+    cache_device->access(cache_device); // the latency the readers are spared
+    ALWAYS_ASSERT(cache_device->submit(cache_device, ios, n) == 0,
+                  "bcache_readahead: failed to read blocks");
+    for (size_t i = 0; i < n; i++) {
+        bcache_ready(blocks[i]);
+        bcache_unpin(blocks[i], false);
+    }
+}
+
+static void *reader_main(void *arg) {
+    (void)arg;
+    size_t blocks[BCACHE_BATCH_BLOCKS];
+    pthread_mutex_lock(&reader_lock);
+    for (;;) {
+        while (readahead_count == 0 && !reader_stopping) {
+            pthread_cond_wait(&reader_wake, &reader_lock);
+        }
+        if (readahead_count == 0) {
+            break; // stopping, with nothing left pinned
+        }
+        size_t n = 0;
+        while (n < BCACHE_BATCH_BLOCKS && readahead_count > 0) {
+            blocks[n++] = readahead_queue[readahead_head];
+            readahead_head = (readahead_head + 1) % BCACHE_READAHEAD_QUEUE;
+            readahead_count--;
+        }
+        pthread_mutex_unlock(&reader_lock);
+        readahead_items(blocks, n);
+        pthread_mutex_lock(&reader_lock);
+    }
+    pthread_mutex_unlock(&reader_lock);
+    return NULL;
+}
+
+static void *flusher_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&flusher_lock);
+    while (!flusher_stopping) {
+        if (!flusher_kicked) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long)BCACHE_FLUSH_INTERVAL_MS * 1000000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            pthread_cond_timedwait(&flusher_wake, &flusher_lock, &deadline);
+        }
+        flusher_kicked = false;
+        if (flusher_stopping) {
+            break;
+        }
+        pthread_mutex_unlock(&flusher_lock);
+
+        // over the ratio, down to half of it; then, whatever is too old
+        if (atomic_load(&dirty_blocks) > dirty_limit) {
+            while (atomic_load(&dirty_blocks) > dirty_limit / 2 &&
+                   flush_pass(now_ns()) > 0) {
+            }
+        }
+        uint64_t now = now_ns();
+        uint64_t age = (uint64_t)BCACHE_DIRTY_AGE_MS * 1000000;
+        if (now > age) {
+            while (flush_pass(now - age) > 0) {
+            }
+        }
+
+        pthread_mutex_lock(&flusher_lock);
+    }
+    pthread_mutex_unlock(&flusher_lock);
+    return NULL;
+}
+
+/**
+ * Add up the statistics of the shards.
+ */
+void bcache_stats(tfs_cache_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (size_t i = 0; i < shard_count; i++) {
+        cache_shard_t *shard = &shards[i];
+        pthread_mutex_lock(&shard->cs_lock);
+        stats->cs_hits += shard->cs_hits;
+        stats->cs_misses += shard->cs_misses;
+        stats->cs_readahead += shard->cs_readahead;
+        stats->cs_resident += shard->cs_hot + shard->cs_cold;
+        stats->cs_dirty += shard->cs_dirty;
+        stats->cs_capacity += shard->cs_capacity;
+        pthread_mutex_unlock(&shard->cs_lock);
+    }
+}
+
+/**
+ * Initialize the buffer cache.
+ *
+ * Input:
+ *   - dev: the device holding the blocks (its buffers are registered with
+ *     it)
+ *   - capacity: number of blocks kept in memory
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - malloc failure.
+ */
+int bcache_init(block_device_t *dev, size_t capacity) {
+    size_t block_size = dev->bd_block_size;
+
+    // as many shards as the budget allows, each with a useful share of it
+    shard_count = 1;
+    while (shard_count < BCACHE_SHARDS &&
+           capacity / (shard_count * 2) >= BCACHE_SHARD_MIN_BLOCKS) {
+        shard_count *= 2;
+    }
+    size_t per_shard = (capacity + shard_count - 1) / shard_count;
+    if (per_shard < 2) {
+        per_shard = 2; // a hot block and a cold one
+    }
+
+    // one arena for every buffer, so that it can be registered at once
+    size_t arena_size = shard_count * per_shard * block_size;
+    arena_size = (arena_size + BCACHE_ARENA_ALIGN - 1) / BCACHE_ARENA_ALIGN *
+                 BCACHE_ARENA_ALIGN;
+    arena = aligned_alloc(BCACHE_ARENA_ALIGN, arena_size);
+    shards = calloc(shard_count, sizeof(cache_shard_t));
+    if (arena == NULL || shards == NULL) {
+        free(arena);
+        free(shards);
+        arena = NULL;
+        shards = NULL;
+        return -1;
+    }
+    cache_device = dev;
+    dev->register_buffers(dev, arena, arena_size); // only an optimization
+
+    size_t chains = 1;
+    while (chains < 2 * per_shard) {
+        chains *= 2;
+    }
+    for (size_t i = 0; i < shard_count; i++) {
+        cache_shard_t *shard = &shards[i];
+        pthread_mutex_init(&shard->cs_lock, NULL);
+        pthread_cond_init(&shard->cs_ready, NULL);
+        shard->cs_chains = calloc(chains, sizeof(cache_entry_t *));
+        shard->cs_chain_count = chains;
+        shard->cs_capacity = per_shard;
+        shard->cs_cold_target = per_shard / 2;
+        shard->cs_free = malloc(per_shard * sizeof(char *));
+        ALWAYS_ASSERT(shard->cs_chains != NULL && shard->cs_free != NULL,
+                      "bcache_init: failed to allocate shard");
+        for (size_t b = 0; b < per_shard; b++) {
+            shard->cs_free[b] = arena + (i * per_shard + b) * block_size;
+        }
+        shard->cs_free_count = per_shard;
+    }
+
+    atomic_init(&dirty_blocks, 0);
+    dirty_limit = shard_count * per_shard * BCACHE_DIRTY_RATIO / 100;
+    flusher_kicked = false;
+    flusher_stopping = false;
+    flusher_running =
+        pthread_create(&flusher, NULL, flusher_main, NULL) == 0;
+    readahead_head = 0;
+    readahead_count = 0;
+    reader_stopping = false;
+    reader_running = pthread_create(&reader, NULL, reader_main, NULL) == 0;
+    if (!flusher_running || !reader_running) {
+        bcache_destroy();
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Destroy the buffer cache, which must have no block pinned, after writing
+ * back the dirty blocks.
+ *
+ * Returns 0 if successful, -1 if the write-back failed.
+ */
+int bcache_destroy(void) {
+    if (reader_running) {
+        // after reading what is queued, which is still pinned
+        pthread_mutex_lock(&reader_lock);
+        reader_stopping = true;
+        pthread_cond_signal(&reader_wake);
+        pthread_mutex_unlock(&reader_lock);
+        pthread_join(reader, NULL);
+        reader_running = false;
+    }
+    if (flusher_running) {
+        pthread_mutex_lock(&flusher_lock);
+        flusher_stopping = true;
+        pthread_cond_signal(&flusher_wake);
+        pthread_mutex_unlock(&flusher_lock);
+        pthread_join(flusher, NULL);
+        flusher_running = false;
+    }
+    int result = bcache_sync();
+
+    for (size_t i = 0; i < shard_count; i++) {
+        cache_shard_t *shard = &shards[i];
+        for (size_t c = 0; c < shard->cs_chain_count; c++) {
+            cache_entry_t *entry = shard->cs_chains[c];
+            while (entry != NULL) {
+                ALWAYS_ASSERT(entry->ce_pins == 0,
+                              "bcache_destroy: block still pinned");
+                cache_entry_t *next = entry->ce_hash_next;
+                free(entry);
+                entry = next;
+            }
+        }
+        free(shard->cs_chains);
+        free(shard->cs_free);
+        pthread_cond_destroy(&shard->cs_ready);
+        pthread_mutex_destroy(&shard->cs_lock);
+    }
+    free(shards);
+    free(arena);
+    shards = NULL;
+    arena = NULL;
+    shard_count = 0;
+    cache_device = NULL;
+    return result;
+}
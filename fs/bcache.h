@@ -0,0 +1,29 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "blockdev.h"
+#include "operations.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Buffer cache: a bounded set of data blocks kept in memory, in front of a
+ * block device that cannot be mapped. Blocks are pinned while in use, and
+ * replaced with CLOCK-Pro when unpinned. Changes are written back by a
+ * background flusher, and blocks can be read ahead by a background reader.
+ */
+
+int bcache_init(block_device_t *dev, size_t capacity);
+int bcache_destroy(void);
+
+void *bcache_pin(size_t block, bool *valid);
+void bcache_ready(size_t block);
+void bcache_unpin(size_t block, bool dirty);
+void bcache_discard(size_t block, size_t count);
+void bcache_readahead(size_t block, size_t count);
+int bcache_sync(void);
+int bcache_sync_range(size_t block, size_t count);
+void bcache_stats(tfs_cache_stats_t *stats);
+
+#endif // BCACHE_H
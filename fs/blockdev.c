@@ -0,0 +1,695 @@
+// pwritev and copy_file_range are extensions (BSD and Linux, respectively)
+#define _GNU_SOURCE
+
+#include "blockdev.h"
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Do nothing, while preventing the compiler from performing any optimizations.
+ *
+ * We need to defeat the optimizer for the blockdev_busy_delay() function.
+ * Under optimization, the empty loop would be completely optimized away.
+ * This function tells the compiler that the assembly code being run (which is
+ * none) might potentially change *all memory in the process*.
+ *
+ * This prevents the optimizer from optimizing this code away, because it does
+ * not know what it does and it may have side effects.
+ *
+ * Reference with more information: https://youtu.be/nXaxk27zwlk?t=2775
+ *
+ * Exercise: try removing this function and look at the assembly generated to
+ * compare.
+ */
+static void touch_all_memory(void) { __asm volatile("" : : : "memory"); }
+
+/**
+ * Artifically delay execution (busy loop).
+ *
+ * Used by the devices without a latency model, as a way of emulating access
+ * latencies as if the FS data structures were really stored in secondary
+ * memory.
+ */
+void blockdev_busy_delay(block_device_t *dev) {
+    (void)dev;
+    for (int i = 0; i < DELAY; i++) {
+        touch_all_memory();
+    }
+}
+
+/**
+ * Perform a batch of transfers one after the other, for devices that gain
+ * nothing from batching.
+ */
+int blockdev_submit_each(block_device_t *dev, block_io_t *ios, size_t n) {
+    int result = 0;
+    for (size_t i = 0; i < n; i++) {
+        block_io_t *io = &ios[i];
+        int r = io->bio_write ? dev->write_block(dev, io->bio_block,
+                                                 io->bio_count, io->bio_buffer)
+                              : dev->read_block(dev, io->bio_block,
+                                                io->bio_count, io->bio_buffer);
+        if (r != 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+/**
+ * Ignore the buffers registered with a device that has no use for them.
+ */
+int blockdev_no_buffers(block_device_t *dev, void *base, size_t len) {
+    (void)dev;
+    (void)base;
+    (void)len;
+    return 0;
+}
+
+/**
+ * Transfer bytes between a buffer and a file with pread/pwrite, retrying
+ * after short transfers and interruptions.
+ *
+ * Returns 0 if successful, -1 otherwise (including if the file is shorter).
+ */
+int blockdev_file_io(int fd, off_t pos, void *buffer, size_t len,
+                     bool is_write) {
+    char *buf = buffer;
+    while (len > 0) {
+        ssize_t r =
+            is_write ? pwrite(fd, buf, len, pos) : pread(fd, buf, len, pos);
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        buf += r;
+        len -= (size_t)r;
+        pos += r;
+    }
+    return 0;
+}
+
+/**
+ * Copy ranges of blocks stored in a file (block 0 at offset) to another file,
+ * with copy_file_range, so that the bytes never leave the kernel. Where the
+ * kernel cannot (e.g. across file systems), they go through a buffer instead.
+ *
+ * Returns 0 if successful, -1 otherwise (with errno set).
+ */
+int blockdev_file_copy_out(int fd, off_t offset, size_t block_size,
+                           block_copy_t const *ranges, size_t n, int out,
+                           off_t out_pos) {
+    char *buffer = NULL;
+    int result = 0;
+    for (size_t i = 0; i < n && result == 0; i++) {
+        off_t pos = offset + (off_t)(ranges[i].bc_block * block_size +
+                                     ranges[i].bc_within);
+        size_t len = ranges[i].bc_len;
+        while (len > 0 && buffer == NULL) {
+            ssize_t r = copy_file_range(fd, &pos, out, &out_pos, len, 0);
+            if (r > 0) {
+                len -= (size_t)r;
+            } else if (r == -1 && errno == EINTR) {
+                continue;
+            } else if (r == -1 && (errno == EXDEV || errno == EINVAL ||
+                                   errno == ENOSYS || errno == EOPNOTSUPP)) {
+                buffer = malloc(COPY_CHUNK_SIZE);
+                if (buffer == NULL) {
+                    return -1;
+                }
+            } else {
+                if (r == 0) {
+                    errno = EIO; // the image is shorter than its blocks
+                }
+                result = -1;
+                break;
+            }
+        }
+
+        while (len > 0 && result == 0) {
+            size_t chunk = len < COPY_CHUNK_SIZE ? len : COPY_CHUNK_SIZE;
+            if (blockdev_file_io(fd, pos, buffer, chunk, false) != 0 ||
+                blockdev_file_io(out, out_pos, buffer, chunk, true) != 0) {
+                result = -1;
+            }
+            pos += (off_t)chunk;
+            out_pos += (off_t)chunk;
+            len -= chunk;
+        }
+    }
+    free(buffer);
+    return result;
+}
+
+/*
+ * In-memory device, over a caller-owned region (malloc'ed, or the mapped
+ * image).
+ */
+typedef struct {
+    block_device_t dev;
+    char *data;
+} ram_device_t;
+
+static int ram_read_block(block_device_t *dev, size_t block, size_t count,
+                          void *buffer) {
+    ram_device_t *ram = (ram_device_t *)dev;
+    memcpy(buffer, ram->data + block * dev->bd_block_size,
+           count * dev->bd_block_size);
+    return 0;
+}
+
+static int ram_write_block(block_device_t *dev, size_t block, size_t count,
+                           void const *buffer) {
+    ram_device_t *ram = (ram_device_t *)dev;
+    memcpy(ram->data + block * dev->bd_block_size, buffer,
+           count * dev->bd_block_size);
+    return 0;
+}
+
+static int ram_flush(block_device_t *dev) {
+    (void)dev; // the owner of the region syncs it (see state_sync)
+    return 0;
+}
+
+static int ram_discard(block_device_t *dev, size_t block, size_t count) {
+    (void)dev;
+    (void)block;
+    (void)count;
+    return 0;
+}
+
+static void *ram_map(block_device_t *dev, size_t block) {
+    ram_device_t *ram = (ram_device_t *)dev;
+    return ram->data + block * dev->bd_block_size;
+}
+
+static int ram_copy_out(block_device_t *dev, block_copy_t const *ranges,
+                        size_t n, int out, off_t out_pos) {
+    ram_device_t *ram = (ram_device_t *)dev;
+    struct iovec iov[TFS_IOV_MAX];
+    size_t i = 0;
+    while (i < n) {
+        // gather as many ranges as a single pwritev takes
+        int count = 0;
+        for (; i < n && count < TFS_IOV_MAX; i++) {
+            char *run = ram->data + ranges[i].bc_block * dev->bd_block_size;
+            iov[count++] = (struct iovec){.iov_base = run + ranges[i].bc_within,
+                                          .iov_len = ranges[i].bc_len};
+        }
+
+        struct iovec *next = iov;
+        while (count > 0) {
+            ssize_t r = pwritev(out, next, count, out_pos);
+            if (r == -1 && errno == EINTR) {
+                continue;
+            }
+            if (r <= 0) {
+                return -1;
+            }
+            out_pos += r;
+            // skip what was written, which may end within a buffer
+            size_t done = (size_t)r;
+            while (count > 0 && done >= next->iov_len) {
+                done -= next->iov_len;
+                next++;
+                count--;
+            }
+            if (count > 0) {
+                next->iov_base = (char *)next->iov_base + done;
+                next->iov_len -= done;
+            }
+        }
+    }
+    return 0;
+}
+
+static void ram_destroy(block_device_t *dev) { free(dev); }
+
+/**
+ * Create an in-memory device.
+ *
+ * Input:
+ *   - data: the blocks (which remain owned by the caller)
+ *   - block_size: size of a block
+ *
+ * Returns the device, or NULL if malloc fails.
+ */
+block_device_t *blockdev_ram_create(void *data, size_t block_size) {
+    ram_device_t *ram = malloc(sizeof(ram_device_t));
+    if (ram == NULL) {
+        return NULL;
+    }
+    ram->dev = (block_device_t){.bd_block_size = block_size,
+                                .read_block = ram_read_block,
+                                .write_block = ram_write_block,
+                                .submit = blockdev_submit_each,
+                                .flush = ram_flush,
+                                .discard = ram_discard,
+                                .map = ram_map,
+                                .register_buffers = blockdev_no_buffers,
+                                .copy_out = ram_copy_out,
+                                .access = blockdev_busy_delay,
+                                .destroy = ram_destroy};
+    ram->data = data;
+    return &ram->dev;
+}
+
+/*
+ * File device: the blocks are stored in a file, from a given offset on, and
+ * accessed with pread/pwrite.
+ */
+typedef struct {
+    block_device_t dev;
+    int fd;
+    off_t offset;
+} file_device_t;
+
+static int file_read_block(block_device_t *dev, size_t block, size_t count,
+                           void *buffer) {
+    file_device_t *file = (file_device_t *)dev;
+    return blockdev_file_io(file->fd,
+                            file->offset + (off_t)(block * dev->bd_block_size),
+                            buffer, count * dev->bd_block_size, false);
+}
+
+static int file_write_block(block_device_t *dev, size_t block, size_t count,
+                            void const *buffer) {
+    file_device_t *file = (file_device_t *)dev;
+    return blockdev_file_io(file->fd,
+                            file->offset + (off_t)(block * dev->bd_block_size),
+                            (void *)buffer, count * dev->bd_block_size, true);
+}
+
+static int file_flush(block_device_t *dev) {
+    file_device_t *file = (file_device_t *)dev;
+    return fsync(file->fd);
+}
+
+static int file_discard(block_device_t *dev, size_t block, size_t count) {
+    // POSIX has no portable way of punching holes in a file
+    (void)dev;
+    (void)block;
+    (void)count;
+    return 0;
+}
+
+static void *file_map(block_device_t *dev, size_t block) {
+    (void)dev;
+    (void)block;
+    return NULL;
+}
+
+static int file_copy_out(block_device_t *dev, block_copy_t const *ranges,
+                         size_t n, int out, off_t out_pos) {
+    file_device_t *file = (file_device_t *)dev;
+    return blockdev_file_copy_out(file->fd, file->offset, dev->bd_block_size,
+                                  ranges, n, out, out_pos);
+}
+
+static void file_destroy(block_device_t *dev) {
+    file_device_t *file = (file_device_t *)dev;
+    close(file->fd);
+    free(file);
+}
+
+/**
+ * Create a file device.
+ *
+ * Input:
+ *   - fd: open file, which the device takes over (and closes when destroyed)
+ *   - offset: offset of block 0 in the file
+ *   - block_size: size of a block
+ *
+ * Returns the device, or NULL if malloc fails.
+ */
+block_device_t *blockdev_file_create(int fd, off_t offset, size_t block_size) {
+    file_device_t *file = malloc(sizeof(file_device_t));
+    if (file == NULL) {
+        return NULL;
+    }
+    file->dev = (block_device_t){.bd_block_size = block_size,
+                                 .read_block = file_read_block,
+                                 .write_block = file_write_block,
+                                 .submit = blockdev_submit_each,
+                                 .flush = file_flush,
+                                 .discard = file_discard,
+                                 .map = file_map,
+                                 .register_buffers = blockdev_no_buffers,
+                                 .copy_out = file_copy_out,
+                                 .access = blockdev_busy_delay,
+                                 .destroy = file_destroy};
+    file->fd = fd;
+    file->offset = offset;
+    return &file->dev;
+}
+
+/*
+ * Latency model: forwards every operation to a lower device, after waiting
+ * for a fixed latency per operation plus the time to transfer its bytes at a
+ * given bandwidth. The lower device is never mapped, so that every data
+ * access pays the model.
+ */
+typedef struct {
+    block_device_t dev;
+    block_device_t *lower;
+    uint64_t latency_ns;
+    uint64_t bandwidth; // bytes per second, 0 if unlimited
+} latency_device_t;
+
+/**
+ * Wait (sleeping) as long as the model takes to transfer a number of bytes.
+ */
+static void latency_wait(latency_device_t const *lat, size_t bytes,
+                         bool per_op) {
+    uint64_t ns = per_op ? lat->latency_ns : 0;
+    if (lat->bandwidth > 0) {
+        ns += (uint64_t)((double)bytes * 1e9 / (double)lat->bandwidth);
+    }
+    if (ns == 0) {
+        return;
+    }
+
+    struct timespec ts = {.tv_sec = (time_t)(ns / 1000000000),
+                          .tv_nsec = (long)(ns % 1000000000)};
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    }
+}
+
+static int latency_read_block(block_device_t *dev, size_t block, size_t count,
+                              void *buffer) {
+    latency_device_t *lat = (latency_device_t *)dev;
+    latency_wait(lat, count * dev->bd_block_size, false);
+    return lat->lower->read_block(lat->lower, block, count, buffer);
+}
+
+static int latency_write_block(block_device_t *dev, size_t block,
+                               size_t count, void const *buffer) {
+    latency_device_t *lat = (latency_device_t *)dev;
+    latency_wait(lat, count * dev->bd_block_size, false);
+    return lat->lower->write_block(lat->lower, block, count, buffer);
+}
+
+static int latency_submit(block_device_t *dev, block_io_t *ios, size_t n) {
+    latency_device_t *lat = (latency_device_t *)dev;
+    size_t blocks = 0;
+    for (size_t i = 0; i < n; i++) {
+        blocks += ios[i].bio_count;
+    }
+    latency_wait(lat, blocks * dev->bd_block_size, false);
+    return lat->lower->submit(lat->lower, ios, n);
+}
+
+static int latency_register_buffers(block_device_t *dev, void *base,
+                                    size_t len) {
+    latency_device_t *lat = (latency_device_t *)dev;
+    return lat->lower->register_buffers(lat->lower, base, len);
+}
+
+static int latency_flush(block_device_t *dev) {
+    latency_device_t *lat = (latency_device_t *)dev;
+    latency_wait(lat, 0, true);
+    return lat->lower->flush(lat->lower);
+}
+
+static int latency_discard(block_device_t *dev, size_t block, size_t count) {
+    latency_device_t *lat = (latency_device_t *)dev;
+    return lat->lower->discard(lat->lower, block, count);
+}
+
+static int latency_copy_out(block_device_t *dev, block_copy_t const *ranges,
+                            size_t n, int out, off_t out_pos) {
+    latency_device_t *lat = (latency_device_t *)dev;
+    size_t bytes = 0;
+    for (size_t i = 0; i < n; i++) {
+        bytes += ranges[i].bc_len;
+    }
+    latency_wait(lat, bytes, true);
+    return lat->lower->copy_out(lat->lower, ranges, n, out, out_pos);
+}
+
+static void *latency_map(block_device_t *dev, size_t block) {
+    (void)dev;
+    (void)block;
+    return NULL;
+}
+
+static void latency_access(block_device_t *dev) {
+    latency_wait((latency_device_t *)dev, 0, true);
+}
+
+static void latency_destroy(block_device_t *dev) {
+    latency_device_t *lat = (latency_device_t *)dev;
+    lat->lower->destroy(lat->lower);
+    free(lat);
+}
+
+/**
+ * Create a latency model device.
+ *
+ * Every access (to data or to metadata) waits latency_ns, and every transfer
+ * of data also waits for its bytes to go through at the given bandwidth.
+ *
+ * Input:
+ *   - lower: device holding the blocks, which the model takes over
+ *   - latency_ns: latency of an access, in nanoseconds
+ *   - bandwidth: bytes per second, or 0 for unlimited bandwidth
+ *
+ * Returns the device, or NULL if malloc fails.
+ */
+block_device_t *blockdev_latency_create(block_device_t *lower,
+                                        uint64_t latency_ns,
+                                        uint64_t bandwidth) {
+    latency_device_t *lat = malloc(sizeof(latency_device_t));
+    if (lat == NULL) {
+        return NULL;
+    }
+    lat->dev = (block_device_t){.bd_block_size = lower->bd_block_size,
+                                .read_block = latency_read_block,
+                                .write_block = latency_write_block,
+                                .submit = latency_submit,
+                                .flush = latency_flush,
+                                .discard = latency_discard,
+                                .map = latency_map,
+                                .register_buffers = latency_register_buffers,
+                                .copy_out = latency_copy_out,
+                                .access = latency_access,
+                                .destroy = latency_destroy};
+    lat->lower = lower;
+    lat->latency_ns = latency_ns;
+    lat->bandwidth = bandwidth;
+    return &lat->dev;
+}
+
+/*
+ * Thread pool device: like the file device, but the transfers of a batch are
+ * handed to a pool of worker threads, so that they run in parallel. This is
+ * the fallback of the io_uring device.
+ */
+typedef struct pool_batch {
+    size_t remaining;
+    int result;
+} pool_batch_t;
+
+typedef struct pool_op {
+    block_io_t *io;
+    pool_batch_t *batch;
+    struct pool_op *next;
+} pool_op_t;
+
+typedef struct {
+    block_device_t dev;
+    int fd;
+    off_t offset;
+    pthread_mutex_t lock;
+    pthread_cond_t work; // signaled when ops are queued (or on shutdown)
+    pthread_cond_t done; // signaled when a batch completes
+    pool_op_t *head;
+    pool_op_t *tail;
+    bool stopping;
+    pthread_t workers[BLOCKDEV_POOL_THREADS];
+} pool_device_t;
+
+static int pool_transfer(pool_device_t *pool, block_io_t const *io) {
+    size_t block_size = pool->dev.bd_block_size;
+    return blockdev_file_io(pool->fd,
+                            pool->offset + (off_t)(io->bio_block * block_size),
+                            io->bio_buffer, io->bio_count * block_size,
+                            io->bio_write);
+}
+
+static void *pool_worker(void *arg) {
+    pool_device_t *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->head == NULL && !pool->stopping) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->head == NULL) {
+            break; // stopping, with nothing left to do
+        }
+
+        pool_op_t *op = pool->head;
+        pool->head = op->next;
+        if (pool->head == NULL) {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        int r = pool_transfer(pool, op->io);
+
+        pthread_mutex_lock(&pool->lock);
+        if (r != 0) {
+            op->batch->result = -1;
+        }
+        if (--op->batch->remaining == 0) {
+            pthread_cond_broadcast(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static int pool_submit(block_device_t *dev, block_io_t *ios, size_t n) {
+    pool_device_t *pool = (pool_device_t *)dev;
+    if (n == 1) {
+        return pool_transfer(pool, &ios[0]); // no parallelism to gain
+    }
+
+    pool_op_t *ops = malloc(n * sizeof(pool_op_t));
+    if (ops == NULL) {
+        return blockdev_submit_each(dev, ios, n);
+    }
+    pool_batch_t batch = {.remaining = n, .result = 0};
+
+    pthread_mutex_lock(&pool->lock);
+    for (size_t i = 0; i < n; i++) {
+        ops[i] = (pool_op_t){.io = &ios[i], .batch = &batch, .next = NULL};
+        if (pool->tail == NULL) {
+            pool->head = &ops[i];
+        } else {
+            pool->tail->next = &ops[i];
+        }
+        pool->tail = &ops[i];
+    }
+    pthread_cond_broadcast(&pool->work);
+    while (batch.remaining > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    free(ops);
+    return batch.result;
+}
+
+static int pool_read_block(block_device_t *dev, size_t block, size_t count,
+                           void *buffer) {
+    block_io_t io = {.bio_block = block,
+                     .bio_count = count,
+                     .bio_buffer = buffer,
+                     .bio_write = false};
+    return pool_transfer((pool_device_t *)dev, &io);
+}
+
+static int pool_write_block(block_device_t *dev, size_t block, size_t count,
+                            void const *buffer) {
+    block_io_t io = {.bio_block = block,
+                     .bio_count = count,
+                     .bio_buffer = (void *)buffer,
+                     .bio_write = true};
+    return pool_transfer((pool_device_t *)dev, &io);
+}
+
+static int pool_flush(block_device_t *dev) {
+    return fsync(((pool_device_t *)dev)->fd);
+}
+
+static int pool_copy_out(block_device_t *dev, block_copy_t const *ranges,
+                         size_t n, int out, off_t out_pos) {
+    pool_device_t *pool = (pool_device_t *)dev;
+    return blockdev_file_copy_out(pool->fd, pool->offset, dev->bd_block_size,
+                                  ranges, n, out, out_pos);
+}
+
+static void pool_destroy(block_device_t *dev) {
+    pool_device_t *pool = (pool_device_t *)dev;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < BLOCKDEV_POOL_THREADS; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    close(pool->fd);
+    free(pool);
+}
+
+/**
+ * Create a thread pool device, with BLOCKDEV_POOL_THREADS workers.
+ *
+ * Input:
+ *   - fd: open file, which the device takes over (and closes when destroyed)
+ *   - offset: offset of block 0 in the file
+ *   - block_size: size of a block
+ *
+ * Returns the device, or NULL if malloc or the creation of a worker fails.
+ */
+block_device_t *blockdev_pool_create(int fd, off_t offset, size_t block_size) {
+    pool_device_t *pool = malloc(sizeof(pool_device_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->dev = (block_device_t){.bd_block_size = block_size,
+                                 .read_block = pool_read_block,
+                                 .write_block = pool_write_block,
+                                 .submit = pool_submit,
+                                 .flush = pool_flush,
+                                 .discard = file_discard,
+                                 .map = file_map,
+                                 .register_buffers = blockdev_no_buffers,
+                                 .copy_out = pool_copy_out,
+                                 .access = blockdev_busy_delay,
+                                 .destroy = pool_destroy};
+    pool->fd = fd;
+    pool->offset = offset;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->stopping = false;
+
+    for (size_t i = 0; i < BLOCKDEV_POOL_THREADS; i++) {
+        if (pthread_create(&pool->workers[i], NULL, pool_worker, pool) != 0) {
+            // stop the workers created so far
+            pthread_mutex_lock(&pool->lock);
+            pool->stopping = true;
+            pthread_cond_broadcast(&pool->work);
+            pthread_mutex_unlock(&pool->lock);
+            for (size_t j = 0; j < i; j++) {
+                pthread_join(pool->workers[j], NULL);
+            }
+            pthread_cond_destroy(&pool->done);
+            pthread_cond_destroy(&pool->work);
+            pthread_mutex_destroy(&pool->lock);
+            free(pool);
+            return NULL;
+        }
+    }
+    return &pool->dev;
+}
@@ -0,0 +1,86 @@
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Block device backends: where the data blocks live. Blocks are addressed by
+ * number and transferred in runs of whole blocks.
+ *
+ * Every operation returns 0 if successful and -1 otherwise.
+ */
+typedef struct block_device block_device_t;
+
+/**
+ * A transfer of a run of blocks, part of a batch.
+ */
+typedef struct {
+    size_t bio_block; // first block
+    size_t bio_count; // number of blocks
+    void *bio_buffer;
+    bool bio_write;
+} block_io_t;
+
+/**
+ * A range of bytes in a run of blocks, part of a copy out to a file.
+ */
+typedef struct {
+    size_t bc_block;  // first block of the run
+    size_t bc_within; // offset in the run where the range starts
+    size_t bc_len;
+} block_copy_t;
+
+struct block_device {
+    size_t bd_block_size;
+
+    // Read count blocks, starting at block, into buffer
+    int (*read_block)(block_device_t *dev, size_t block, size_t count,
+                      void *buffer);
+    // Write count blocks, starting at block, from buffer
+    int (*write_block)(block_device_t *dev, size_t block, size_t count,
+                       void const *buffer);
+    // Perform a batch of transfers (of distinct blocks), in any order and
+    // possibly in parallel, returning once all of them are done
+    int (*submit)(block_device_t *dev, block_io_t *ios, size_t n);
+    // Make every completed write durable
+    int (*flush)(block_device_t *dev);
+    // Tell the device that count blocks, starting at block, hold no data
+    int (*discard)(block_device_t *dev, size_t block, size_t count);
+    // Address of a block, for devices that live in memory (NULL otherwise):
+    // runs of blocks are then contiguous in memory too
+    void *(*map)(block_device_t *dev, size_t block);
+    // Tell the device that transfers will often use buffers in [base, base +
+    // len), so that it can set them up once (e.g. pin them) instead of on
+    // every transfer
+    int (*register_buffers)(block_device_t *dev, void *base, size_t len);
+    // Write ranges of blocks, one after the other, to the file out from
+    // out_pos on, without staging them in a user buffer where possible
+    int (*copy_out)(block_device_t *dev, block_copy_t const *ranges, size_t n,
+                    int out, off_t out_pos);
+    // Charge the cost of an access to the FS metadata kept on the device
+    void (*access)(block_device_t *dev);
+    void (*destroy)(block_device_t *dev);
+};
+
+block_device_t *blockdev_ram_create(void *data, size_t block_size);
+block_device_t *blockdev_file_create(int fd, off_t offset, size_t block_size);
+block_device_t *blockdev_pool_create(int fd, off_t offset, size_t block_size);
+block_device_t *blockdev_uring_create(int fd, off_t offset, size_t block_size);
+block_device_t *blockdev_latency_create(block_device_t *lower,
+                                        uint64_t latency_ns,
+                                        uint64_t bandwidth);
+
+// Helpers shared by the implementations
+int blockdev_submit_each(block_device_t *dev, block_io_t *ios, size_t n);
+int blockdev_no_buffers(block_device_t *dev, void *base, size_t len);
+void blockdev_busy_delay(block_device_t *dev);
+int blockdev_file_io(int fd, off_t pos, void *buffer, size_t len,
+                     bool is_write);
+int blockdev_file_copy_out(int fd, off_t offset, size_t block_size,
+                           block_copy_t const *ranges, size_t n, int out,
+                           off_t out_pos);
+
+#endif // BLOCKDEV_H
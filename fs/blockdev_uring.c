@@ -0,0 +1,418 @@
+// io_uring is Linux-specific: syscall() and the ring layout need GNU extensions
+#define _GNU_SOURCE
+
+#include "blockdev.h"
+#include "config.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+ * io_uring device: the image file, accessed through an io_uring instance.
+ *
+ * Every transfer, whether it comes from a batch or from a single
+ * read_block/write_block call, is queued on the shared submission ring. One of
+ * the waiting threads (the reaper) then submits everything queued so far -
+ * including the transfers of concurrent callers - with a single
+ * io_uring_enter, and hands out the completions. Transfers whose buffer lies
+ * in the registered region use the fixed-buffer opcodes, which spare the
+ * kernel from pinning the pages on every transfer.
+ *
+ * Transfers that fail or come back short are redone synchronously with
+ * pread/pwrite by their owner. If io_uring_enter itself fails for good, the
+ * ring is given up on: the transfers still on it, and every transfer from then
+ * on, are done that way.
+ */
+
+typedef struct uring_batch {
+    size_t remaining;
+} uring_batch_t;
+
+typedef struct {
+    block_io_t *io;
+    uring_batch_t *batch;
+    int32_t res;
+    bool reaped; // res is the outcome
+} uring_op_t;
+
+typedef struct {
+    block_device_t dev;
+    int fd;
+    off_t offset;
+    int ring_fd;
+
+    // ring memory, shared with the kernel
+    void *ring;
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned entries;
+
+    // everything below is protected by lock
+    pthread_mutex_t lock;
+    pthread_cond_t done; // signaled when the reaper hands out completions
+    unsigned in_flight;  // queued or submitted, not yet reaped
+    bool reaping;        // some thread is in io_uring_enter
+    int failed;          // errno of io_uring_enter, once it failed for good
+    char *fixed_base;    // registered buffer (NULL if none)
+    size_t fixed_len;
+} uring_device_t;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static bool uring_is_fixed(uring_device_t const *uring, block_io_t const *io,
+                           size_t len) {
+    char const *buf = io->bio_buffer;
+    return uring->fixed_base != NULL && buf >= uring->fixed_base &&
+           buf + len <= uring->fixed_base + uring->fixed_len;
+}
+
+/**
+ * Queue a transfer on the submission ring. The caller holds the lock and has
+ * made sure that the ring has room for it.
+ */
+static void uring_queue(uring_device_t *uring, uring_op_t *op) {
+    block_io_t *io = op->io;
+    size_t len = io->bio_count * uring->dev.bd_block_size;
+    bool fixed = uring_is_fixed(uring, io, len);
+
+    unsigned tail = *uring->sq_tail;
+    unsigned index = tail & *uring->sq_mask;
+    struct io_uring_sqe *sqe = &uring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    if (io->bio_write) {
+        sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    } else {
+        sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    }
+    sqe->fd = uring->fd;
+    sqe->off = (uint64_t)uring->offset +
+               (uint64_t)(io->bio_block * uring->dev.bd_block_size);
+    sqe->addr = (uint64_t)(uintptr_t)io->bio_buffer;
+    sqe->len = (uint32_t)len;
+    sqe->buf_index = 0;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    uring->sq_array[index] = index;
+
+    // the kernel must see the entry before the new tail
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring->in_flight++;
+}
+
+/**
+ * Hand out the completions available on the completion ring. The caller
+ * holds the lock.
+ */
+static void uring_reap(uring_device_t *uring) {
+    unsigned head = *uring->cq_head;
+    unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+        uring_op_t *op = (uring_op_t *)(uintptr_t)cqe->user_data;
+        op->res = cqe->res;
+        op->reaped = true;
+        op->batch->remaining--;
+        uring->in_flight--;
+    }
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int uring_submit(block_device_t *dev, block_io_t *ios, size_t n) {
+    uring_device_t *uring = (uring_device_t *)dev;
+    if (n == 0) {
+        return 0;
+    }
+
+    uring_op_t *ops = malloc(n * sizeof(uring_op_t));
+    if (ops == NULL) {
+        return blockdev_submit_each(dev, ios, n);
+    }
+    uring_batch_t batch = {.remaining = 0};
+
+    pthread_mutex_lock(&uring->lock);
+    size_t next = 0;
+    while (next < n || batch.remaining > 0) {
+        if (uring->failed != 0) {
+            // the ring is not entered again: our transfers still on it, and
+            // those not queued yet, are redone below
+            for (size_t i = 0; i < next; i++) {
+                if (!ops[i].reaped) {
+                    ops[i].res = -uring->failed;
+                    ops[i].reaped = true;
+                    batch.remaining--;
+                }
+            }
+            for (; next < n; next++) {
+                ops[next] = (uring_op_t){.io = &ios[next],
+                                         .batch = &batch,
+                                         .res = -uring->failed,
+                                         .reaped = true};
+            }
+            break;
+        }
+
+        // queue as many of our transfers as the ring has room for; keeping
+        // in_flight below the ring size also keeps the completion ring (twice
+        // as large) from overflowing
+        for (; next < n && uring->in_flight < uring->entries; next++) {
+            ops[next] = (uring_op_t){.io = &ios[next], .batch = &batch};
+            if (ios[next].bio_count * dev->bd_block_size > UINT32_MAX) {
+                ops[next].res = -EFBIG; // too large for an SQE
+                ops[next].reaped = true;
+                continue;
+            }
+            batch.remaining++;
+            uring_queue(uring, &ops[next]);
+        }
+        if (next == n && batch.remaining == 0) {
+            break; // only oversized transfers were left
+        }
+
+        if (uring->reaping) {
+            // the reaper will submit our transfers along with its own
+            pthread_cond_wait(&uring->done, &uring->lock);
+            continue;
+        }
+
+        // become the reaper: submit everything queued (by any thread) and wait
+        // for at least one completion
+        uring->reaping = true;
+        unsigned to_submit =
+            *uring->sq_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+        pthread_mutex_unlock(&uring->lock);
+
+        int error = 0;
+        while (sys_io_uring_enter(uring->ring_fd, to_submit, 1,
+                                  IORING_ENTER_GETEVENTS) == -1) {
+            if (errno == EBUSY) {
+                break; // the completions must be reaped first: retry after
+            } else if (errno != EINTR && errno != EAGAIN) {
+                error = errno;
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&uring->lock);
+        uring_reap(uring);
+        uring->failed = error;
+        uring->reaping = false;
+        pthread_cond_broadcast(&uring->done);
+    }
+    pthread_mutex_unlock(&uring->lock);
+
+    // redo failed and short transfers synchronously
+    int result = 0;
+    for (size_t i = 0; i < n; i++) {
+        block_io_t *io = &ios[i];
+        size_t len = io->bio_count * dev->bd_block_size;
+        if (ops[i].res >= 0 && (size_t)ops[i].res == len) {
+            continue;
+        }
+        if (blockdev_file_io(uring->fd,
+                             uring->offset +
+                                 (off_t)(io->bio_block * dev->bd_block_size),
+                             io->bio_buffer, len, io->bio_write) != 0) {
+            result = -1;
+        }
+    }
+
+    free(ops);
+    return result;
+}
+
+static int uring_read_block(block_device_t *dev, size_t block, size_t count,
+                            void *buffer) {
+    block_io_t io = {.bio_block = block,
+                     .bio_count = count,
+                     .bio_buffer = buffer,
+                     .bio_write = false};
+    return uring_submit(dev, &io, 1);
+}
+
+static int uring_write_block(block_device_t *dev, size_t block, size_t count,
+                             void const *buffer) {
+    block_io_t io = {.bio_block = block,
+                     .bio_count = count,
+                     .bio_buffer = (void *)buffer,
+                     .bio_write = true};
+    return uring_submit(dev, &io, 1);
+}
+
+static int uring_register_buffers(block_device_t *dev, void *base,
+                                  size_t len) {
+    uring_device_t *uring = (uring_device_t *)dev;
+    struct iovec iov = {.iov_base = base, .iov_len = len};
+
+    pthread_mutex_lock(&uring->lock);
+    if (uring->fixed_base != NULL) {
+        uring->fixed_base = NULL;
+        sys_io_uring_register(uring->ring_fd, IORING_UNREGISTER_BUFFERS, NULL,
+                              0);
+    }
+    int r = sys_io_uring_register(uring->ring_fd, IORING_REGISTER_BUFFERS,
+                                  &iov, 1);
+    if (r == 0) {
+        uring->fixed_base = base;
+        uring->fixed_len = len;
+    }
+    pthread_mutex_unlock(&uring->lock);
+
+    // without registration (e.g. over RLIMIT_MEMLOCK), transfers still work
+    return r == 0 ? 0 : -1;
+}
+
+static int uring_flush(block_device_t *dev) {
+    return fsync(((uring_device_t *)dev)->fd);
+}
+
+static int uring_discard(block_device_t *dev, size_t block, size_t count) {
+    (void)dev;
+    (void)block;
+    (void)count;
+    return 0;
+}
+
+static void *uring_map(block_device_t *dev, size_t block) {
+    (void)dev;
+    (void)block;
+    return NULL;
+}
+
+static int uring_copy_out(block_device_t *dev, block_copy_t const *ranges,
+                          size_t n, int out, off_t out_pos) {
+    uring_device_t *uring = (uring_device_t *)dev;
+    return blockdev_file_copy_out(uring->fd, uring->offset, dev->bd_block_size,
+                                  ranges, n, out, out_pos);
+}
+
+static void uring_unmap_rings(uring_device_t *uring) {
+    if (uring->sqes != NULL) {
+        munmap(uring->sqes, uring->sqes_size);
+    }
+    if (uring->ring != NULL) {
+        munmap(uring->ring, uring->ring_size);
+    }
+    close(uring->ring_fd);
+}
+
+static void uring_destroy(block_device_t *dev) {
+    uring_device_t *uring = (uring_device_t *)dev;
+    uring_unmap_rings(uring);
+    pthread_cond_destroy(&uring->done);
+    pthread_mutex_destroy(&uring->lock);
+    close(uring->fd);
+    free(uring);
+}
+
+/**
+ * Create an io_uring device, with a ring of BLOCKDEV_URING_ENTRIES entries.
+ *
+ * Input:
+ *   - fd: open file, which the device takes over (and closes when destroyed)
+ *   - offset: offset of block 0 in the file
+ *   - block_size: size of a block
+ *
+ * Returns the device, or NULL if io_uring is unavailable (in which case fd is
+ * left open, for a fallback device to use).
+ */
+block_device_t *blockdev_uring_create(int fd, off_t offset, size_t block_size) {
+    uring_device_t *uring = malloc(sizeof(uring_device_t));
+    if (uring == NULL) {
+        return NULL;
+    }
+    memset(uring, 0, sizeof(*uring));
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    uring->ring_fd = sys_io_uring_setup(BLOCKDEV_URING_ENTRIES, &p);
+    if (uring->ring_fd == -1) {
+        free(uring); // no io_uring (old kernel, seccomp, sysctl)
+        return NULL;
+    }
+
+    // map the rings, which recent kernels place in a single mapping
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(uring->ring_fd);
+        free(uring);
+        return NULL;
+    }
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    uring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    uring->ring = mmap(NULL, uring->ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+                       IORING_OFF_SQ_RING);
+    uring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+                       IORING_OFF_SQES);
+    if (uring->ring == MAP_FAILED || uring->sqes == MAP_FAILED) {
+        if (uring->ring == MAP_FAILED) {
+            uring->ring = NULL;
+        }
+        if (uring->sqes == MAP_FAILED) {
+            uring->sqes = NULL;
+        }
+        uring_unmap_rings(uring);
+        free(uring);
+        return NULL;
+    }
+
+    char *ring = uring->ring;
+    uring->sq_head = (unsigned *)(void *)(ring + p.sq_off.head);
+    uring->sq_tail = (unsigned *)(void *)(ring + p.sq_off.tail);
+    uring->sq_mask = (unsigned *)(void *)(ring + p.sq_off.ring_mask);
+    uring->sq_array = (unsigned *)(void *)(ring + p.sq_off.array);
+    uring->cq_head = (unsigned *)(void *)(ring + p.cq_off.head);
+    uring->cq_tail = (unsigned *)(void *)(ring + p.cq_off.tail);
+    uring->cq_mask = (unsigned *)(void *)(ring + p.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(void *)(ring + p.cq_off.cqes);
+    uring->entries = p.sq_entries;
+
+    uring->dev = (block_device_t){.bd_block_size = block_size,
+                                  .read_block = uring_read_block,
+                                  .write_block = uring_write_block,
+                                  .submit = uring_submit,
+                                  .flush = uring_flush,
+                                  .discard = uring_discard,
+                                  .map = uring_map,
+                                  .register_buffers = uring_register_buffers,
+                                  .copy_out = uring_copy_out,
+                                  .access = blockdev_busy_delay,
+                                  .destroy = uring_destroy};
+    uring->fd = fd;
+    uring->offset = offset;
+    pthread_mutex_init(&uring->lock, NULL);
+    pthread_cond_init(&uring->done, NULL);
+    return &uring->dev;
+}
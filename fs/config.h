@@ -8,4 +8,80 @@
 
 #define DELAY (5000)
 
+// Number of extents kept inline in an inode; further extents spill over into a
+// dedicated extent block
+#define INODE_DIRECT_EXTENTS (8)
+
+// Maximum depth of the hash of a directory: a directory holds at most
+// 2^DIR_MAX_DEPTH buckets (blocks)
+#define DIR_MAX_DEPTH (20)
+
+// Directory entry cache: number of shards, and entries per shard
+#define DCACHE_SHARDS (64)
+#define DCACHE_SHARD_ENTRIES (256)
+
+// Per-thread cache of free data blocks: capacity, and number of blocks moved
+// at once between a cache and the global free block bitmap
+#define BLOCK_MAGAZINE_SIZE (32)
+#define BLOCK_MAGAZINE_BATCH (16)
+
+// Open file table: maximum number of times it can grow (each chunk doubles its
+// size), and per-thread cache of closed handles (capacity, and number of
+// handles moved at once to the global free handle stack when it is full)
+#define OPEN_FILE_CHUNKS (24)
+#define OPEN_FILE_CACHE_SIZE (16)
+#define OPEN_FILE_CACHE_BATCH (8)
+
+// Block device backends over the image file: workers of the thread pool
+// backend, and entries of the io_uring submission queue
+#define BLOCKDEV_POOL_THREADS (4)
+#define BLOCKDEV_URING_ENTRIES (64)
+
+// Buffer cache (for block devices that cannot be mapped): shards, minimum
+// share of the budget for a shard to be added, blocks pinned at once by a
+// batched transfer, and alignment of the buffers
+#define BCACHE_SHARDS (16)
+#define BCACHE_SHARD_MIN_BLOCKS (16)
+#define BCACHE_BATCH_BLOCKS (64)
+#define BCACHE_ARENA_ALIGN (4096)
+
+// Write-back of the buffer cache: period of the flusher, age of the dirty
+// blocks it writes back, share of the cache (in percent) dirty enough to wake
+// it up, and blocks written back at once
+#define BCACHE_FLUSH_INTERVAL_MS (100)
+#define BCACHE_DIRTY_AGE_MS (1000)
+#define BCACHE_DIRTY_RATIO (25)
+#define BCACHE_FLUSH_BLOCKS (128)
+
+// Readahead of sequential reads: blocks read ahead at first (the window then
+// doubles with every sequential read, up to tfs_params.readahead_window), and
+// blocks queued at most for the reader thread of the buffer cache
+#define READAHEAD_MIN_BLOCKS (4)
+#define BCACHE_READAHEAD_QUEUE (512)
+
+// Bytes written at once when copying a file from outside TécnicoFS
+#define COPY_CHUNK_SIZE (1024 * 1024)
+
+// Bulk import of a host tree: files queued for the workers at most, workers
+// at most, and directories the walk keeps open at once
+#define IMPORT_QUEUE_SIZE (256)
+#define IMPORT_MAX_THREADS (64)
+#define IMPORT_WALK_FDS (32)
+
+// Latency histograms of tfs_stats (log-linear): 2^STATS_HIST_SUB_BITS buckets
+// for every power of two of nanoseconds, up to 2^STATS_HIST_MAX_BITS ns (and
+// one bucket per nanosecond below 2^STATS_HIST_SUB_BITS)
+#define STATS_HIST_SUB_BITS (3)
+#define STATS_HIST_MAX_BITS (40)
+#define STATS_HIST_BUCKETS                                                     \
+    ((STATS_HIST_MAX_BITS - STATS_HIST_SUB_BITS + 1) << STATS_HIST_SUB_BITS)
+
+// Lock profiler (built with TFS_LOCK_PROFILE): locks held at once by a thread
+// whose hold times are measured, and inodes listed in the contention report
+#define LOCKPROF_MAX_HELD (16)
+#define LOCKPROF_TOP_INODES (8)
+
+// Maximum number of buffers in a vectored read or write (IOV_MAX on Linux)
+#define TFS_IOV_MAX (1024)
+
 #endif // CONFIG_H
@@ -0,0 +1,201 @@
+#include "dcache.h"
+#include "betterassert.h"
+#include "config.h"
+#include "lockprof.h"
+#include "state.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The cache is split in DCACHE_SHARDS shards, each with its own lock, a fixed
+ * pool of DCACHE_SHARD_ENTRIES entries (replaced in FIFO order) and as many
+ * hash chains.
+ *
+ * Each shard also has a sequence number, bumped on every invalidation. A
+ * lookup that misses returns it, and the following insert (of what was found
+ * in the directory) is dropped if it changed in the meantime: otherwise, an
+ * entry removed from the directory between the two could be cached again.
+ */
+typedef struct dcache_entry {
+    int parent_inumber; // -1 if the entry is unused
+    int inumber;
+    uint32_t hash;
+    char name[MAX_FILE_NAME];
+    struct dcache_entry *next;
+} dcache_entry_t;
+
+typedef struct {
+    tfs_rwlock_t lock;
+    uint64_t seq;
+    size_t victim; // next entry to replace
+    dcache_entry_t *chains[DCACHE_SHARD_ENTRIES];
+    dcache_entry_t entries[DCACHE_SHARD_ENTRIES];
+} dcache_shard_t;
+
+static dcache_shard_t *shards;
+
+static uint32_t dcache_hash(int parent_inumber, char const *name) {
+    return name_hash(name) ^ ((uint32_t)parent_inumber * 2654435761u);
+}
+
+static dcache_shard_t *dcache_shard(uint32_t hash) {
+    return &shards[(hash >> 16) % DCACHE_SHARDS];
+}
+
+static dcache_entry_t **dcache_chain(dcache_shard_t *shard, uint32_t hash) {
+    return &shard->chains[hash % DCACHE_SHARD_ENTRIES];
+}
+
+/**
+ * Find an entry (in a locked shard).
+ */
+static dcache_entry_t *dcache_find(dcache_shard_t *shard, uint32_t hash,
+                                   int parent_inumber, char const *name) {
+    for (dcache_entry_t *entry = *dcache_chain(shard, hash); entry != NULL;
+         entry = entry->next) {
+        if (entry->hash == hash && entry->parent_inumber == parent_inumber &&
+            strncmp(entry->name, name, MAX_FILE_NAME) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Remove an entry from its chain (in a write-locked shard).
+ */
+static void dcache_unlink(dcache_shard_t *shard, dcache_entry_t *entry) {
+    dcache_entry_t **it = dcache_chain(shard, entry->hash);
+    while (*it != entry) {
+        it = &(*it)->next;
+    }
+    *it = entry->next;
+    entry->parent_inumber = -1;
+}
+
+/**
+ * Initialize the directory entry cache.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - malloc failure when allocating the cache.
+ */
+int dcache_init(void) {
+    shards = malloc(DCACHE_SHARDS * sizeof(dcache_shard_t));
+    if (shards == NULL) {
+        return -1;
+    }
+
+    for (size_t s = 0; s < DCACHE_SHARDS; s++) {
+        dcache_shard_t *shard = &shards[s];
+        tfs_rwlock_init(&shard->lock, LOCK_CLASS_DCACHE_SHARD);
+        shard->seq = 0;
+        shard->victim = 0;
+        for (size_t i = 0; i < DCACHE_SHARD_ENTRIES; i++) {
+            shard->chains[i] = NULL;
+            shard->entries[i].parent_inumber = -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Destroy the directory entry cache.
+ */
+void dcache_destroy(void) {
+    if (shards == NULL) {
+        return;
+    }
+    for (size_t s = 0; s < DCACHE_SHARDS; s++) {
+        tfs_rwlock_destroy(&shards[s].lock);
+    }
+    free(shards);
+    shards = NULL;
+}
+
+/**
+ * Look a name up in the cache.
+ *
+ * Input:
+ *   - parent_inumber: inumber of the directory
+ *   - name: name of the entry
+ *   - seq: receives the sequence number to pass to dcache_insert on a miss
+ *
+ * Returns the inumber of the entry, or -1 if it is not cached.
+ */
+int dcache_lookup(int parent_inumber, char const *name, uint64_t *seq) {
+    uint32_t hash = dcache_hash(parent_inumber, name);
+    dcache_shard_t *shard = dcache_shard(hash);
+
+    tfs_rwlock_rdlock(&shard->lock);
+    *seq = shard->seq;
+    dcache_entry_t *entry = dcache_find(shard, hash, parent_inumber, name);
+    int inumber = entry != NULL ? entry->inumber : -1;
+    tfs_rwlock_unlock(&shard->lock);
+    return inumber;
+}
+
+/**
+ * Cache a directory entry found after a miss.
+ *
+ * Input:
+ *   - parent_inumber: inumber of the directory
+ *   - name: name of the entry
+ *   - inumber: inumber the entry links to
+ *   - seq: sequence number returned by the dcache_lookup that missed
+ */
+void dcache_insert(int parent_inumber, char const *name, int inumber,
+                   uint64_t seq) {
+    uint32_t hash = dcache_hash(parent_inumber, name);
+    dcache_shard_t *shard = dcache_shard(hash);
+
+    tfs_rwlock_wrlock(&shard->lock);
+    if (shard->seq != seq ||
+        dcache_find(shard, hash, parent_inumber, name) != NULL) {
+        tfs_rwlock_unlock(&shard->lock);
+        return; // possibly stale, or already cached by another thread
+    }
+
+    dcache_entry_t *entry = &shard->entries[shard->victim];
+    shard->victim = (shard->victim + 1) % DCACHE_SHARD_ENTRIES;
+    if (entry->parent_inumber != -1) {
+        dcache_unlink(shard, entry);
+    }
+
+    entry->parent_inumber = parent_inumber;
+    entry->inumber = inumber;
+    entry->hash = hash;
+    strncpy(entry->name, name, MAX_FILE_NAME - 1);
+    entry->name[MAX_FILE_NAME - 1] = '\0';
+
+    dcache_entry_t **chain = dcache_chain(shard, hash);
+    entry->next = *chain;
+    *chain = entry;
+    tfs_rwlock_unlock(&shard->lock);
+}
+
+/**
+ * Drop a directory entry from the cache. Must be called whenever the entry is
+ * removed from its directory.
+ *
+ * Input:
+ *   - parent_inumber: inumber of the directory
+ *   - name: name of the entry
+ */
+void dcache_invalidate(int parent_inumber, char const *name) {
+    uint32_t hash = dcache_hash(parent_inumber, name);
+    dcache_shard_t *shard = dcache_shard(hash);
+
+    tfs_rwlock_wrlock(&shard->lock);
+    shard->seq++;
+    dcache_entry_t *entry = dcache_find(shard, hash, parent_inumber, name);
+    if (entry != NULL) {
+        dcache_unlink(shard, entry);
+    }
+    tfs_rwlock_unlock(&shard->lock);
+}
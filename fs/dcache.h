@@ -0,0 +1,19 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stdint.h>
+
+/*
+ * Directory entry cache: maps (parent directory inumber, name) to the inumber
+ * of the child, so that path walks do not search every directory on the way.
+ */
+
+int dcache_init(void);
+void dcache_destroy(void);
+
+int dcache_lookup(int parent_inumber, char const *name, uint64_t *seq);
+void dcache_insert(int parent_inumber, char const *name, int inumber,
+                   uint64_t seq);
+void dcache_invalidate(int parent_inumber, char const *name);
+
+#endif // DCACHE_H
@@ -0,0 +1,274 @@
+// nftw is an XSI extension
+#define _XOPEN_SOURCE 700
+
+#include "config.h"
+#include "operations.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+ * Bulk import of a host directory tree: one thread walks the tree with nftw,
+ * creating the directories (parents come before their entries) and queueing
+ * the regular files in a bounded queue; a pool of workers takes the files off
+ * the queue and copies each one with tfs_copy_from_external_fs, which reserves
+ * all of a file's blocks at once.
+ */
+
+/*
+ * A file to copy.
+ */
+typedef struct {
+    char *ij_host_path;
+    char *ij_tfs_path;
+    uint64_t ij_size;
+} import_job_t;
+
+typedef struct {
+    size_t im_host_len;
+    char const *im_tfs_dir;
+
+    pthread_mutex_t im_lock;
+    pthread_cond_t im_not_empty;
+    pthread_cond_t im_not_full;
+    import_job_t im_queue[IMPORT_QUEUE_SIZE];
+    size_t im_head;
+    size_t im_count;
+    bool im_walked; // no more jobs will be queued
+
+    tfs_import_stats_t im_stats;
+    int im_error; // errno of the first failure, 0 if none
+} import_t;
+
+// nftw has no room for a context: the walks of concurrent imports take turns
+static pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+static import_t *walking;
+
+static double seconds_since(struct timespec const *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) +
+           (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Record a failure (with the lock held).
+ */
+static void import_failed(import_t *im, int error) {
+    im->im_stats.is_failed++;
+    if (im->im_error == 0) {
+        im->im_error = error;
+    }
+}
+
+/**
+ * Map a path of the walk to its path in TécnicoFS.
+ *
+ * Returns the path (to be freed by the caller), or NULL if malloc fails.
+ */
+static char *tfs_path_of(import_t const *im, char const *host_path) {
+    char const *rel = host_path + im->im_host_len; // "" or "/..."
+    char const *base = strcmp(im->im_tfs_dir, "/") == 0 ? "" : im->im_tfs_dir;
+    size_t len = strlen(base) + strlen(rel) + 1;
+    char *path = malloc(len);
+    if (path != NULL) {
+        snprintf(path, len, "%s%s", base, rel);
+    }
+    return path;
+}
+
+static int import_visit(char const *fpath, struct stat const *sb, int type,
+                        struct FTW *ftw) {
+    import_t *im = walking;
+    if (ftw->level == 0) {
+        return 0; // the root maps to the existing tfs_dir
+    }
+
+    if (type != FTW_D && !(type == FTW_F && S_ISREG(sb->st_mode))) {
+        pthread_mutex_lock(&im->im_lock);
+        if (type == FTW_DNR || type == FTW_NS) {
+            import_failed(im, EACCES);
+        } else {
+            im->im_stats.is_skipped++; // symbolic links, devices, ...
+        }
+        pthread_mutex_unlock(&im->im_lock);
+        return 0;
+    }
+
+    char *tfs_path = tfs_path_of(im, fpath);
+    char *host_path = type == FTW_F ? strdup(fpath) : NULL;
+    if (tfs_path == NULL || (type == FTW_F && host_path == NULL)) {
+        free(tfs_path);
+        free(host_path);
+        pthread_mutex_lock(&im->im_lock);
+        import_failed(im, ENOMEM);
+        pthread_mutex_unlock(&im->im_lock);
+        return 0;
+    }
+
+    if (type == FTW_D) {
+        int r = tfs_mkdir(tfs_path);
+        int error = errno;
+        // a directory that is there already will do (not a file)
+        bool exists = false;
+        if (r == -1) {
+            int fh = tfs_open(tfs_path, 0);
+            if (fh != -1) {
+                tfs_close(fh);
+            } else {
+                exists = errno == EISDIR;
+            }
+        }
+        free(tfs_path);
+        pthread_mutex_lock(&im->im_lock);
+        if (r == 0) {
+            im->im_stats.is_dirs++;
+        } else if (!exists) {
+            import_failed(im, error);
+        }
+        pthread_mutex_unlock(&im->im_lock);
+        return 0;
+    }
+
+    pthread_mutex_lock(&im->im_lock);
+    while (im->im_count == IMPORT_QUEUE_SIZE) {
+        pthread_cond_wait(&im->im_not_full, &im->im_lock);
+    }
+    size_t tail = (im->im_head + im->im_count) % IMPORT_QUEUE_SIZE;
+    im->im_queue[tail] = (import_job_t){.ij_host_path = host_path,
+                                        .ij_tfs_path = tfs_path,
+                                        .ij_size = (uint64_t)sb->st_size};
+    im->im_count++;
+    pthread_cond_signal(&im->im_not_empty);
+    pthread_mutex_unlock(&im->im_lock);
+    return 0;
+}
+
+static void *import_worker(void *arg) {
+    import_t *im = arg;
+    pthread_mutex_lock(&im->im_lock);
+    for (;;) {
+        while (im->im_count == 0 && !im->im_walked) {
+            pthread_cond_wait(&im->im_not_empty, &im->im_lock);
+        }
+        if (im->im_count == 0) {
+            break;
+        }
+        import_job_t job = im->im_queue[im->im_head];
+        im->im_head = (im->im_head + 1) % IMPORT_QUEUE_SIZE;
+        im->im_count--;
+        pthread_cond_signal(&im->im_not_full);
+        pthread_mutex_unlock(&im->im_lock);
+
+        int r = tfs_copy_from_external_fs(job.ij_host_path, job.ij_tfs_path);
+        int error = errno;
+        free(job.ij_host_path);
+        free(job.ij_tfs_path);
+
+        pthread_mutex_lock(&im->im_lock);
+        if (r == 0) {
+            im->im_stats.is_files++;
+            im->im_stats.is_bytes += job.ij_size;
+        } else {
+            import_failed(im, error);
+        }
+    }
+    pthread_mutex_unlock(&im->im_lock);
+    return NULL;
+}
+
+int tfs_import_tree(char const *host_dir, char const *tfs_dir, int nthreads,
+                    tfs_import_stats_t *stats) {
+    STATS_SCOPE(TFS_OP_IMPORT_TREE);
+    if (host_dir == NULL || tfs_dir == NULL || tfs_dir[0] != '/' ||
+        nthreads < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (nthreads > IMPORT_MAX_THREADS) {
+        nthreads = IMPORT_MAX_THREADS;
+    }
+
+    import_t *im = calloc(1, sizeof(import_t));
+    if (im == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    // without trailing slashes, so that the walk's paths extend it
+    size_t host_len = strlen(host_dir);
+    while (host_len > 1 && host_dir[host_len - 1] == '/') {
+        host_len--;
+    }
+    char *root = strndup(host_dir, host_len);
+    if (root == NULL) {
+        free(im);
+        errno = ENOMEM;
+        return -1;
+    }
+    im->im_host_len = host_len;
+    im->im_tfs_dir = tfs_dir;
+    pthread_mutex_init(&im->im_lock, NULL);
+    pthread_cond_init(&im->im_not_empty, NULL);
+    pthread_cond_init(&im->im_not_full, NULL);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t workers[IMPORT_MAX_THREADS];
+    int started = 0;
+    while (started < nthreads &&
+           pthread_create(&workers[started], NULL, import_worker, im) == 0) {
+        started++;
+    }
+
+    int walk = -1;
+    int walk_error = EAGAIN; // no worker could be started
+    if (started > 0) {
+        pthread_mutex_lock(&walk_lock);
+        walking = im;
+        walk = nftw(root, import_visit, IMPORT_WALK_FDS, FTW_PHYS);
+        walk_error = errno;
+        walking = NULL;
+        pthread_mutex_unlock(&walk_lock);
+    }
+    double walk_seconds = seconds_since(&start);
+
+    pthread_mutex_lock(&im->im_lock);
+    im->im_walked = true;
+    pthread_cond_broadcast(&im->im_not_empty);
+    pthread_mutex_unlock(&im->im_lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    double total_seconds = seconds_since(&start);
+    im->im_stats.is_walk_seconds = walk_seconds;
+    im->im_stats.is_drain_seconds = total_seconds - walk_seconds;
+    im->im_stats.is_total_seconds = total_seconds;
+    im->im_stats.is_files_per_second =
+        total_seconds > 0 ? (double)im->im_stats.is_files / total_seconds : 0;
+    if (stats != NULL) {
+        *stats = im->im_stats;
+    }
+
+    int error = walk != 0 ? walk_error : im->im_error;
+    pthread_cond_destroy(&im->im_not_full);
+    pthread_cond_destroy(&im->im_not_empty);
+    pthread_mutex_destroy(&im->im_lock);
+    free(root);
+    free(im);
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
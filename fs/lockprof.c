@@ -0,0 +1,265 @@
+#include "lockprof.h"
+#include "config.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef TFS_LOCK_PROFILE
+
+/*
+ * Every lock has its own profile, and every class of locks the sum of those
+ * of its locks. An acquisition first tries the lock: only when that fails is
+ * it contended, and the wait timed. Hold times are measured from a small
+ * stack, per thread, of the locks it holds (a reader's hold is its own).
+ */
+
+typedef struct {
+    lock_profile_t const *hl_prof;
+    uint64_t hl_since;
+} held_lock_t;
+
+static char const *const class_names[LOCK_CLASS_COUNT] = {
+    [LOCK_CLASS_INODE] = "inode",
+    [LOCK_CLASS_DATA_BLOCKS] = "data_blocks",
+    [LOCK_CLASS_DCACHE_SHARD] = "dcache_shard",
+    [LOCK_CLASS_DIR_INDEX] = "dir_index_build",
+    [LOCK_CLASS_MAGAZINES] = "magazines",
+    [LOCK_CLASS_MAGAZINE] = "magazine",
+    [LOCK_CLASS_HANDLE_CACHES] = "handle_caches",
+    [LOCK_CLASS_HANDLE_CACHE] = "handle_cache",
+};
+
+static lock_profile_t classes[LOCK_CLASS_COUNT];
+static _Thread_local held_lock_t held[LOCKPROF_MAX_HELD];
+static _Thread_local size_t held_count;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void update_max(_Atomic uint64_t *max, uint64_t value) {
+    uint64_t seen = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > seen &&
+           !atomic_compare_exchange_weak_explicit(
+               max, &seen, value, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+static void profile_clear(lock_profile_t *prof, lock_class_t lock_class) {
+    prof->lp_class = lock_class;
+    atomic_init(&prof->lp_acquisitions, 0);
+    atomic_init(&prof->lp_contended, 0);
+    atomic_init(&prof->lp_wait_ns, 0);
+    atomic_init(&prof->lp_max_hold_ns, 0);
+}
+
+/**
+ * Account for an acquisition (of a lock now held by the caller), after
+ * waiting for wait_ns nanoseconds if contended.
+ */
+static void acquired(lock_profile_t *prof, bool contended, uint64_t wait_ns) {
+    lock_profile_t *cls = &classes[prof->lp_class];
+    atomic_fetch_add_explicit(&prof->lp_acquisitions, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cls->lp_acquisitions, 1, memory_order_relaxed);
+    if (contended) {
+        atomic_fetch_add_explicit(&prof->lp_contended, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&cls->lp_contended, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&prof->lp_wait_ns, wait_ns,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&cls->lp_wait_ns, wait_ns,
+                                  memory_order_relaxed);
+    }
+    // holds deeper than the stack go unmeasured
+    if (held_count < LOCKPROF_MAX_HELD) {
+        held[held_count++] = (held_lock_t){.hl_prof = prof,
+                                           .hl_since = now_ns()};
+    }
+}
+
+static void released(lock_profile_t *prof) {
+    for (size_t i = held_count; i-- > 0;) {
+        if (held[i].hl_prof == prof) {
+            uint64_t hold_ns = now_ns() - held[i].hl_since;
+            update_max(&prof->lp_max_hold_ns, hold_ns);
+            update_max(&classes[prof->lp_class].lp_max_hold_ns, hold_ns);
+            memmove(&held[i], &held[i + 1],
+                    (held_count - i - 1) * sizeof(held_lock_t));
+            held_count--;
+            return;
+        }
+    }
+}
+
+void tfs_rwlock_init(tfs_rwlock_t *lock, lock_class_t lock_class) {
+    pthread_rwlock_init(&lock->lk_rwlock, NULL);
+    profile_clear(&lock->lk_prof, lock_class);
+}
+
+void tfs_rwlock_destroy(tfs_rwlock_t *lock) {
+    pthread_rwlock_destroy(&lock->lk_rwlock);
+}
+
+void tfs_rwlock_rdlock(tfs_rwlock_t *lock) {
+    if (pthread_rwlock_tryrdlock(&lock->lk_rwlock) == 0) {
+        acquired(&lock->lk_prof, false, 0);
+        return;
+    }
+    uint64_t start = now_ns();
+    pthread_rwlock_rdlock(&lock->lk_rwlock);
+    acquired(&lock->lk_prof, true, now_ns() - start);
+    trace_lock_wait(start);
+}
+
+void tfs_rwlock_wrlock(tfs_rwlock_t *lock) {
+    if (pthread_rwlock_trywrlock(&lock->lk_rwlock) == 0) {
+        acquired(&lock->lk_prof, false, 0);
+        return;
+    }
+    uint64_t start = now_ns();
+    pthread_rwlock_wrlock(&lock->lk_rwlock);
+    acquired(&lock->lk_prof, true, now_ns() - start);
+    trace_lock_wait(start);
+}
+
+void tfs_rwlock_unlock(tfs_rwlock_t *lock) {
+    released(&lock->lk_prof);
+    pthread_rwlock_unlock(&lock->lk_rwlock);
+}
+
+void tfs_mutex_init(tfs_mutex_t *lock, lock_class_t lock_class) {
+    pthread_mutex_init(&lock->lk_mutex, NULL);
+    profile_clear(&lock->lk_prof, lock_class);
+}
+
+void tfs_mutex_destroy(tfs_mutex_t *lock) {
+    pthread_mutex_destroy(&lock->lk_mutex);
+}
+
+void tfs_mutex_lock(tfs_mutex_t *lock) {
+    if (pthread_mutex_trylock(&lock->lk_mutex) == 0) {
+        acquired(&lock->lk_prof, false, 0);
+        return;
+    }
+    uint64_t start = now_ns();
+    pthread_mutex_lock(&lock->lk_mutex);
+    acquired(&lock->lk_prof, true, now_ns() - start);
+    trace_lock_wait(start);
+}
+
+void tfs_mutex_unlock(tfs_mutex_t *lock) {
+    released(&lock->lk_prof);
+    pthread_mutex_unlock(&lock->lk_mutex);
+}
+
+/**
+ * Start the class profiles over (the profiles of the locks start over when
+ * they are initialized).
+ */
+void lockprof_reset(void) {
+    for (size_t c = 0; c < LOCK_CLASS_COUNT; c++) {
+        profile_clear(&classes[c], (lock_class_t)c);
+    }
+}
+
+static uint64_t load(_Atomic uint64_t const *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/**
+ * Order profiles by decreasing wait, then by decreasing contended
+ * acquisitions.
+ */
+static int compare_profiles(void const *a, void const *b) {
+    lock_profile_t const *x = *(lock_profile_t const *const *)a;
+    lock_profile_t const *y = *(lock_profile_t const *const *)b;
+    uint64_t xw = load(&x->lp_wait_ns), yw = load(&y->lp_wait_ns);
+    if (xw != yw) {
+        return xw < yw ? 1 : -1;
+    }
+    uint64_t xc = load(&x->lp_contended), yc = load(&y->lp_contended);
+    return (xc < yc) - (xc > yc);
+}
+
+static void report_row(FILE *out, char const *name,
+                       lock_profile_t const *prof) {
+    uint64_t acquisitions = load(&prof->lp_acquisitions);
+    uint64_t contended = load(&prof->lp_contended);
+    fprintf(out, "  %-16s %14llu %12llu %10.2f %12.3f %14.3f\n", name,
+            (unsigned long long)acquisitions, (unsigned long long)contended,
+            acquisitions > 0 ? 100.0 * (double)contended / (double)acquisitions
+                             : 0.0,
+            (double)load(&prof->lp_wait_ns) / 1e6,
+            (double)load(&prof->lp_max_hold_ns) / 1e3);
+}
+
+static void report_header(FILE *out, char const *first) {
+    fprintf(out, "  %-16s %14s %12s %10s %12s %14s\n", first, "acquisitions",
+            "contended", "contended%", "wait_ms", "max_hold_us");
+}
+
+/**
+ * Write the contention report: every class of locks (that was acquired), and
+ * the inodes whose locks were waited for the longest, ranked by total wait.
+ *
+ * Input:
+ *   - out: where to write the report
+ *   - inode_lock: profile of the lock of an inode, by inumber
+ *   - inode_count: number of inodes
+ */
+void lockprof_report(FILE *out, lock_profile_t const *(*inode_lock)(size_t),
+                     size_t inode_count) {
+    lock_profile_t const *ranked[LOCK_CLASS_COUNT];
+    size_t n = 0;
+    for (size_t c = 0; c < LOCK_CLASS_COUNT; c++) {
+        if (load(&classes[c].lp_acquisitions) > 0) {
+            ranked[n++] = &classes[c];
+        }
+    }
+    qsort(ranked, n, sizeof(ranked[0]), compare_profiles);
+    fprintf(out, "Lock contention, by lock class:\n");
+    report_header(out, "class");
+    for (size_t i = 0; i < n; i++) {
+        report_row(out, class_names[ranked[i]->lp_class], ranked[i]);
+    }
+
+    // the hottest inodes: a bounded selection, kept sorted
+    lock_profile_t const *hot[LOCKPROF_TOP_INODES];
+    size_t hot_inumbers[LOCKPROF_TOP_INODES];
+    size_t hot_count = 0;
+    for (size_t i = 0; i < inode_count; i++) {
+        lock_profile_t const *prof = inode_lock(i);
+        if (load(&prof->lp_contended) == 0) {
+            continue;
+        }
+        size_t pos = hot_count;
+        while (pos > 0 && compare_profiles(&prof, &hot[pos - 1]) < 0) {
+            pos--;
+        }
+        if (pos == LOCKPROF_TOP_INODES) {
+            continue;
+        }
+        size_t last = hot_count < LOCKPROF_TOP_INODES ? hot_count++
+                                                      : LOCKPROF_TOP_INODES - 1;
+        memmove(&hot[pos + 1], &hot[pos], (last - pos) * sizeof(hot[0]));
+        memmove(&hot_inumbers[pos + 1], &hot_inumbers[pos],
+                (last - pos) * sizeof(hot_inumbers[0]));
+        hot[pos] = prof;
+        hot_inumbers[pos] = i;
+    }
+    if (hot_count > 0) {
+        fprintf(out, "Most contended inode locks:\n");
+        report_header(out, "inumber");
+        for (size_t i = 0; i < hot_count; i++) {
+            char name[24];
+            snprintf(name, sizeof(name), "%zu", hot_inumbers[i]);
+            report_row(out, name, hot[i]);
+        }
+    }
+}
+
+#endif // TFS_LOCK_PROFILE
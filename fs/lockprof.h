@@ -0,0 +1,116 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include "trace.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Locks of the state layer. Built with TFS_LOCK_PROFILE (make
+ * LOCK_PROFILE=yes), every acquisition is profiled: acquisitions, contended
+ * acquisitions (the lock was not free), time spent waiting for the lock and
+ * longest time it was held, per lock and per class of locks, and a report
+ * ranked by contention is written at tfs_destroy. Otherwise, these are plain
+ * pthread locks. Either way, the waits for a lock that is not free are traced
+ * (see tfs_trace_dump).
+ */
+
+typedef enum {
+    LOCK_CLASS_INODE = 0,     // inode_t.rwlock
+    LOCK_CLASS_DATA_BLOCKS,   // free block bitmap
+    LOCK_CLASS_DCACHE_SHARD,  // directory entry cache
+    LOCK_CLASS_DIR_INDEX,     // building a directory's index
+    LOCK_CLASS_MAGAZINES,     // registry of the block magazines
+    LOCK_CLASS_MAGAZINE,      // a thread's block magazine
+    LOCK_CLASS_HANDLE_CACHES, // registry of the handle caches
+    LOCK_CLASS_HANDLE_CACHE,  // a thread's handle cache
+    LOCK_CLASS_COUNT,
+} lock_class_t;
+
+#ifdef TFS_LOCK_PROFILE
+
+typedef struct {
+    lock_class_t lp_class;
+    _Atomic uint64_t lp_acquisitions;
+    _Atomic uint64_t lp_contended;
+    _Atomic uint64_t lp_wait_ns;
+    _Atomic uint64_t lp_max_hold_ns;
+} lock_profile_t;
+
+typedef struct {
+    pthread_rwlock_t lk_rwlock;
+    lock_profile_t lk_prof;
+} tfs_rwlock_t;
+
+typedef struct {
+    pthread_mutex_t lk_mutex;
+    lock_profile_t lk_prof;
+} tfs_mutex_t;
+
+#define TFS_MUTEX_INITIALIZER(lock_class)                                      \
+    {                                                                          \
+        .lk_mutex = PTHREAD_MUTEX_INITIALIZER,                                 \
+        .lk_prof = {.lp_class = (lock_class)}                                  \
+    }
+
+void tfs_rwlock_init(tfs_rwlock_t *lock, lock_class_t lock_class);
+void tfs_rwlock_destroy(tfs_rwlock_t *lock);
+void tfs_rwlock_rdlock(tfs_rwlock_t *lock);
+void tfs_rwlock_wrlock(tfs_rwlock_t *lock);
+void tfs_rwlock_unlock(tfs_rwlock_t *lock);
+
+void tfs_mutex_init(tfs_mutex_t *lock, lock_class_t lock_class);
+void tfs_mutex_destroy(tfs_mutex_t *lock);
+void tfs_mutex_lock(tfs_mutex_t *lock);
+void tfs_mutex_unlock(tfs_mutex_t *lock);
+
+void lockprof_reset(void);
+void lockprof_report(FILE *out, lock_profile_t const *(*inode_lock)(size_t),
+                     size_t inode_count);
+
+#else
+
+typedef pthread_rwlock_t tfs_rwlock_t;
+typedef pthread_mutex_t tfs_mutex_t;
+
+#define TFS_MUTEX_INITIALIZER(lock_class) PTHREAD_MUTEX_INITIALIZER
+
+#define tfs_rwlock_init(lock, lock_class) pthread_rwlock_init((lock), NULL)
+#define tfs_rwlock_destroy(lock) pthread_rwlock_destroy(lock)
+#define tfs_rwlock_unlock(lock) pthread_rwlock_unlock(lock)
+
+#define tfs_mutex_init(lock, lock_class) pthread_mutex_init((lock), NULL)
+#define tfs_mutex_destroy(lock) pthread_mutex_destroy(lock)
+#define tfs_mutex_unlock(lock) pthread_mutex_unlock(lock)
+
+// a lock that is free costs no more than a plain acquisition
+static inline void tfs_rwlock_rdlock(tfs_rwlock_t *lock) {
+    if (pthread_rwlock_tryrdlock(lock) != 0) {
+        uint64_t start = trace_start();
+        pthread_rwlock_rdlock(lock);
+        trace_lock_wait(start);
+    }
+}
+
+static inline void tfs_rwlock_wrlock(tfs_rwlock_t *lock) {
+    if (pthread_rwlock_trywrlock(lock) != 0) {
+        uint64_t start = trace_start();
+        pthread_rwlock_wrlock(lock);
+        trace_lock_wait(start);
+    }
+}
+
+static inline void tfs_mutex_lock(tfs_mutex_t *lock) {
+    if (pthread_mutex_trylock(lock) != 0) {
+        uint64_t start = trace_start();
+        pthread_mutex_lock(lock);
+        trace_lock_wait(start);
+    }
+}
+
+#endif // TFS_LOCK_PROFILE
+
+#endif // LOCKPROF_H
@@ -1,11 +1,21 @@
 #include "operations.h"
 #include "config.h"
 #include "state.h"
+#include "bcache.h"
+#include "dcache.h"
+#include "stats.h"
+#include "trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "betterassert.h"
 
 tfs_params tfs_default_params() {
@@ -14,6 +24,14 @@ tfs_params tfs_default_params() {
         .max_block_count = 1024,
         .max_open_files_count = 16,
         .block_size = 1024,
+        .image_path = NULL,
+        .backend = TFS_BACKEND_RAM,
+        .device_latency_ns = 0,
+        .device_bandwidth = 0,
+        .cache_size = 256 * 1024,
+        .readahead_window = 32,
+        .collect_stats = false,
+        .trace_events = 0,
     };
     return params;
 }
@@ -26,10 +44,16 @@ int tfs_init(tfs_params const *params_ptr) {
         params = tfs_default_params();
     }
 
+    trace_init(params.trace_events);
+    stats_init(params.collect_stats, params.trace_events > 0);
     if (state_init(params) != 0) {
         return -1;
     }
 
+    if (state_loaded()) {
+        return 0; // the image already holds the root directory
+    }
+
     // create root inode
     int root = inode_create(T_DIRECTORY);
     if (root != ROOT_DIR_INUM) {
@@ -39,6 +63,17 @@ int tfs_init(tfs_params const *params_ptr) {
     return 0;
 }
 
+int tfs_sync(void) {
+    STATS_SCOPE(TFS_OP_SYNC);
+    return state_sync();
+}
+
+void tfs_cache_stats(tfs_cache_stats_t *stats) { bcache_stats(stats); }
+
+void tfs_stats(tfs_stats_t *stats) { stats_collect(stats); }
+
+int tfs_trace_dump(char const *path) { return trace_dump(path); }
+
 int tfs_destroy() {
     if (state_destroy() != 0) {
         return -1;
@@ -51,10 +86,302 @@ static bool valid_pathname(char const *name) {
 }
 
 /**
- * Looks for a file.
+ * Copy data between a list of buffers and the data blocks of an inode.
+ *
+ * The inode's extents are walked once, in file order, and each piece of a run
+ * of contiguous blocks overlapping [offset, offset + len) is copied to/from
+ * the buffers in turn, with a memcpy per (run, buffer) pair when the blocks are
+ * in memory. Otherwise, the pairs are collected and handed to the block layer
+ * as a single batch.
+ *
+ * Input:
+ *   - inode: the inode (locked by the caller)
+ *   - offset: file offset where the copy starts
+ *   - iov: user buffers; a buffer whose iov_base is NULL fills its range of
+ *     the file with zeros (when to_file)
+ *   - iovcnt: number of buffers
+ *   - len: number of bytes to copy, at most the total length of the buffers
+ *     (the blocks must already be allocated)
+ *   - to_file: true to copy from the buffers into the file, false otherwise
+ */
+static void inode_copyv(inode_t const *inode, size_t offset,
+                        struct iovec const *iov, int iovcnt, size_t len,
+                        bool to_file) {
+    size_t block_size = state_block_size();
+    size_t ext_begin = 0; // file offset of the current extent
+    int v = 0;            // current buffer
+    size_t v_done = 0;    // bytes of the current buffer already copied
+
+    bool mapped = data_blocks_mapped();
+    data_range_t *ranges = NULL;
+    size_t n_ranges = 0;
+    if (!mapped) {
+        // every piece but the last ends at the end of an extent or a buffer
+        ranges = malloc(((size_t)inode->i_extent_count + (size_t)iovcnt) *
+                        sizeof(data_range_t));
+        ALWAYS_ASSERT(ranges != NULL, "inode_copy: failed to allocate ranges");
+    }
+
+    for (int i = 0; i < inode->i_extent_count && len > 0; i++) {
+        extent_t ext = inode_extent(inode, i);
+        size_t ext_bytes = (size_t)ext.e_length * block_size;
+
+        if (offset < ext_begin + ext_bytes) {
+            char *run = NULL;
+            if (mapped) {
+                run = data_block_get(ext.e_start);
+                ALWAYS_ASSERT(run != NULL,
+                              "inode_copy: data block deleted mid-io");
+            }
+
+            while (len > 0 && offset < ext_begin + ext_bytes) {
+                ALWAYS_ASSERT(v < iovcnt, "inode_copy: buffers too short");
+                size_t within = offset - ext_begin;
+                size_t n = ext_bytes - within;
+                if (n > iov[v].iov_len - v_done) {
+                    n = iov[v].iov_len - v_done;
+                }
+                if (n > len) {
+                    n = len;
+                }
+
+                char *buf = iov[v].iov_base;
+                if (buf != NULL) {
+                    buf += v_done;
+                }
+                if (run == NULL) {
+                    ranges[n_ranges++] = (data_range_t){.dr_block = ext.e_start,
+                                                        .dr_offset = within,
+                                                        .dr_buffer = buf,
+                                                        .dr_len = n};
+                } else if (buf == NULL) {
+                    memset(run + within, 0, n);
+                } else if (to_file) {
+                    memcpy(run + within, buf, n);
+                } else {
+                    memcpy(buf, run + within, n);
+                }
+                offset += n;
+                len -= n;
+                v_done += n;
+                if (v_done == iov[v].iov_len) {
+                    v++;
+                    v_done = 0;
+                }
+            }
+            if (run != NULL) {
+                data_block_put(ext.e_start, to_file);
+            }
+        }
+        ext_begin += ext_bytes;
+    }
+    ALWAYS_ASSERT(len == 0, "inode_copy: range not backed by data blocks");
+
+    if (n_ranges > 0 && to_file) {
+        data_blocks_writev(ranges, n_ranges);
+    } else if (n_ranges > 0) {
+        data_blocks_readv(ranges, n_ranges);
+    }
+    free(ranges);
+}
+
+/**
+ * Copy data between a buffer and the data blocks of an inode.
+ *
+ * Input:
+ *   - inode: the inode (locked by the caller)
+ *   - offset: file offset where the copy starts
+ *   - buffer: user buffer, or NULL to fill the range of the file with zeros
+ *   - len: number of bytes to copy (the blocks must already be allocated)
+ *   - to_file: true to copy from the buffer into the file, false otherwise
+ */
+static void inode_copy(inode_t const *inode, size_t offset, void *buffer,
+                       size_t len, bool to_file) {
+    struct iovec iov = {.iov_base = buffer, .iov_len = len};
+    inode_copyv(inode, offset, &iov, 1, len, to_file);
+}
+
+/**
+ * Sum the lengths of a list of buffers.
+ *
+ * Returns the total length, or -1 if the list is invalid (negative or more
+ * than TFS_IOV_MAX buffers) or the total does not fit in a ssize_t.
+ */
+static ssize_t iov_total(struct iovec const *iov, int iovcnt) {
+    if (iovcnt < 0 || iovcnt > TFS_IOV_MAX || (iovcnt > 0 && iov == NULL)) {
+        return -1;
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > SSIZE_MAX - total) {
+            return -1;
+        }
+        total += iov[i].iov_len;
+    }
+    return (ssize_t)total;
+}
+
+/**
+ * Write to an inode at a given offset, growing it as needed. A gap between the
+ * end of the file and the offset reads as zeros.
  *
- * Note: as a simplification, only a plain directory space (root directory only)
- * is supported.
+ * Input:
+ *   - inode: the inode (write-locked by the caller)
+ *   - iov: buffers containing the contents to write, in order
+ *   - iovcnt: number of buffers
+ *   - len: total length of the buffers (in bytes)
+ *   - offset: file offset where the write starts
+ *
+ * Returns the number of bytes written (lower than len if the FS runs out of
+ * blocks), or -1 if not even one byte fits. The blocks grown for what was not
+ * written are given back.
+ */
+static ssize_t inode_write_at(inode_t *inode, struct iovec const *iov,
+                              int iovcnt, size_t len, size_t offset) {
+    if (len == 0) {
+        return 0;
+    }
+
+    // Allocate the blocks needed to hold the write, and only write as many
+    // bytes as the allocated blocks can hold
+    size_t block_size = state_block_size();
+    size_t end = offset + len;
+    size_t owned = inode->i_block_count; // blocks reserved ahead stay
+    size_t blocks = inode_grow(inode, (end + block_size - 1) / block_size);
+    size_t capacity = blocks * block_size;
+    if (capacity <= offset) {
+        inode_shrink(inode, owned);
+        return -1; // no space
+    }
+    if (end > capacity) {
+        len = capacity - offset;
+    }
+
+    if (offset > inode->i_size) {
+        inode_copy(inode, inode->i_size, NULL, offset - inode->i_size, true);
+    }
+    // Perform the actual write
+    inode_copyv(inode, offset, iov, iovcnt, len, true);
+
+    if (offset + len > inode->i_size) {
+        inode->i_size = offset + len;
+    }
+    size_t used = (inode->i_size + block_size - 1) / block_size;
+    inode_shrink(inode, used > owned ? used : owned);
+    return (ssize_t)len;
+}
+
+/**
+ * Read from an inode at a given offset.
+ *
+ * Input:
+ *   - inode: the inode (read-locked by the caller)
+ *   - iov: destination buffers, filled in order
+ *   - iovcnt: number of buffers
+ *   - len: total length of the buffers
+ *   - offset: file offset where the read starts
+ *
+ * Returns the number of bytes read (lower than len if the end of the file was
+ * reached).
+ */
+static size_t inode_read_at(inode_t const *inode, struct iovec const *iov,
+                            int iovcnt, size_t len, size_t offset) {
+    if (offset >= inode->i_size) {
+        return 0;
+    }
+
+    // Determine how many bytes to read
+    size_t to_read = inode->i_size - offset;
+    if (to_read > len) {
+        to_read = len;
+    }
+
+    // Perform the actual read
+    inode_copyv(inode, offset, iov, iovcnt, to_read, false);
+    return to_read;
+}
+
+/**
+ * Read the target path of a symbolic link, which is kept as its contents.
+ *
+ * Input:
+ *   - inode: the symbolic link inode (locked by the caller)
+ *
+ * Returns the path (to be freed by the caller), or NULL if malloc fails.
+ */
+static char *sym_link_target(inode_t const *inode) {
+    char *path = malloc(inode->i_size + 1);
+    if (path == NULL) {
+        return NULL;
+    }
+    struct iovec iov = {.iov_base = path, .iov_len = inode->i_size};
+    size_t len = inode_read_at(inode, &iov, 1, inode->i_size, 0);
+    path[len] = '\0';
+    return path;
+}
+
+/**
+ * Looks for an entry of a directory, going through the directory entry cache.
+ *
+ * Input:
+ *   - dir_inumber: inumber of the directory
+ *   - sub_name: name of the entry
+ * Returns the inumber of the entry, -1 if unsuccessful.
+ */
+static int dir_lookup(int dir_inumber, char const *sub_name) {
+    uint64_t seq;
+    int inum = dcache_lookup(dir_inumber, sub_name, &seq);
+    if (inum != -1) {
+        return inum;
+    }
+
+    inum = find_in_dir(inode_get(dir_inumber), sub_name);
+    if (inum != -1) {
+        dcache_insert(dir_inumber, sub_name, inum, seq);
+    }
+    return inum;
+}
+
+/**
+ * Resolves a path, component by component, starting at the root directory.
+ *
+ * Input:
+ *   - path: absolute path name
+ *   - len: number of characters of path to resolve
+ * Returns the inumber of the last component, -1 if unsuccessful.
+ */
+static int tfs_walk(char const *path, size_t len) {
+    int inum = ROOT_DIR_INUM;
+    char component[MAX_FILE_NAME];
+
+    size_t i = 0;
+    while (i < len) {
+        if (path[i] == '/') {
+            i++;
+            continue;
+        }
+
+        size_t start = i;
+        while (i < len && path[i] != '/') {
+            i++;
+        }
+        if (i - start > MAX_FILE_NAME - 1) {
+            return -1; // no such name can exist
+        }
+        memcpy(component, path + start, i - start);
+        component[i - start] = '\0';
+
+        inum = dir_lookup(inum, component);
+        if (inum == -1) {
+            return -1;
+        }
+    }
+    return inum;
+}
+
+/**
+ * Looks for a file.
  *
  * Input:
  *   - name: absolute path name
@@ -70,14 +397,48 @@ static int tfs_lookup(char const *name, inode_t const *root_inode) {
     if (inode != root_inode) { // checks if root_inode is the root directory
         return -1;
     }
-    // skip the initial '/' character
-    name++;
-    return find_in_dir(root_inode, name);
+    return tfs_walk(name, strlen(name));
+}
+
+/**
+ * Looks for the directory that holds (or would hold) a file.
+ *
+ * Input:
+ *   - name: absolute path name
+ *   - sub_name: buffer of MAX_FILE_NAME characters, which receives the name of
+ *     the file inside the directory (the last component of the path)
+ * Returns the inumber of the directory, -1 if unsuccessful (with errno set to
+ * EINVAL, ENAMETOOLONG or ENOENT).
+ */
+static int tfs_lookup_parent(char const *name, char *sub_name) {
+    if (!valid_pathname(name)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char const *last = strrchr(name, '/') + 1;
+    size_t len = strlen(last);
+    if (len == 0) {
+        errno = EINVAL;
+        return -1; // trailing '/'
+    } else if (len > MAX_FILE_NAME - 1) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(sub_name, last, len + 1);
+
+    int inum = tfs_walk(name, (size_t)(last - name));
+    if (inum == -1) {
+        errno = ENOENT;
+    }
+    return inum;
 }
 
 int tfs_open(char const *name, tfs_file_mode_t mode) {
+    STATS_SCOPE(TFS_OP_OPEN);
     // Checks if the path name is valid
     if (!valid_pathname(name)) {
+        errno = EINVAL;
         return -1;
     }
 
@@ -93,19 +454,30 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
         ALWAYS_ASSERT(inode != NULL,
                       "tfs_open: directory files must have an inode");
         if (inode->sym_link) {
-            name = inode->sym_path; // get path of original file
-            inum = tfs_lookup(name, root_dir_inode); // get inum of original file
+            tfs_rwlock_rdlock(&inode->rwlock);
+            char *target = sym_link_target(inode); // path of original file
+            tfs_rwlock_unlock(&inode->rwlock);
+            if (target == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            inum = tfs_lookup(target, root_dir_inode); // inum of original file
+            free(target);
             if (inum < 0) { // if original file doesn't exist
+                errno = ENOENT;
                 return -1;
             }
             inode = inode_get(inum); // get inode of original file
         }
+        if (inode->i_node_type == T_DIRECTORY) {
+            errno = EISDIR;
+            return -1; // directories cannot be opened
+        }
         // Truncate (if requested)
         if (mode & TFS_O_TRUNC) {
-            if (inode->i_size > 0) {
-                data_block_free(inode->i_data_block);
-                inode->i_size = 0;
-            }
+            tfs_rwlock_wrlock(&inode->rwlock);
+            inode_truncate(inode);
+            tfs_rwlock_unlock(&inode->rwlock);
         }
         // Determine initial offset
         if (mode & TFS_O_APPEND) {
@@ -115,25 +487,39 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
         }
     } else if (mode & TFS_O_CREAT) {
         // The file does not exist; the mode specified that it should be created
+        char sub_name[MAX_FILE_NAME];
+        int parent_inum = tfs_lookup_parent(name, sub_name);
+        if (parent_inum == -1) {
+            errno = ENOENT;
+            return -1; // parent directory does not exist
+        }
+
         // Create inode
         inum = inode_create(T_FILE);
         if (inum == -1) {
+            errno = ENOSPC;
             return -1; // no space in inode table
         }
 
-        // Add entry in the root directory
-        if (add_dir_entry(root_dir_inode, name + 1, inum) == -1) {
+        // Add entry in the parent directory
+        if (add_dir_entry(inode_get(parent_inum), sub_name, inum) == -1) {
             inode_delete(inum);
+            errno = ENOSPC;
             return -1; // no space in directory
         }
         offset = 0;
     } else {
+        errno = ENOENT;
         return -1;
     }
 
     // Finally, add entry to the open file table and return the corresponding
     // handle
-    return add_to_open_file_table(inum, offset);
+    int fhandle = add_to_open_file_table(inum, offset);
+    if (fhandle == -1) {
+        errno = ENFILE;
+    }
+    return fhandle;
 
     // Note: for simplification, if file was created with TFS_O_CREAT and there
     // is an error adding an entry to the open file table, the file is not
@@ -141,9 +527,15 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
 }
 
 int tfs_sym_link(char const *target, char const *link_name) {
+    STATS_SCOPE(TFS_OP_SYM_LINK);
     if (!valid_pathname(target) || !valid_pathname(link_name)) {
         return -1;
     }
+    char link_sub_name[MAX_FILE_NAME];
+    int link_parent_inum = tfs_lookup_parent(link_name, link_sub_name);
+    if (link_parent_inum < 0) { // link directory does not exist
+        return -1;
+    }
     // verify if target exists
     inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
     int target_inum = tfs_lookup(target, root_dir_inode);
@@ -151,48 +543,68 @@ int tfs_sym_link(char const *target, char const *link_name) {
         return -1;
     }
     inode_t *target_inode = inode_get(target_inum);
-    pthread_rwlock_wrlock(&target_inode->rwlock);
-
-    int link_inum;
-    if (target_inode->sym_link) { // check if target is a symlink
-        // if target is a symlink, create a new inode for the new symlink
-        // and copy the original inode data to the new inode
-        link_inum = inode_create(T_FILE);
-        if (link_inum < 0) {
-            return -1; // no space in inode table
-        }
-        inode_t *link_inode= inode_get(link_inum);
-        link_inode->i_size = target_inode->i_size;
-        link_inode->i_data_block = target_inode->i_data_block;
-        link_inode->sym_link = true;
-        link_inode->sym_path = target_inode->sym_path;
-    } else {
-        link_inum = tfs_lookup(link_name, root_dir_inode); 
-        if (link_inum > 0) { // link already exists
-            return -1;
-        }
-        link_inum = inode_create(T_FILE);
-        if (link_inum < 0) {
+    tfs_rwlock_wrlock(&target_inode->rwlock);
+    if (target_inode->i_node_type == T_DIRECTORY) { // no links to dirs
+        tfs_rwlock_unlock(&target_inode->rwlock);
+        return -1;
+    }
+
+    // the link keeps the path of the original file as its contents: if the
+    // target is a symlink, its path is copied to the new symlink
+    char *path = (char *)target;
+    if (target_inode->sym_link) {
+        path = sym_link_target(target_inode);
+        if (path == NULL) {
+            tfs_rwlock_unlock(&target_inode->rwlock);
             return -1;
         }
-        inode_t *link_inode = inode_get(link_inum);
-        pthread_rwlock_wrlock(&link_inode->rwlock);
+    } else if (tfs_lookup(link_name, root_dir_inode) >= 0) {
+        tfs_rwlock_unlock(&target_inode->rwlock);
+        return -1; // link already exists
+    }
 
-        link_inode->sym_path = (char*)target;
-        link_inode->sym_link = true;
+    int link_inum = inode_create(T_FILE);
+    if (link_inum < 0) {
+        if (path != target) {
+            free(path);
+        }
+        tfs_rwlock_unlock(&target_inode->rwlock);
+        return -1; // no space in inode table
     }
-    if (add_dir_entry(root_dir_inode, link_name + 1, link_inum) == -1) {
+    // the new inode is not reachable until it is added to the directory
+    inode_t *link_inode = inode_get(link_inum);
+    link_inode->sym_link = true;
+    size_t path_len = strlen(path);
+    struct iovec iov = {.iov_base = path, .iov_len = path_len};
+    ssize_t written = inode_write_at(link_inode, &iov, 1, path_len, 0);
+    if (path != target) {
+        free(path);
+    }
+    if (written != (ssize_t)path_len) {
+        inode_delete(link_inum);
+        tfs_rwlock_unlock(&target_inode->rwlock);
+        return -1; // no space for the path
+    }
+    if (add_dir_entry(inode_get(link_parent_inum), link_sub_name, link_inum) ==
+        -1) {
         inode_delete(link_inum);
+        tfs_rwlock_unlock(&target_inode->rwlock);
         return -1; // no space in directory
     }
-    pthread_rwlock_unlock(&target_inode->rwlock);
+    tfs_rwlock_unlock(&target_inode->rwlock);
     return 0; 
 }
 
 int tfs_link(char const *target, char const *link_name) {
+    STATS_SCOPE(TFS_OP_LINK);
     if (!valid_pathname(target) || !valid_pathname(link_name)) {
         return -1;
     }
+    char link_sub_name[MAX_FILE_NAME];
+    int link_parent_inum = tfs_lookup_parent(link_name, link_sub_name);
+    if (link_parent_inum < 0) { // link directory does not exist
+        return -1;
+    }
     // check if target is symlink
     inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
 
@@ -201,30 +613,89 @@ int tfs_link(char const *target, char const *link_name) {
         return -1;
     }
     inode_t *target_inode = inode_get(target_inum);
-    pthread_rwlock_wrlock(&target_inode->rwlock);
+    tfs_rwlock_wrlock(&target_inode->rwlock);
 
     if (target_inode->sym_link == true) { // target is symlink
-        pthread_rwlock_unlock(&target_inode->rwlock);
+        tfs_rwlock_unlock(&target_inode->rwlock);
+        return -1;
+    }
+    if (target_inode->i_node_type == T_DIRECTORY) { // no hard links to dirs
+        tfs_rwlock_unlock(&target_inode->rwlock);
         return -1;
     }
     int link_inum = tfs_lookup(link_name, root_dir_inode); 
-    if (link_inum > 0) { // check if link_name already exists
-        pthread_rwlock_unlock(&target_inode->rwlock);
+    if (link_inum >= 0) { // check if link_name already exists
+        tfs_rwlock_unlock(&target_inode->rwlock);
         return -1;
     }
     target_inode->hard_links++;
     
     // link entry points to target_inum
-    if (add_dir_entry(root_dir_inode, link_name +1, target_inum) == -1) {
-        inode_delete(link_inum);
-        pthread_rwlock_unlock(&target_inode->rwlock);
+    if (add_dir_entry(inode_get(link_parent_inum), link_sub_name,
+                      target_inum) == -1) {
+        target_inode->hard_links--;
+        tfs_rwlock_unlock(&target_inode->rwlock);
         return -1; // no space in directory
     }
-    pthread_rwlock_unlock(&target_inode->rwlock);
+    tfs_rwlock_unlock(&target_inode->rwlock);
+    return 0;
+}
+
+int tfs_mkdir(char const *name) {
+    STATS_SCOPE(TFS_OP_MKDIR);
+    char sub_name[MAX_FILE_NAME];
+    int parent_inum = tfs_lookup_parent(name, sub_name);
+    if (parent_inum < 0) { // parent directory does not exist
+        return -1;
+    }
+
+    int inum = inode_create(T_DIRECTORY);
+    if (inum < 0) {
+        errno = ENOSPC;
+        return -1; // no space in inode table or for the directory block
+    }
+
+    if (add_dir_entry(inode_get(parent_inum), sub_name, inum) == -1) {
+        int error = errno;
+        inode_delete(inum);
+        errno = error;
+        return -1; // name already exists, or no space in parent directory
+    }
+    return 0;
+}
+
+int tfs_rmdir(char const *name) {
+    STATS_SCOPE(TFS_OP_RMDIR);
+    char sub_name[MAX_FILE_NAME];
+    int parent_inum = tfs_lookup_parent(name, sub_name);
+    if (parent_inum < 0) { // parent directory does not exist
+        return -1;
+    }
+
+    int inum = dir_lookup(parent_inum, sub_name);
+    if (inum < 0) { // directory does not exist
+        return -1;
+    }
+
+    inode_t *inode = inode_get(inum);
+    tfs_rwlock_wrlock(&inode->rwlock);
+    if (inode->i_node_type != T_DIRECTORY || !dir_is_empty(inode)) {
+        tfs_rwlock_unlock(&inode->rwlock);
+        return -1;
+    }
+    // no entries can be added from now on
+    inode->hard_links = 0;
+    tfs_rwlock_unlock(&inode->rwlock);
+
+    if (clear_dir_entry(inode_get(parent_inum), sub_name) == -1) {
+        return -1; // removed concurrently
+    }
+    inode_delete(inum);
     return 0;
 }
 
 int tfs_close(int fhandle) {
+    STATS_SCOPE(TFS_OP_CLOSE);
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) {
         return -1; // invalid fd
@@ -235,7 +706,24 @@ int tfs_close(int fhandle) {
     return 0;
 }
 
+int tfs_fsync(int fhandle) {
+    STATS_SCOPE(TFS_OP_FSYNC);
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    // the read lock keeps the extents in place, and the writes out
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_fsync: inode of open file deleted");
+    tfs_rwlock_rdlock(&inode->rwlock);
+    int result = inode_sync(inode);
+    tfs_rwlock_unlock(&inode->rwlock);
+    return result;
+}
+
 ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+    STATS_SCOPE(TFS_OP_WRITE);
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) { 
         return -1;
@@ -243,174 +731,487 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
 
     //  From the open file table entry, we get the inode
     inode_t *inode = inode_get(file->of_inumber);
-    pthread_rwlock_wrlock(&inode->rwlock);
     ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
+    tfs_rwlock_wrlock(&inode->rwlock);
 
-    // Determine how many bytes to write
-    size_t block_size = state_block_size();
-    if (to_write + file->of_offset > block_size) {
-        to_write = block_size - file->of_offset;
+    struct iovec iov = {.iov_base = (void *)buffer, .iov_len = to_write};
+    ssize_t written = inode_write_at(inode, &iov, 1, to_write, file->of_offset);
+    if (written > 0) {
+        // The offset associated with the file handle is incremented accordingly
+        file->of_offset += (size_t)written;
     }
+    tfs_rwlock_unlock(&inode->rwlock);
+    return written;
+}
 
-    if (to_write > 0) {
-        if (inode->i_size == 0) {
-            // If empty file, allocate new block
-            int bnum = data_block_alloc();
-            if (bnum == -1) {
-                pthread_rwlock_unlock(&inode->rwlock);
-                return -1; // no space
-            }
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+    STATS_SCOPE(TFS_OP_READ);
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
 
-            inode->i_data_block = bnum;
-        }
+    // From the open file table entry, we get the inode
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
+    tfs_rwlock_rdlock(&inode->rwlock);
 
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_write: data block deleted mid-write");
+    struct iovec iov = {.iov_base = buffer, .iov_len = len};
+    size_t to_read = inode_read_at(inode, &iov, 1, len, file->of_offset);
+    inode_readahead(file, inode, file->of_offset, to_read);
+    // The offset associated with the file handle is incremented accordingly
+    file->of_offset += to_read;
 
-        // Perform the actual write
-        memcpy(block + file->of_offset, buffer, to_write);
+    tfs_rwlock_unlock(&inode->rwlock);
+    return (ssize_t)to_read;
+}
 
-        // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_write;
-        if (file->of_offset > inode->i_size) {
-            inode->i_size = file->of_offset;
-        }
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len,
+                   size_t offset) {
+    STATS_SCOPE(TFS_OP_PWRITE);
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
     }
-    pthread_rwlock_unlock(&inode->rwlock);
-    return (ssize_t)to_write;
+
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_pwrite: inode of open file deleted");
+    struct iovec iov = {.iov_base = (void *)buffer, .iov_len = len};
+    tfs_rwlock_wrlock(&inode->rwlock);
+    ssize_t written = inode_write_at(inode, &iov, 1, len, offset);
+    tfs_rwlock_unlock(&inode->rwlock);
+    return written;
 }
 
-ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) {
+    STATS_SCOPE(TFS_OP_PREAD);
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) {
         return -1;
     }
 
-    // From the open file table entry, we get the inode
-    inode_t const *inode = inode_get(file->of_inumber);
-    pthread_rwlock_rdlock((pthread_rwlock_t*)&inode->rwlock);
-    ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
+    // only the inode's read lock is taken, so reads of a shared handle run in
+    // parallel
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_pread: inode of open file deleted");
+    struct iovec iov = {.iov_base = buffer, .iov_len = len};
+    tfs_rwlock_rdlock(&inode->rwlock);
+    size_t to_read = inode_read_at(inode, &iov, 1, len, offset);
+    inode_readahead(file, inode, offset, to_read);
+    tfs_rwlock_unlock(&inode->rwlock);
+    return (ssize_t)to_read;
+}
 
-    // Determine how many bytes to read
-    size_t to_read = inode->i_size - file->of_offset;
-    if (to_read > len) {
-        to_read = len;
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt) {
+    STATS_SCOPE(TFS_OP_WRITEV);
+    ssize_t total = iov_total(iov, iovcnt);
+    if (total == -1) {
+        return -1;
+    }
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
     }
 
-    if (to_read > 0) {
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_read: data block deleted mid-read");
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_writev: inode of open file deleted");
+    tfs_rwlock_wrlock(&inode->rwlock);
 
-        // Perform the actual read
-        memcpy(buffer, block + file->of_offset, to_read);
-        // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_read;
+    ssize_t written =
+        inode_write_at(inode, iov, iovcnt, (size_t)total, file->of_offset);
+    if (written > 0) {
+        file->of_offset += (size_t)written;
     }
-    pthread_rwlock_unlock((pthread_rwlock_t*)&inode->rwlock);
+    tfs_rwlock_unlock(&inode->rwlock);
+    return written;
+}
+
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt) {
+    STATS_SCOPE(TFS_OP_READV);
+    ssize_t total = iov_total(iov, iovcnt);
+    if (total == -1) {
+        return -1;
+    }
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_readv: inode of open file deleted");
+    tfs_rwlock_rdlock(&inode->rwlock);
+
+    size_t to_read =
+        inode_read_at(inode, iov, iovcnt, (size_t)total, file->of_offset);
+    inode_readahead(file, inode, file->of_offset, to_read);
+    file->of_offset += to_read;
+
+    tfs_rwlock_unlock(&inode->rwlock);
     return (ssize_t)to_read;
 }
 
+ssize_t tfs_read_view(int fhandle, size_t offset, size_t len,
+                      tfs_view_t *view) {
+    STATS_SCOPE(TFS_OP_READ_VIEW);
+    *view = (tfs_view_t){.v_len = 0,
+                         .v_run_count = 0,
+                         .v_runs = NULL,
+                         .v_inumber = -1,
+                         .v_buffer = NULL};
+
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_read_view: inode of open file deleted");
+    tfs_rwlock_rdlock(&inode->rwlock);
+
+    if (offset >= inode->i_size || len == 0) {
+        tfs_rwlock_unlock(&inode->rwlock);
+        return 0;
+    }
+    if (len > inode->i_size - offset) {
+        len = inode->i_size - offset;
+    }
+
+    // a run never spans two extents
+    view->v_runs = malloc((size_t)inode->i_extent_count *
+                          sizeof(tfs_view_run_t));
+    if (view->v_runs == NULL) {
+        tfs_rwlock_unlock(&inode->rwlock);
+        return -1;
+    }
+
+    if (!data_blocks_mapped()) {
+        // the blocks are not in memory: the view is a copy, in a single run
+        view->v_buffer = malloc(len);
+        if (view->v_buffer == NULL) {
+            free(view->v_runs);
+            view->v_runs = NULL;
+            tfs_rwlock_unlock(&inode->rwlock);
+            return -1;
+        }
+        struct iovec iov = {.iov_base = view->v_buffer, .iov_len = len};
+        inode_read_at(inode, &iov, 1, len, offset);
+        tfs_rwlock_unlock(&inode->rwlock);
+
+        view->v_runs[0] =
+            (tfs_view_run_t){.vr_base = view->v_buffer, .vr_len = len};
+        view->v_run_count = 1;
+        view->v_len = len;
+        return (ssize_t)len;
+    }
+
+    size_t block_size = state_block_size();
+    size_t ext_begin = 0; // file offset of the current extent
+    size_t pos = offset;
+    size_t left = len;
+    for (int i = 0; i < inode->i_extent_count && left > 0; i++) {
+        extent_t ext = inode_extent(inode, i);
+        size_t ext_bytes = (size_t)ext.e_length * block_size;
+
+        if (pos < ext_begin + ext_bytes) {
+            size_t within = pos - ext_begin;
+            size_t n = ext_bytes - within;
+            if (n > left) {
+                n = left;
+            }
+
+            // mapped blocks stay addressable after being released
+            char const *run = data_block_get(ext.e_start);
+            ALWAYS_ASSERT(run != NULL,
+                          "tfs_read_view: data block deleted mid-io");
+            data_block_put(ext.e_start, false);
+            view->v_runs[view->v_run_count++] =
+                (tfs_view_run_t){.vr_base = run + within, .vr_len = n};
+            pos += n;
+            left -= n;
+        }
+        ext_begin += ext_bytes;
+    }
+    ALWAYS_ASSERT(left == 0, "tfs_read_view: range not backed by data blocks");
+
+    // the read lock is kept until the view is released
+    view->v_len = len;
+    view->v_inumber = file->of_inumber;
+    return (ssize_t)len;
+}
+
+void tfs_release_view(tfs_view_t *view) {
+    STATS_SCOPE(TFS_OP_RELEASE_VIEW);
+    if (view->v_inumber != -1) {
+        inode_t *inode = inode_get(view->v_inumber);
+        ALWAYS_ASSERT(inode != NULL,
+                      "tfs_release_view: inode of leased file deleted");
+        tfs_rwlock_unlock(&inode->rwlock);
+    }
+    free(view->v_runs);
+    free(view->v_buffer);
+    *view = (tfs_view_t){.v_len = 0,
+                         .v_run_count = 0,
+                         .v_runs = NULL,
+                         .v_inumber = -1,
+                         .v_buffer = NULL};
+}
+
 int tfs_unlink(char const *target) {
+    STATS_SCOPE(TFS_OP_UNLINK);
     if (!valid_pathname(target)) {
         return -1;
     }
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-
-    int target_inum = tfs_lookup(target, root_dir_inode);
-    if (target_inum < 0) { // target does not exist
-        pthread_rwlock_unlock(&root_dir_inode->rwlock);
+    char sub_name[MAX_FILE_NAME];
+    int parent_inum = tfs_lookup_parent(target, sub_name);
+    if (parent_inum < 0) { // parent directory does not exist
         return -1;
     }
+    inode_t *parent_inode = inode_get(parent_inum);
 
-    inode_t *target_inode = inode_get(target_inum);
-    pthread_rwlock_wrlock(&target_inode->rwlock);
+    int target_inum;
+    inode_t *target_inode;
+    for (;;) {
+        target_inum = dir_lookup(parent_inum, sub_name);
+        if (target_inum < 0) { // target does not exist
+            return -1;
+        }
+        target_inode = inode_get(target_inum);
+        tfs_rwlock_wrlock(&target_inode->rwlock);
+        // a concurrent unlink may have removed the name (and the inode been
+        // reused) before the lock: only the inode it names now can go
+        if (dir_lookup(parent_inum, sub_name) == target_inum) {
+            break;
+        }
+        tfs_rwlock_unlock(&target_inode->rwlock);
+    }
+
+    if (target_inode->i_node_type == T_DIRECTORY) { // use tfs_rmdir instead
+        tfs_rwlock_unlock(&target_inode->rwlock);
+        return -1;
+    }
 
     if (target_inode->sym_link == true) { // target is symlink
-        clear_dir_entry(root_dir_inode, target + 1);
+        clear_dir_entry(parent_inode, sub_name);
+        tfs_rwlock_unlock(&target_inode->rwlock);
         inode_delete(target_inum);
         return 0;
     }
 
     if (target_inode->hard_links > 1) { // target has hard links
         target_inode->hard_links--;
-        clear_dir_entry(root_dir_inode, target + 1);
-        if (target_inode->hard_links == 0) {
-            inode_delete(target_inum);
-        }
-        pthread_rwlock_unlock(&target_inode->rwlock);
+        clear_dir_entry(parent_inode, sub_name);
+        tfs_rwlock_unlock(&target_inode->rwlock);
         return 0;
     }
     // target has no hard links
-    if (clear_dir_entry(root_dir_inode, target + 1) == -1) {
-        pthread_rwlock_unlock(&target_inode->rwlock);
+    if (clear_dir_entry(parent_inode, sub_name) == -1) {
+        tfs_rwlock_unlock(&target_inode->rwlock);
         return -1;
     }
+    tfs_rwlock_unlock(&target_inode->rwlock);
     inode_delete(target_inum);
     return 0;
 }
 
+/**
+ * Give an open file the blocks to hold a given number of bytes, in runs as
+ * long as the free space allows.
+ *
+ * Returns 0 if successful, -1 otherwise (with errno set to ENOSPC).
+ */
+static int reserve_blocks(int fhandle, size_t size) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    ALWAYS_ASSERT(file != NULL, "reserve_blocks: invalid file handle");
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "reserve_blocks: inode of open file deleted");
+
+    size_t block_size = state_block_size();
+    size_t blocks = (size + block_size - 1) / block_size;
+    tfs_rwlock_wrlock(&inode->rwlock);
+    size_t owned = inode->i_block_count;
+    bool reserved = inode_grow(inode, blocks) >= blocks;
+    if (!reserved) {
+        inode_shrink(inode, owned);
+    }
+    tfs_rwlock_unlock(&inode->rwlock);
+    if (!reserved) {
+        errno = ENOSPC;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Copy a mapped source file into an open file, COPY_CHUNK_SIZE bytes at a
+ * time, after reserving every block it needs (so that they come in long runs,
+ * even when other files grow at the same time).
+ *
+ * Returns 0 if successful, -1 otherwise (with errno set).
+ */
+static int copy_mapped(char const *source, size_t size, int dest) {
+    if (reserve_blocks(dest, size) != 0) {
+        return -1;
+    }
+    for (size_t pos = 0; pos < size;) {
+        size_t n = size - pos;
+        if (n > COPY_CHUNK_SIZE) {
+            n = COPY_CHUNK_SIZE;
+        }
+        if (tfs_write(dest, source + pos, n) != (ssize_t)n) {
+            errno = ENOSPC;
+            return -1;
+        }
+        pos += n;
+    }
+    return 0;
+}
+
+/**
+ * Copy a source file that cannot be mapped (or whose size is unknown, like a
+ * pipe) into an open file, reading COPY_CHUNK_SIZE bytes before each write.
+ *
+ * Returns 0 if successful, -1 otherwise (with errno set).
+ */
+static int copy_streamed(int source, int dest) {
+    char *buffer = malloc(COPY_CHUNK_SIZE);
+    if (buffer == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int result = 0;
+    bool eof = false;
+    while (!eof && result == 0) {
+        size_t n = 0;
+        while (n < COPY_CHUNK_SIZE) {
+            ssize_t r = read(source, buffer + n, COPY_CHUNK_SIZE - n);
+            if (r == -1 && errno == EINTR) {
+                continue;
+            }
+            if (r <= 0) {
+                eof = r == 0;
+                result = r == 0 ? 0 : -1;
+                break;
+            }
+            n += (size_t)r;
+        }
+        if (n > 0 && tfs_write(dest, buffer, n) != (ssize_t)n) {
+            errno = ENOSPC;
+            result = -1;
+        }
+    }
+    free(buffer);
+    return result;
+}
+
 /*
  * Copy the contents of a file that exists in the OS's file system tree
  * (outside of the TFS) into a file in the TFS.
  *
+ * Regular files get all of their blocks at once, and are then mapped and
+ * written in chunks of COPY_CHUNK_SIZE bytes; other files are read
+ * (sequentially) into a buffer of that size, each write allocating its blocks
+ * in long runs. On failure, the destination is
+ * left empty, or removed if the copy created it.
+ *
  * Input:
  *   - source_path: path name of the source file (from the OS' file system)
  *   - dest_path: absolute path name of the destination file (in TécnicoFS),
  *   wich is created if needed, and overwritten if it already exists.
  *
- *   Return: 0 on success, -1 on error.
+ *   Return: 0 on success, -1 on error (with errno set).
  */
 int tfs_copy_from_external_fs(char const *source_path, char const *dest_path) {
-    if (valid_pathname(dest_path) == 0) { // check if dest_path is valid
-        printf("\n1\n");
+    STATS_SCOPE(TFS_OP_COPY_FROM_EXTERNAL);
+    int source = open(source_path, O_RDONLY);
+    if (source == -1) {
         return -1;
     }
-    FILE *fd = fopen(source_path, "r");
-    if (fd == NULL) {
-        printf("\n2\n");
-        return -1;
+    struct stat st;
+    int error = fstat(source, &st) == -1 ? errno : 0;
+    if (error == 0 && S_ISDIR(st.st_mode)) {
+        error = EISDIR;
     }
-    char buffer[tfs_default_params().block_size]; // all files are at most 1 block by definition
-    size_t bytes_read = fread(buffer, 1, sizeof(buffer), fd);
-    if (bytes_read != sizeof(buffer) && !feof(fd)) { // !feof is true if eof is reached
-        printf("\n3\n");
+    if (error != 0) {
+        close(source);
+        errno = error;
         return -1;
     }
-    int close_file = fclose(fd);
-    if (close_file == -1) {
-        printf("\n4\n");
-        return -1;
+
+    int dest = tfs_open(dest_path, TFS_O_TRUNC);
+    bool created = dest == -1 && errno == ENOENT;
+    if (created) {
+        dest = tfs_open(dest_path, TFS_O_CREAT);
     }
-    int dest_fd = tfs_open(dest_path, TFS_O_CREAT);
-    if (dest_fd == -1) {
-        printf("\n5\n");
-        return -1;
-    }   
-    ssize_t bytes_written = tfs_write(dest_fd, buffer, (size_t)bytes_read);
-    if (bytes_written ==-1) {
-        printf("\n6\n");
+    if (dest == -1) {
+        error = errno;
+        close(source);
+        errno = error;
         return -1;
     }
-    int close_dest_file = tfs_close(dest_fd);
-    if (close_dest_file == -1) {
-        printf("\n7\n");
-        return -1;
+
+    int result;
+    void *mapped = MAP_FAILED;
+    size_t size = (size_t)st.st_size;
+    if (S_ISREG(st.st_mode) && size > 0) {
+        mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, source, 0);
     }
-    return 0;
+    if (mapped != MAP_FAILED) {
+        posix_madvise(mapped, size, POSIX_MADV_SEQUENTIAL);
+        result = copy_mapped(mapped, size, dest);
+        munmap(mapped, size);
+    } else {
+        posix_fadvise(source, 0, 0, POSIX_FADV_SEQUENTIAL);
+        result = copy_streamed(source, dest);
+    }
+
+    error = errno;
+    close(source);
+    if (tfs_close(dest) == -1 && result == 0) {
+        error = EBADF;
+        result = -1;
+    }
+    if (result == -1) {
+        // give the blocks back
+        if (created) {
+            tfs_unlink(dest_path);
+        } else if ((dest = tfs_open(dest_path, TFS_O_TRUNC)) != -1) {
+            tfs_close(dest);
+        }
+    }
+    errno = error;
+    return result;
 }
 
-int tfs_list(){
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-    pthread_rwlock_rdlock(&root_dir_inode->rwlock);
-    for (int i = 0; i < root_dir_inode->i_size; i++) {
-        root_dir_inode->i_data_block += i;
-        dir_entry_t *entry = (dir_entry_t *)root_dir_inode;
-        if (entry->d_inumber != 0) {
-            inode_t *inode = inode_get(entry->d_inumber);
-            pthread_rwlock_rdlock(&inode->rwlock);
-            printf("%s", entry->d_name);
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
+    STATS_SCOPE(TFS_OP_COPY_TO_EXTERNAL);
+    int source = tfs_open(source_path, 0);
+    if (source == -1) {
+        return -1;
     }
+    int dest = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (dest == -1) {
+        int error = errno;
+        tfs_close(source);
+        errno = error;
+        return -1;
     }
-    pthread_rwlock_unlock(&root_dir_inode->rwlock);
-    return 0;
-}
\ No newline at end of file
+
+    // the read lock keeps the extents in place, and the writes out
+    open_file_entry_t *file = get_open_file_entry(source);
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL,
+                  "tfs_copy_to_external_fs: inode of open file deleted");
+    tfs_rwlock_rdlock(&inode->rwlock);
+    int result = inode_copy_out(inode, dest);
+    tfs_rwlock_unlock(&inode->rwlock);
+
+    int error = errno;
+    if (close(dest) == -1 && result == 0) {
+        error = errno;
+        result = -1;
+    }
+    tfs_close(source);
+    errno = error;
+    return result;
+}
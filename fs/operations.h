@@ -2,7 +2,20 @@
 #define OPERATIONS_H
 
 #include "config.h"
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * Block device backends.
+ */
+typedef enum {
+    TFS_BACKEND_RAM = 0, // data blocks in memory (or in the mapped image)
+    TFS_BACKEND_FILE,    // data blocks in the image file, through pread/pwrite
+    TFS_BACKEND_THREAD_POOL, // like FILE, with batches spread over threads
+    TFS_BACKEND_URING, // like FILE, through io_uring (else THREAD_POOL)
+} tfs_backend_t;
 
 /**
  * TécnicoFS parameters.
@@ -10,9 +23,34 @@
 typedef struct {
     size_t max_inode_count;
     size_t max_block_count;
-    size_t max_open_files_count;
+    size_t max_open_files_count; // initial size of the open file table,
+                                 // which grows on demand
 
     size_t block_size;
+
+    // image file holding the persistent state (inodes, free block bitmap and
+    // data blocks), or NULL to keep it in memory only. A missing or empty file
+    // is formatted; otherwise its geometry must match the parameters above
+    char const *image_path;
+
+    // where the data blocks live (all but TFS_BACKEND_RAM require image_path)
+    tfs_backend_t backend;
+    // device model: latency of every access (in nanoseconds), and bandwidth
+    // of data transfers (in bytes per second); when either is set, it
+    // replaces the DELAY busy loop
+    uint64_t device_latency_ns;
+    uint64_t device_bandwidth;
+    // memory budget (in bytes) of the buffer cache, which holds the data
+    // blocks in use when the backend is not in memory
+    size_t cache_size;
+    // largest number of blocks read ahead (into the buffer cache) of the
+    // reads of a handle that go through a file in order, or 0 to disable it
+    size_t readahead_window;
+    // count and time the operations (see tfs_stats)
+    bool collect_stats;
+    // events (the latest ones) every thread keeps for tfs_trace_dump, rounded
+    // up to a power of two, or 0 to trace nothing
+    size_t trace_events;
 } tfs_params;
 
 /**
@@ -27,11 +65,133 @@ tfs_params tfs_default_params();
 int tfs_init(tfs_params const *params);
 
 /**
- * Destroy tecnicofs.
+ * Write the persistent state, and every change to the files, back to the image
+ * file (if there is one), waiting for it to reach the disk.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_sync(void);
+
+/**
+ * Destroy tecnicofs, writing the persistent state back to the image file (if
+ * there is one).
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_destroy();
 
+/**
+ * Buffer cache statistics.
+ */
+typedef struct {
+    uint64_t cs_hits;      // blocks found in the cache
+    uint64_t cs_misses;    // blocks missing (read into it, or overwritten)
+    uint64_t cs_readahead; // blocks read into it ahead of the reads
+    size_t cs_resident;    // blocks held
+    size_t cs_dirty;       // blocks held, not yet written back
+    size_t cs_capacity;    // memory budget, in blocks
+} tfs_cache_stats_t;
+
+/**
+ * Obtain the statistics of the buffer cache (all zeros if the data blocks are
+ * in memory, and no cache is needed).
+ */
+void tfs_cache_stats(tfs_cache_stats_t *stats);
+
+/**
+ * Operations counted and timed by tfs_stats: the public entry points, and the
+ * primitives of the state layer under them.
+ */
+typedef enum {
+    TFS_OP_OPEN = 0,
+    TFS_OP_CLOSE,
+    TFS_OP_READ,
+    TFS_OP_WRITE,
+    TFS_OP_PREAD,
+    TFS_OP_PWRITE,
+    TFS_OP_READV,
+    TFS_OP_WRITEV,
+    TFS_OP_READ_VIEW,
+    TFS_OP_RELEASE_VIEW,
+    TFS_OP_FSYNC,
+    TFS_OP_SYNC,
+    TFS_OP_LINK,
+    TFS_OP_SYM_LINK,
+    TFS_OP_UNLINK,
+    TFS_OP_MKDIR,
+    TFS_OP_RMDIR,
+    TFS_OP_COPY_FROM_EXTERNAL,
+    TFS_OP_COPY_TO_EXTERNAL,
+    TFS_OP_IMPORT_TREE,
+    TFS_OP_INODE_CREATE,
+    TFS_OP_INODE_DELETE,
+    TFS_OP_INODE_GET,
+    TFS_OP_FIND_IN_DIR,
+    TFS_OP_ADD_DIR_ENTRY,
+    TFS_OP_CLEAR_DIR_ENTRY,
+    TFS_OP_DATA_BLOCK_ALLOC,
+    TFS_OP_DATA_BLOCK_FREE,
+    TFS_OP_BLOCK_ACCESS, // simulated storage accesses
+    TFS_OP_COUNT,
+} tfs_op_t;
+
+/**
+ * Count and latencies of an operation. Bucket i of the histogram counts the
+ * operations that took between tfs_stats_bucket_ns(i) nanoseconds and the
+ * start of the next bucket.
+ */
+typedef struct {
+    uint64_t os_count;
+    uint64_t os_total_ns;
+    uint64_t os_max_ns;
+    uint64_t os_buckets[STATS_HIST_BUCKETS];
+} tfs_op_stats_t;
+
+typedef struct {
+    tfs_op_stats_t st_ops[TFS_OP_COUNT];
+} tfs_stats_t;
+
+/**
+ * Obtain the statistics of the operations made (by every thread) since
+ * tfs_init, all zeros unless tfs_params.collect_stats was set. Operations
+ * made by others (e.g. the writes of tfs_copy_from_external_fs) count too.
+ */
+void tfs_stats(tfs_stats_t *stats);
+
+/**
+ * Name of an operation (e.g. "open", "inode_get").
+ */
+char const *tfs_op_name(tfs_op_t op);
+
+/**
+ * Lowest latency (in nanoseconds) that falls in a bucket of the histograms.
+ */
+uint64_t tfs_stats_bucket_ns(size_t bucket);
+
+/**
+ * Latency (in nanoseconds) below which a share (e.g. 0.99) of the operations
+ * took, to the precision of the histogram (the end of the bucket it falls
+ * in, at most the maximum). Returns 0 if there were no operations.
+ */
+uint64_t tfs_stats_percentile(tfs_op_stats_t const *op, double share);
+
+/**
+ * Write the trace of the operations made since tfs_init, when
+ * tfs_params.trace_events is set, to a file in the Chrome trace event format
+ * (JSON, for chrome://tracing or Perfetto). Every thread is a track of its
+ * own, with its latest operations (the public entry points, the primitives of
+ * the state layer under them and the simulated storage accesses, nested) and
+ * the locks it waited for. Events lost to a thread's ring wrapping around are
+ * counted in otherData.dropped_events. The trace outlives tfs_destroy.
+ *
+ * Input:
+ *   - path: the file to write (created, or truncated)
+ *
+ * Returns 0 if successful, -1 otherwise (with errno set).
+ *
+ * Possible errors:
+ *   - path cannot be opened, or written.
+ */
+int tfs_trace_dump(char const *path);
+
 /**
  * TécnicoFS file opening modes.
  */
@@ -41,6 +201,23 @@ typedef enum {
     TFS_O_APPEND = 0b100,
 } tfs_file_mode_t;
 
+/**
+ * Read-only view of a range of a file, straight into its data blocks.
+ */
+typedef struct {
+    void const *vr_base;
+    size_t vr_len;
+} tfs_view_run_t;
+
+typedef struct {
+    size_t v_len;           // bytes covered by the view
+    int v_run_count;        // runs of contiguous bytes, in file order
+    tfs_view_run_t *v_runs;
+    int v_inumber;          // file whose read lock the view holds (-1 if none)
+    void *v_buffer;         // copy of the range, if the blocks are not in
+                            // memory (then the file is not kept locked)
+} tfs_view_t;
+
 /**
  * Open a file.
  *
@@ -52,11 +229,19 @@ typedef enum {
  *     - create file if it does not exist (TFS_O_CREAT)
  *
  * Returns file handle of the opened file if successful, -1 otherwise.
+ *
+ * Possible errors (in errno):
+ *   - EINVAL: invalid path name.
+ *   - ENOENT: the file (or the target of the symbolic link) does not exist,
+ *     and is not to be created, or its directory does not exist.
+ *   - EISDIR: the file is a directory.
+ *   - ENOSPC: no free inode, or no room in the directory, for a new file.
+ *   - ENOMEM, ENFILE: memory or open file table exhausted.
  */
 int tfs_open(char const *name, tfs_file_mode_t mode);
 
 /**
- * Create a symbolic link to a file.
+ * Create a symbolic link to a file (not to a directory).
  *
  * Input:
  *   - target: absolute path name of the link target
@@ -77,6 +262,35 @@ int tfs_sym_link(char const *target, char const *link_name);
  */
 int tfs_link(char const *target_file, char const *link_name);
 
+/**
+ * Create a directory.
+ *
+ * Input:
+ *   - name: absolute path name of the directory, whose parent directory must
+ *     already exist
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors (in errno):
+ *   - EINVAL: invalid path name.
+ *   - ENAMETOOLONG: the name of the directory is too long.
+ *   - ENOENT: the parent directory does not exist (or is being removed).
+ *   - ENOTDIR: the parent is not a directory.
+ *   - EEXIST: a file or directory of that name exists already.
+ *   - ENOSPC: no free inode, or no room in the parent directory.
+ */
+int tfs_mkdir(char const *name);
+
+/**
+ * Remove an empty directory.
+ *
+ * Input:
+ *   - name: absolute path name of the directory
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_rmdir(char const *name);
+
 /**
  * Close a file.
  *
@@ -87,6 +301,18 @@ int tfs_link(char const *target_file, char const *link_name);
  */
 int tfs_close(int fhandle);
 
+/**
+ * Write the changes to an open file back to the image, waiting for them to
+ * reach the disk (writes otherwise complete once the data is in the buffer
+ * cache, and are written back in the background). See also tfs_sync.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fsync(int fhandle);
+
 /**
  * Write to an open file, starting at the current offset.
  *
@@ -113,9 +339,105 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/**
+ * Write to an open file at a given offset, without using nor changing the
+ * offset of the file handle. Writing past the end of the file fills the gap
+ * with zeros.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: buffer containing the contents to write
+ *   - len: length of the buffer contents (in bytes)
+ *   - offset: file offset where the write starts
+ *
+ * Returns the number of bytes that were written (can be lower than 'len' if the
+ * maximum file size is exceeded), or -1 in case of error.
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset);
+
+/**
+ * Read from an open file at a given offset, without using nor changing the
+ * offset of the file handle. Several threads may read through the same handle
+ * in parallel.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: destination buffer
+ *   - len: length of the buffer
+ *   - offset: file offset where the read starts
+ *
+ * Returns the number of bytes that were copied from the file to the buffer (can
+ * be lower than 'len' if the file size was reached, and 0 if offset is past
+ * it), or -1 in case of error.
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
+/**
+ * Write the contents of several buffers to an open file, in order, starting at
+ * the current offset. The file is locked once and the buffers are gathered in
+ * a single pass, so the write is atomic with respect to other operations on
+ * the file.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: buffers containing the contents to write
+ *   - iovcnt: number of buffers (at most TFS_IOV_MAX)
+ *
+ * Returns the number of bytes that were written (can be lower than the total
+ * length of the buffers if the maximum file size is exceeded, in which case
+ * the buffers are written in order up to that point), or -1 in case of error.
+ */
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt);
+
+/**
+ * Read from an open file into several buffers, filling each of them in turn,
+ * starting at the current offset.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: destination buffers
+ *   - iovcnt: number of buffers (at most TFS_IOV_MAX)
+ *
+ * Returns the number of bytes that were copied from the file to the buffers
+ * (can be lower than their total length if the file size was reached), or -1
+ * in case of error.
+ */
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt);
+
+/**
+ * Lease a read-only view of a range of an open file, without copying it: the
+ * view points straight into the file's data blocks, with one run per run of
+ * contiguous blocks. The offset of the file handle is neither used nor
+ * changed.
+ *
+ * The file stays read-locked until the view is released, so the view must be
+ * released by the same thread, and that thread must not write to (or truncate,
+ * or unlink) the file meanwhile. When the data blocks are not in memory (see
+ * tfs_params.backend), the view is a private copy of the range instead.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - offset: file offset where the view starts
+ *   - len: length of the view
+ *   - view: filled in with the view
+ *
+ * Returns the number of bytes covered by the view (can be lower than 'len' if
+ * the file size was reached), or -1 in case of error (the view is left empty).
+ */
+ssize_t tfs_read_view(int fhandle, size_t offset, size_t len,
+                      tfs_view_t *view);
+
+/**
+ * Release a view obtained from tfs_read_view, unlocking its file.
+ *
+ * Input:
+ *   - view: the view, which is left empty
+ */
+void tfs_release_view(tfs_view_t *view);
+
 /**
  * Delete a link, or a file if the number of hard links reaches 0, that
- * exists in TécnicoFS.
+ * exists in TécnicoFS. Directories are removed with tfs_rmdir instead.
  *
  * Input:
  *   - target: path name of the target (in TécnicoFS)
@@ -126,15 +448,84 @@ int tfs_unlink(char const *target);
 
 /**
  * Copy the contents of a file that exists in the OS' file system tree
- * (outside TécnicoFS) to the TécnicoFS.
+ * (outside TécnicoFS) to the TécnicoFS. Files of any size are copied, in
+ * chunks of COPY_CHUNK_SIZE bytes.
  *
  * Input:
  *   - source_path: path name of the source file (from the OS' file system)
  *   - dest_path: absolute path name of the destination file (in TécnicoFS),
  *    which is created if needed, and overwritten if it already exists.
  *
- * Returns 0 if successful, -1 otherwise.
+ * Returns 0 if successful, -1 otherwise. On failure, the destination is left
+ * empty (or removed, if the copy created it).
+ *
+ * Possible errors (in errno):
+ *   - those of open, fstat and read on the source (EISDIR if a directory);
+ *   - those of tfs_open on the destination;
+ *   - ENOSPC: the file system ran out of blocks (or extents) for the copy.
  */
 int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
 
+/**
+ * Copy the contents of a file in TécnicoFS to a file in the OS' file system
+ * tree, straight from its data blocks: with a single gathered write when they
+ * are in memory (or in the mapped image), and within the kernel
+ * (copy_file_range) when they are in the image file.
+ *
+ * Input:
+ *   - source_path: absolute path name of the source file (in TécnicoFS)
+ *   - dest_path: path name of the destination file (in the OS' file system),
+ *     which is created if needed, and overwritten if it already exists.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors (in errno):
+ *   - those of tfs_open on the source;
+ *   - those of open and write on the destination;
+ *   - EIO: the changes to the source could not be written back to the image.
+ */
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path);
+
+/**
+ * Outcome of a tfs_import_tree.
+ */
+typedef struct {
+    size_t is_files;     // regular files imported
+    size_t is_dirs;      // directories created
+    size_t is_skipped;   // entries of other types (symbolic links, ...)
+    size_t is_failed;    // entries that could not be imported
+    uint64_t is_bytes;   // bytes imported
+    double is_walk_seconds;  // walking the tree (and creating directories),
+                             // while the workers copy the files found
+    double is_drain_seconds; // copying the files left after the walk
+    double is_total_seconds;
+    double is_files_per_second;
+} tfs_import_stats_t;
+
+/**
+ * Copy a directory tree of the OS' file system into TécnicoFS, with a pool of
+ * threads. One thread walks the tree, creating its directories and queueing
+ * its regular files (up to IMPORT_QUEUE_SIZE at a time); the workers copy
+ * the files as with tfs_copy_from_external_fs. Other entries (e.g. symbolic
+ * links) are skipped, and entries that fail do not stop the import.
+ *
+ * Input:
+ *   - host_dir: path name of the directory to copy (in the OS' file system)
+ *   - tfs_dir: absolute path name of an existing directory of TécnicoFS,
+ *     which receives the contents of host_dir
+ *   - nthreads: number of workers (at most IMPORT_MAX_THREADS are used)
+ *   - stats: filled in with the counts and timings of the import, if not
+ *     NULL
+ *
+ * Returns 0 if every entry was imported (or skipped), -1 otherwise.
+ *
+ * Possible errors (in errno, for the first failure):
+ *   - EINVAL: invalid arguments;
+ *   - those of nftw on host_dir;
+ *   - those of tfs_copy_from_external_fs on a file;
+ *   - those of tfs_mkdir on a directory.
+ */
+int tfs_import_tree(char const *host_dir, char const *tfs_dir, int nthreads,
+                    tfs_import_stats_t *stats);
+
 #endif // OPERATIONS_H
@@ -1,12 +1,22 @@
 #include "state.h"
+#include "bcache.h"
 #include "betterassert.h"
+#include "blockdev.h"
+#include "dcache.h"
+#include "stats.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 /*
  * Persistent FS state
@@ -15,29 +25,153 @@
  */
 static tfs_params fs_params;
 
+/*
+ * All persistent state lives in a single region, the image: a superblock, the
+ * inode table, the inode allocation states, the free block bitmap and the data
+ * blocks, in this order. It is mmap'ed from fs_params.image_path if given, and
+ * malloc'ed otherwise. The superblock describes the layout, so that an
+ * existing image is only reused with the same geometry (and by a build with
+ * the same inode_t).
+ */
+typedef struct {
+    uint64_t sb_magic;
+    uint32_t sb_version;
+    uint32_t sb_inode_size; // sizeof(inode_t), as the table is mapped as is
+    uint64_t sb_inode_count;
+    uint64_t sb_block_count;
+    uint64_t sb_block_size;
+    uint64_t sb_inodes_offset;
+    uint64_t sb_inode_states_offset;
+    uint64_t sb_bitmap_offset;
+    uint64_t sb_data_offset;
+    uint64_t sb_image_size;
+} superblock_t;
+
+#define IMAGE_MAGIC (0x31474d4953464354ULL) // "TCFSIMG1"
+#define IMAGE_VERSION (1)
+#define IMAGE_ALIGN (4096) // alignment of the data blocks and the image size
+
+static void *image;
+static size_t image_size;
+static size_t image_map_size; // all of it, or up to the data blocks
+static bool image_mapped;     // mmap'ed from an image file
+static bool image_loaded;     // the image was reused, rather than formatted
+static int image_fd = -1;     // kept open for the file backend only
+
 // Inode table
-static pthread_rwlock_t inode_table_lock;
 static inode_t *inode_table;
 static allocation_state_t *freeinode_ts;
 
+/*
+ * Free inodes are kept in a lock-free (Treiber) stack, linked through
+ * freeinode_next. The top of the stack packs a tag in its upper 32 bits and
+ * (inumber + 1) in its lower 32 bits (0 meaning empty); the tag is bumped on
+ * every update, so a CAS never succeeds against a top that was popped and
+ * pushed back in the meantime (ABA).
+ */
+static _Atomic uint64_t freeinode_top;
+static _Atomic int *freeinode_next;
+
 // Data blocks
-static pthread_rwlock_t data_block_lock;
-static char *fs_data; // # blocks * block size
-static allocation_state_t *free_blocks;
+static tfs_rwlock_t data_block_lock;
+static block_device_t *device;
+static char *fs_data; // # blocks * block size, NULL if the blocks are not in
+                      // memory (file backend)
+static uint64_t *free_blocks; // bitmap, one bit per block (set if taken)
+static size_t free_blocks_hint; // next-fit: block where the next search starts
+
+/*
+ * Per-thread caches ("magazines") of free data blocks.
+ *
+ * Blocks in a magazine are marked as taken in free_blocks, so single block
+ * allocations and frees only touch the thread's own magazine, and go to
+ * free_blocks (under data_block_lock) in batches. All magazines are kept in a
+ * registry, so that a thread that runs out of blocks can take them from the
+ * magazines of other threads.
+ */
+typedef struct block_magazine {
+    tfs_mutex_t lock; // only contended when another thread steals blocks
+    int count;
+    int blocks[BLOCK_MAGAZINE_SIZE];
+    struct block_magazine *next;
+} block_magazine_t;
+
+static pthread_once_t magazines_once = PTHREAD_ONCE_INIT;
+static pthread_key_t magazine_key;
+static tfs_mutex_t magazines_lock =
+    TFS_MUTEX_INITIALIZER(LOCK_CLASS_MAGAZINES);
+static block_magazine_t *magazines; // registry of every thread's magazine
+static _Thread_local block_magazine_t *thread_magazine;
 
 /*
  * Volatile FS state
  */
-static pthread_rwlock_t fs_state_lock;
-static open_file_entry_t *open_file_table;
-static allocation_state_t *free_open_file_entries;
+
+/*
+ * In-memory index of each directory (indexed by inumber): the bucket table of
+ * its extendible hash, mapping each hash prefix to the block holding the
+ * matching names. It is built lazily from the headers of the directory blocks,
+ * which remain the source of truth, and is protected by the directory's rwlock
+ * (plus build_lock, as readers may build it concurrently).
+ */
+typedef struct {
+    tfs_mutex_t build_lock;
+    atomic_bool valid;
+    uint32_t depth;   // global depth: the table has 2^depth slots
+    int *buckets;     // block of the bucket for each hash prefix
+    size_t capacity;  // allocated slots
+} dir_index_t;
+
+static dir_index_t *dir_indexes;
+
+/*
+ * Open file table.
+ *
+ * The table grows in chunks that are never moved nor freed while the FS is up,
+ * so entries can be looked up without locks: chunk k holds the
+ * (max_open_files_count * 2^k) handles that follow those of chunk k - 1. Each
+ * slot has an atomic state word, telling whether its handle is open.
+ *
+ * Closed handles go to a lock-free (Treiber) stack, with a tagged top just
+ * like the free inode stack, and each thread keeps a small cache of closed
+ * handles in front of it. Handles that were never used are taken from
+ * open_file_count, which grows the table as needed.
+ */
+typedef struct {
+    atomic_int of_state; // allocation_state_t
+    atomic_int of_next;  // next handle in the free handle stack
+    open_file_entry_t of_entry;
+} open_file_slot_t;
+
+typedef struct handle_cache {
+    tfs_mutex_t lock; // only contended when the FS is destroyed
+    int count;
+    int handles[OPEN_FILE_CACHE_SIZE];
+    struct handle_cache *next;
+} handle_cache_t;
+
+static _Atomic(open_file_slot_t *) open_file_chunks[OPEN_FILE_CHUNKS];
+static atomic_size_t open_file_count; // handles handed out at least once
+static _Atomic uint64_t free_handles_top;
+
+static pthread_once_t handle_caches_once = PTHREAD_ONCE_INIT;
+static pthread_key_t handle_cache_key;
+static tfs_mutex_t handle_caches_lock =
+    TFS_MUTEX_INITIALIZER(LOCK_CLASS_HANDLE_CACHES);
+static handle_cache_t *handle_caches; // registry of every thread's cache
+static _Thread_local handle_cache_t *thread_handle_cache;
 
 // Convenience macros
 #define INODE_TABLE_SIZE (fs_params.max_inode_count)
 #define DATA_BLOCKS (fs_params.max_block_count)
-#define MAX_OPEN_FILES (fs_params.max_open_files_count)
+#define OPEN_FILE_CHUNK_BASE                                                   \
+    (fs_params.max_open_files_count > 0 ? fs_params.max_open_files_count : 1)
 #define BLOCK_SIZE (fs_params.block_size)
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
+#define DIR_BUCKET_ENTRIES                                                     \
+    ((BLOCK_SIZE - sizeof(dir_bucket_t)) / sizeof(dir_entry_t))
+#define MAX_EXTENTS (INODE_DIRECT_EXTENTS + BLOCK_SIZE / sizeof(extent_t))
+#define BITMAP_WORD_BITS (64)
+#define BITMAP_WORDS ((DATA_BLOCKS + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
 
 static inline bool valid_inumber(int inumber) {
     return inumber >= 0 && inumber < INODE_TABLE_SIZE;
@@ -47,46 +181,247 @@ static inline bool valid_block_number(int block_number) {
     return block_number >= 0 && block_number < DATA_BLOCKS;
 }
 
-static inline bool valid_file_handle(int file_handle) {
-    return file_handle >= 0 && file_handle < MAX_OPEN_FILES;
+size_t state_block_size(void) { return BLOCK_SIZE; }
+
+/**
+ * Artifically delay execution.
+ *
+ * Auxiliary function to insert a delay.
+ * Used in accesses to persistent FS state as a way of emulating access
+ * latencies as if such data structures were really stored in secondary memory.
+ * The cost of an access is set by the block device (a busy loop of DELAY
+ * iterations, unless a latency model is configured).
+ *
+ * Input:
+ *   - inumber: the inode accessed (traced), or -1
+ *   - block: the (first) data block accessed (traced), or -1
+ */
+static void insert_delay(int inumber, int block) {
+    STATS_SCOPE(TFS_OP_BLOCK_ACCESS);
+    STATS_TARGET(inumber, block);
+    device->access(device);
 }
 
-size_t state_block_size(void) { return BLOCK_SIZE; }
+static void magazines_init(void);
+static void magazine_flush(block_magazine_t *mag, int count);
+static void handle_caches_init(void);
+static void dir_bucket_init(int block_number, uint32_t prefix, uint32_t depth);
+
+static size_t align_up(size_t n, size_t alignment) {
+    return (n + alignment - 1) / alignment * alignment;
+}
 
 /**
- * Do nothing, while preventing the compiler from performing any optimizations.
+ * Compute the layout of the image for the current parameters.
+ */
+static superblock_t image_layout(void) {
+    superblock_t sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.sb_magic = IMAGE_MAGIC;
+    sb.sb_version = IMAGE_VERSION;
+    sb.sb_inode_size = sizeof(inode_t);
+    sb.sb_inode_count = INODE_TABLE_SIZE;
+    sb.sb_block_count = DATA_BLOCKS;
+    sb.sb_block_size = BLOCK_SIZE;
+
+    size_t offset = align_up(sizeof(superblock_t), 64);
+    sb.sb_inodes_offset = offset;
+    offset = align_up(offset + INODE_TABLE_SIZE * sizeof(inode_t), 64);
+    sb.sb_inode_states_offset = offset;
+    offset = align_up(offset + INODE_TABLE_SIZE * sizeof(allocation_state_t),
+                      64);
+    sb.sb_bitmap_offset = offset;
+    offset = align_up(offset + BITMAP_WORDS * sizeof(uint64_t), IMAGE_ALIGN);
+    sb.sb_data_offset = offset;
+    offset += DATA_BLOCKS * BLOCK_SIZE;
+    sb.sb_image_size = align_up(offset, IMAGE_ALIGN);
+    return sb;
+}
+
+/**
+ * Whether the data blocks are accessed in the image file, rather than in
+ * memory.
+ */
+static bool data_in_file(void) { return fs_params.backend != TFS_BACKEND_RAM; }
+
+/**
+ * Obtain the region backing the persistent state: the image file, mapped
+ * (after checking its superblock against layout, if it is not a new file), or
+ * fresh memory.
  *
- * We need to defeat the optimizer for the insert_delay() function.
- * Under optimization, the empty loop would be completely optimized away.
- * This function tells the compiler that the assembly code being run (which is
- * none) might potentially change *all memory in the process*.
+ * Returns 0 if successful, -1 otherwise.
  *
- * This prevents the optimizer from optimizing this code away, because it does
- * not know what it does and it may have side effects.
+ * Possible errors:
+ *   - The image file cannot be opened, resized or mapped.
+ *   - The image file was created with another geometry, or is corrupt.
+ *   - malloc failure.
+ */
+static int image_open(superblock_t const *layout) {
+    image_size = layout->sb_image_size;
+    image_loaded = false;
+    image_mapped = false;
+
+    if (fs_params.image_path == NULL) {
+        if (data_in_file()) {
+            return -1; // the file backends keep the blocks in the image
+        }
+        image_map_size = image_size;
+        image = aligned_alloc(IMAGE_ALIGN, image_size);
+        return image != NULL ? 0 : -1;
+    }
+
+    int fd = open(fs_params.image_path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size == 0) {
+        // a new image, to be formatted
+        if (ftruncate(fd, (off_t)image_size) == -1) {
+            close(fd);
+            return -1;
+        }
+    } else if ((size_t)st.st_size != image_size) {
+        close(fd);
+        return -1; // another geometry (or a truncated image)
+    } else {
+        image_loaded = true;
+    }
+
+    // with the file backends, the data blocks are accessed through fd
+    image_map_size = data_in_file() ? layout->sb_data_offset : image_size;
+    image = mmap(NULL, image_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                 0);
+    if (image == MAP_FAILED) {
+        close(fd);
+        image = NULL;
+        return -1;
+    }
+    image_mapped = true;
+
+    if (image_loaded && memcmp(image, layout, sizeof(superblock_t)) != 0) {
+        close(fd);
+        munmap(image, image_map_size);
+        image = NULL;
+        return -1; // another geometry, or not an image at all
+    }
+
+    if (data_in_file()) {
+        image_fd = fd;
+    } else {
+        close(fd); // the mapping stays valid
+    }
+    return 0;
+}
+
+/**
+ * Create the block device for the current parameters, over the data blocks of
+ * the image.
  *
- * Reference with more information: https://youtu.be/nXaxk27zwlk?t=2775
+ * Returns the device, or NULL if malloc fails.
+ */
+static block_device_t *device_create(superblock_t const *layout) {
+    block_device_t *dev = NULL;
+    off_t offset = (off_t)layout->sb_data_offset;
+    switch (fs_params.backend) {
+    case TFS_BACKEND_RAM:
+        dev = blockdev_ram_create(fs_data, BLOCK_SIZE);
+        break;
+    case TFS_BACKEND_FILE:
+        dev = blockdev_file_create(image_fd, offset, BLOCK_SIZE);
+        break;
+    case TFS_BACKEND_URING:
+        dev = blockdev_uring_create(image_fd, offset, BLOCK_SIZE);
+        if (dev != NULL) {
+            break;
+        }
+        // io_uring is unavailable: fall back to the thread pool
+        // fall through
+    case TFS_BACKEND_THREAD_POOL:
+        dev = blockdev_pool_create(image_fd, offset, BLOCK_SIZE);
+        break;
+    default:
+        break;
+    }
+    if (dev != NULL && data_in_file()) {
+        image_fd = -1; // now owned by the device
+    }
+
+    if (dev != NULL &&
+        (fs_params.device_latency_ns > 0 || fs_params.device_bandwidth > 0)) {
+        block_device_t *model = blockdev_latency_create(
+            dev, fs_params.device_latency_ns, fs_params.device_bandwidth);
+        if (model == NULL) {
+            dev->destroy(dev);
+        }
+        dev = model;
+    }
+    return dev;
+}
+
+/**
+ * Write the image back to its file, if any, and release it.
  *
- * Exercise: try removing this function and look at the assembly generated to
- * compare.
+ * Returns 0 if successful, -1 if the image could not be written back.
  */
-static void touch_all_memory(void) { __asm volatile("" : : : "memory"); }
+static int image_close(void) {
+    int result = 0;
+    if (image_fd != -1) {
+        close(image_fd);
+        image_fd = -1;
+    }
+    if (image_mapped) {
+        result = msync(image, image_map_size, MS_SYNC);
+        munmap(image, image_map_size);
+    } else {
+        free(image);
+    }
+    image = NULL;
+    return result;
+}
 
 /**
- * Artifically delay execution (busy loop).
+ * Undo what a state_init that failed got to set up, so that it can be tried
+ * again.
  *
- * Auxiliary function to insert a delay.
- * Used in accesses to persistent FS state as a way of emulating access
- * latencies as if such data structures were really stored in secondary memory.
+ * Input:
+ *   - cached: whether the buffer cache was initialized
  */
-static void insert_delay(void) {
-    for (int i = 0; i < DELAY; i++) {
-        touch_all_memory();
+static void state_init_unwind(bool cached) {
+    free(freeinode_next);
+    free(dir_indexes);
+    if (cached) {
+        bcache_destroy();
+    }
+    if (device != NULL) {
+        device->destroy(device);
+        device = NULL;
     }
+    image_close();
+    if (fs_params.image_path != NULL && !image_loaded) {
+        // a new image goes back to empty, to be formatted next time
+        truncate(fs_params.image_path, 0);
+    }
+
+    inode_table = NULL;
+    freeinode_ts = NULL;
+    freeinode_next = NULL;
+    fs_data = NULL;
+    free_blocks = NULL;
+    dir_indexes = NULL;
 }
 
 /**
  * Initialize FS state.
  *
+ * The persistent state comes from the image file in params, if it exists, and
+ * is formatted otherwise. The volatile state is always built from scratch.
+ *
  * Input:
  *   - params: TécnicoFS parameters
  *
@@ -95,93 +430,422 @@ static void insert_delay(void) {
  * Possible errors:
  *   - TFS already initialized.
  *   - malloc failure when allocating TFS structures.
+ *   - The image file cannot be used (see image_open).
  */
 int state_init(tfs_params params) {
-    fs_params = params;
-
     if (inode_table != NULL) {
         return -1; // already initialized
     }
-    
-    pthread_rwlock_init(&inode_table_lock, NULL);
-    pthread_rwlock_init(&data_block_lock, NULL);
-    inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
-    freeinode_ts = malloc(INODE_TABLE_SIZE * sizeof(allocation_state_t));
-    fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
-    free_blocks = malloc(DATA_BLOCKS * sizeof(allocation_state_t));
-    open_file_table = malloc(MAX_OPEN_FILES * sizeof(open_file_entry_t));
-    free_open_file_entries =
-        malloc(MAX_OPEN_FILES * sizeof(allocation_state_t));
-
-    if (!inode_table || !freeinode_ts || !fs_data || !free_blocks ||
-        !open_file_table || !free_open_file_entries) {
+    fs_params = params;
+
+    superblock_t layout = image_layout();
+    if (image_open(&layout) != 0) {
+        return -1;
+    }
+    char *base = image;
+    inode_table = (inode_t *)(void *)(base + layout.sb_inodes_offset);
+    freeinode_ts =
+        (allocation_state_t *)(void *)(base + layout.sb_inode_states_offset);
+    free_blocks = (uint64_t *)(void *)(base + layout.sb_bitmap_offset);
+    fs_data = image_map_size > layout.sb_data_offset
+                  ? base + layout.sb_data_offset
+                  : NULL;
+
+    device = device_create(&layout);
+    if (device == NULL) {
+        state_init_unwind(false);
+        return -1;
+    }
+    bool cached = !data_blocks_mapped();
+    if (cached) {
+        size_t capacity = fs_params.cache_size / BLOCK_SIZE;
+        if (capacity > DATA_BLOCKS) {
+            capacity = DATA_BLOCKS; // nothing more to cache
+        }
+        if (bcache_init(device, capacity) != 0) {
+            state_init_unwind(false);
+            return -1;
+        }
+    }
+
+#ifdef TFS_LOCK_PROFILE
+    lockprof_reset();
+#endif
+    tfs_rwlock_init(&data_block_lock, LOCK_CLASS_DATA_BLOCKS);
+    freeinode_next = malloc(INODE_TABLE_SIZE * sizeof(*freeinode_next));
+    dir_indexes = malloc(INODE_TABLE_SIZE * sizeof(dir_index_t));
+
+    if (!freeinode_next || !dir_indexes) {
+        state_init_unwind(cached);
         return -1; // allocation failed
     }
 
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        freeinode_ts[i] = FREE;
+    if (dcache_init() != 0) {
+        state_init_unwind(cached);
+        return -1;
     }
 
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
+    if (!image_loaded) {
+        memcpy(image, &layout, sizeof(superblock_t));
+        for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+            freeinode_ts[i] = FREE;
+        }
+
+        for (size_t i = 0; i < BITMAP_WORDS; i++) {
+            free_blocks[i] = 0;
+        }
+        // the padding bits after the last block are marked as taken, so that
+        // the searches never return them
+        if (DATA_BLOCKS % BITMAP_WORD_BITS != 0) {
+            free_blocks[BITMAP_WORDS - 1] =
+                ~0ULL << (DATA_BLOCKS % BITMAP_WORD_BITS);
+        }
     }
 
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        free_open_file_entries[i] = FREE;
+    // seed the free inode stack from the allocation states, so that inodes are
+    // handed out from 0 up
+    int top = -1;
+    for (size_t i = INODE_TABLE_SIZE; i-- > 0;) {
+        if (freeinode_ts[i] == FREE) {
+            atomic_init(&freeinode_next[i], top);
+            top = (int)i;
+        }
+        // the locks in an image are not valid across processes; they are set
+        // up here once for every slot (not when an inode is created), as a
+        // thread may still wait on the lock of an inode whose slot is reused
+        tfs_rwlock_init(&inode_table[i].rwlock, LOCK_CLASS_INODE);
+
+        tfs_mutex_init(&dir_indexes[i].build_lock, LOCK_CLASS_DIR_INDEX);
+        atomic_init(&dir_indexes[i].valid, false);
+        dir_indexes[i].buckets = NULL;
+        dir_indexes[i].capacity = 0;
+    }
+    atomic_init(&freeinode_top, (uint64_t)(uint32_t)(top + 1));
+
+    free_blocks_hint = 0;
+    pthread_once(&magazines_once, magazines_init);
+
+    for (size_t i = 0; i < OPEN_FILE_CHUNKS; i++) {
+        atomic_init(&open_file_chunks[i], NULL);
     }
+    atomic_init(&open_file_count, 0);
+    atomic_init(&free_handles_top, 0);
+    pthread_once(&handle_caches_once, handle_caches_init);
 
     return 0;
 }
 
+#ifdef TFS_LOCK_PROFILE
+static lock_profile_t const *inode_lock_profile(size_t inumber) {
+    return &inode_table[inumber].rwlock.lk_prof;
+}
+#endif
+
 /**
  * Destroy FS state.
  *
  * Returns 0 if succesful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The image could not be written back to its file.
  */
 int state_destroy(void) {
-    free(inode_table);
-    free(freeinode_ts);
-    free(fs_data);
-    free(free_blocks);
-    free(open_file_table);
-    free(free_open_file_entries);
+    // the blocks cached by the threads go back to the bitmap, which may
+    // outlive this process
+    tfs_mutex_lock(&magazines_lock);
+    for (block_magazine_t *mag = magazines; mag != NULL; mag = mag->next) {
+        tfs_mutex_lock(&mag->lock);
+        magazine_flush(mag, mag->count);
+        tfs_mutex_unlock(&mag->lock);
+    }
+    tfs_mutex_unlock(&magazines_lock);
+
+    // the handles cached by the threads belong to the state being destroyed
+    tfs_mutex_lock(&handle_caches_lock);
+    for (handle_cache_t *c = handle_caches; c != NULL; c = c->next) {
+        tfs_mutex_lock(&c->lock);
+        c->count = 0;
+        tfs_mutex_unlock(&c->lock);
+    }
+    tfs_mutex_unlock(&handle_caches_lock);
+
+#ifdef TFS_LOCK_PROFILE
+    lockprof_report(stderr, inode_lock_profile, INODE_TABLE_SIZE);
+#endif
+
+    free(freeinode_next);
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        free(dir_indexes[i].buckets);
+        tfs_mutex_destroy(&dir_indexes[i].build_lock);
+    }
+    free(dir_indexes);
+    dcache_destroy();
+    for (size_t i = 0; i < OPEN_FILE_CHUNKS; i++) {
+        free(atomic_exchange(&open_file_chunks[i], NULL));
+    }
+    int result = 0;
+    if (!data_blocks_mapped() && bcache_destroy() != 0) {
+        result = -1; // the dirty blocks could not be written back
+    }
+    if (device->flush(device) != 0) {
+        result = -1;
+    }
+    device->destroy(device);
+    device = NULL;
+    if (image_close() != 0) {
+        result = -1;
+    }
 
     inode_table = NULL;
     freeinode_ts = NULL;
+    freeinode_next = NULL;
     fs_data = NULL;
     free_blocks = NULL;
-    open_file_table = NULL;
-    free_open_file_entries = NULL;
+    dir_indexes = NULL;
 
-    return 0;
+    return result;
+}
+
+/**
+ * Check whether the persistent state was loaded from an existing image, rather
+ * than formatted by state_init.
+ */
+bool state_loaded(void) { return image_loaded; }
+
+/**
+ * Flush the block device and the image file (if any), waiting for what was
+ * written to them to reach the disk.
+ */
+static int device_image_sync(void) {
+    if (device->flush(device) != 0) {
+        return -1;
+    }
+    if (!image_mapped) {
+        return 0;
+    }
+    return msync(image, image_map_size, MS_SYNC);
+}
+
+/**
+ * Write the persistent state back to the image file (if any) and the dirty
+ * data blocks back to the block device, waiting for both to reach the disk.
+ *
+ * Blocks cached in the threads' magazines are marked as taken in the image, so
+ * they are lost if the process dies before state_destroy.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int state_sync(void) {
+    if (!data_blocks_mapped() && bcache_sync() != 0) {
+        return -1;
+    }
+    return device_image_sync();
+}
+
+/**
+ * Write the dirty data blocks of an inode back to the block device, and the
+ * persistent state (which holds the inode) to the image file, waiting for
+ * both to reach the disk.
+ *
+ * Input:
+ *   - inode: the inode (locked by the caller)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int inode_sync(inode_t const *inode) {
+    if (!data_blocks_mapped()) {
+        for (int i = 0; i < inode->i_extent_count; i++) {
+            extent_t ext = inode_extent(inode, i);
+            if (bcache_sync_range((size_t)ext.e_start,
+                                  (size_t)ext.e_length) != 0) {
+                return -1;
+            }
+        }
+    }
+    return device_image_sync();
+}
+
+/**
+ * Write the contents of an inode to a file outside the FS, straight from its
+ * runs of data blocks: the device copies them out (with a single gathered
+ * write if they are in memory, or within the kernel if they are in the image
+ * file). Blocks changed in the buffer cache are written back first.
+ *
+ * Input:
+ *   - inode: the inode (read-locked by the caller)
+ *   - out: file descriptor of the destination, written from offset 0 on
+ *
+ * Returns 0 if successful, -1 otherwise (with errno set).
+ */
+int inode_copy_out(inode_t const *inode, int out) {
+    block_copy_t *ranges =
+        malloc((size_t)inode->i_extent_count * sizeof(block_copy_t));
+    if (ranges == NULL && inode->i_extent_count > 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t n = 0;
+    size_t left = inode->i_size;
+    bool mapped = data_blocks_mapped();
+    for (int i = 0; i < inode->i_extent_count && left > 0; i++) {
+        extent_t ext = inode_extent(inode, i);
+        size_t len = (size_t)ext.e_length * BLOCK_SIZE;
+        if (len > left) {
+            len = left;
+        }
+        size_t blocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (!mapped && bcache_sync_range((size_t)ext.e_start, blocks) != 0) {
+            free(ranges);
+            errno = EIO;
+            return -1;
+        }
+        ranges[n++] = (block_copy_t){
+            .bc_block = (size_t)ext.e_start, .bc_within = 0, .bc_len = len};
+        left -= len;
+    }
+
+    int result = 0;
+    if (n > 0) {
+        // simulate storage access delay to the runs
+        insert_delay((int)(inode - inode_table), (int)ranges[0].bc_block);
+        result = device->copy_out(device, ranges, n, out, 0);
+    }
+    free(ranges);
+    return result;
+}
+
+/**
+ * Read ahead the data blocks an open file is going to need, when its reads go
+ * through it in order (see inode_readahead).
+ */
+static void file_readahead(open_file_entry_t *file, inode_t const *inode,
+                           size_t offset, size_t len) {
+    size_t end = offset + len;
+    bool sequential = offset == file->of_ra_next;
+    file->of_ra_next = end;
+    if (!sequential) {
+        file->of_ra_window = 0;
+        file->of_ra_end = end;
+        return;
+    }
+    if (fs_params.readahead_window == 0 || data_blocks_mapped() || len == 0) {
+        return;
+    }
+
+    size_t window = file->of_ra_window;
+    if (window > 0 && file->of_ra_end > end &&
+        file->of_ra_end - end >= window * BLOCK_SIZE / 2) {
+        return; // far enough ahead still
+    }
+    window *= 2;
+    if (window < READAHEAD_MIN_BLOCKS) {
+        window = READAHEAD_MIN_BLOCKS;
+    }
+    if (window > fs_params.readahead_window) {
+        window = fs_params.readahead_window;
+    }
+    file->of_ra_window = window;
+
+    size_t from = (file->of_ra_end > end ? file->of_ra_end : end) / BLOCK_SIZE;
+    size_t to = (end + BLOCK_SIZE - 1) / BLOCK_SIZE + window;
+    size_t last = (inode->i_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (to > last) {
+        to = last;
+    }
+    if (from >= to) {
+        return;
+    }
+    file->of_ra_end = to * BLOCK_SIZE;
+
+    size_t ext_first = 0; // file block where the current extent starts
+    for (int i = 0; i < inode->i_extent_count && ext_first < to; i++) {
+        extent_t ext = inode_extent(inode, i);
+        size_t ext_end = ext_first + (size_t)ext.e_length;
+        if (from < ext_end) {
+            size_t first = from > ext_first ? from : ext_first;
+            size_t stop = to < ext_end ? to : ext_end;
+            bcache_readahead((size_t)ext.e_start + (first - ext_first),
+                             stop - first);
+        }
+        ext_first = ext_end;
+    }
+}
+
+/**
+ * Read ahead the data blocks an open file is going to need, when its reads go
+ * through it in order.
+ *
+ * A read starting where the previous one ended is sequential: the window
+ * starts at READAHEAD_MIN_BLOCKS, and the blocks up to a window past the end
+ * of the read are queued for the buffer cache to read in the background.
+ * Once the reads get within half a window of the end of what was read ahead,
+ * the window doubles (up to tfs_params.readahead_window) and the next blocks
+ * are queued. Any other read resets the window. Data blocks in memory are
+ * never read ahead.
+ *
+ * Input:
+ *   - file: the open file entry
+ *   - inode: its inode (locked by the caller)
+ *   - offset: file offset where the read started
+ *   - len: number of bytes it read
+ */
+void inode_readahead(open_file_entry_t *file, inode_t const *inode,
+                     size_t offset, size_t len) {
+    if (atomic_flag_test_and_set(&file->of_ra_busy)) {
+        return; // a parallel read of the same handle is at it
+    }
+    file_readahead(file, inode, offset, len);
+    atomic_flag_clear(&file->of_ra_busy);
 }
 
 /**
  * (Try to) Allocate a new inode in the inode table, without initializing its
  * data.
  *
+ * Pops the free inode stack, in O(1) and without taking any lock.
+ *
  * Returns the inumber of the newly allocated inode, or -1 in the case of error.
  *
  * Possible errors:
  *   - No free slots in inode table.
  */
 static int inode_alloc(void) {
-    for (size_t inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
+    insert_delay(-1, -1); // simulate storage access delay (to freeinode_ts)
+
+    uint64_t top = atomic_load(&freeinode_top);
+    int inumber;
+    do {
+        inumber = (int)(uint32_t)top - 1;
+        if (inumber == -1) {
+            return -1; // no free inodes
         }
 
-        // Finds first free entry in inode table
-        if (freeinode_ts[inumber] == FREE) {
-            //  Found a free entry, so takes it for the new inode
-            freeinode_ts[inumber] = TAKEN;
-
-            return (int)inumber;
+        int next = atomic_load(&freeinode_next[inumber]);
+        uint64_t new_top = (((top >> 32) + 1) << 32) | (uint32_t)(next + 1);
+        if (atomic_compare_exchange_weak(&freeinode_top, &top, new_top)) {
+            break;
         }
-    }
+    } while (true);
 
-    // no free inodes
-    return -1;
+    ALWAYS_ASSERT(freeinode_ts[inumber] == FREE,
+                  "inode_alloc: inode in the free stack is taken");
+    freeinode_ts[inumber] = TAKEN;
+    return inumber;
+}
+
+/**
+ * Push an inode back onto the free inode stack.
+ */
+static void inode_free(int inumber) {
+    freeinode_ts[inumber] = FREE;
+
+    uint64_t top = atomic_load(&freeinode_top);
+    uint64_t new_top;
+    do {
+        atomic_store(&freeinode_next[inumber], (int)(uint32_t)top - 1);
+        new_top = (((top >> 32) + 1) << 32) | (uint32_t)(inumber + 1);
+    } while (!atomic_compare_exchange_weak(&freeinode_top, &top, new_top));
 }
 
 /**
@@ -189,8 +853,8 @@ static int inode_alloc(void) {
  *
  * Allocates and initializes a new inode.
  * Directories will have their data block allocated and initialized, with i_size
- * set to BLOCK_SIZE. Regular files will not have their data block allocated
- * (i_size will be set to 0, i_data_block to -1).
+ * set to BLOCK_SIZE. Regular files will not have any data block allocated
+ * (i_size and i_block_count will be set to 0, with no extents).
  *
  * Input:
  *   - i_type: the type of the node (file or directory)
@@ -202,57 +866,46 @@ static int inode_alloc(void) {
  *   - (if creating a directory) No free data blocks.
  */
 int inode_create(inode_type i_type) {
-    pthread_rwlock_wrlock(&inode_table_lock);
+    STATS_SCOPE(TFS_OP_INODE_CREATE);
     int inumber = inode_alloc();
     if (inumber == -1) {
-        pthread_rwlock_unlock(&inode_table_lock);
         return -1; // no free slots in inode table
     }
 
+    STATS_TARGET(inumber, -1);
     inode_t *inode = &inode_table[inumber];
-    insert_delay(); // simulate storage access delay (to inode)
+    insert_delay(inumber, -1); // simulate storage access delay (to inode)
 
     inode->i_node_type = i_type;
+    inode->i_size = 0;
+    inode->i_block_count = 0;
+    inode->i_extent_count = 0;
+    inode->i_extent_block = -1;
+    inode->hard_links = 1;
+    inode->sym_link = false;
+
     switch (i_type) {
     case T_DIRECTORY: {
-        // Initializes directory (filling its block with empty entries, labeled
-        // with inumber==-1)
-        int b = data_block_alloc();
-        if (b == -1) {
-            // ensure fields are initialized
-            inode->i_size = 0;
-            inode->i_data_block = -1;
-
-            // run regular deletion process
-            inode_delete(inumber);
-            pthread_rwlock_unlock(&inode_table_lock);
+        // Initializes directory (a single bucket, for every hash, filled with
+        // empty entries, labeled with inumber==-1)
+        if (inode_grow(inode, 1) != 1) {
+            // nothing was allocated for the inode, so just release its slot
+            inode_free(inumber);
             return -1;
         }
 
-        inode_table[inumber].i_size = BLOCK_SIZE;
-        inode_table[inumber].i_data_block = b;
-        pthread_rwlock_init(&inode_table[inumber].rwlock, NULL);
-
-        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-        ALWAYS_ASSERT(dir_entry != NULL,
-                      "inode_create: data block freed while in use");
+        inode->i_size = BLOCK_SIZE;
+        dir_bucket_init(inode->i_extents[0].e_start, 0, 0);
 
-        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-            dir_entry[i].d_inumber = -1;
-        }
+        // the index of a previous directory with this inumber is stale
+        atomic_store(&dir_indexes[inumber].valid, false);
     } break;
     case T_FILE:
-        // In case of a new file, simply sets its size to 0
-        inode_table[inumber].i_size = 0;
-        inode_table[inumber].i_data_block = -1;
-        //init inode hard links
-        inode_table[inumber].hard_links = 1;
-        pthread_rwlock_init(&inode_table[inumber].rwlock, NULL);
+        // In case of a new file, the fields above already describe it
         break;
     default:
         PANIC("inode_create: unknown file type");
     }
-    pthread_rwlock_unlock(&inode_table_lock);
     return inumber;
 }
 
@@ -263,133 +916,555 @@ int inode_create(inode_type i_type) {
  *   - inumber: inode's number
  */
 void inode_delete(int inumber) {
-    pthread_rwlock_wrlock(&inode_table_lock);
+    STATS_SCOPE(TFS_OP_INODE_DELETE);
+    STATS_TARGET(inumber, -1);
     // simulate storage access delay (to inode and freeinode_ts)
-    insert_delay();
-    insert_delay();
+    insert_delay(inumber, -1);
+    insert_delay(-1, -1);
 
     ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
 
     ALWAYS_ASSERT(freeinode_ts[inumber] == TAKEN,
                   "inode_delete: inode already freed");
 
-    if (inode_table[inumber].i_size > 0) {
-        data_block_free(inode_table[inumber].i_data_block);
-    }
+    inode_truncate(&inode_table[inumber]);
 
-    freeinode_ts[inumber] = FREE;
-    pthread_rwlock_unlock(&inode_table_lock);
+    inode_free(inumber);
 }
 
 /**
  * Obtain a pointer to an inode from its inumber.
  *
+ * Takes no lock: synchronizing accesses to the inode's fields is up to the
+ * caller, through the inode's rwlock.
+ *
  * Input:
  *   - inumber: inode's number
  *
  * Returns pointer to inode.
  */
 inode_t *inode_get(int inumber) {
-    pthread_rwlock_rdlock(&inode_table_lock);
-    pthread_rwlock_rdlock(&inode_table[inumber].rwlock);
+    STATS_SCOPE(TFS_OP_INODE_GET);
+    STATS_TARGET(inumber, -1);
     ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
 
-    insert_delay(); // simulate storage access delay to inode
-    pthread_rwlock_unlock(&inode_table_lock);
-    pthread_rwlock_unlock(&inode_table[inumber].rwlock);
+    insert_delay(inumber, -1); // simulate storage access delay to inode
     return &inode_table[inumber];
 } 
 
 /**
- * Clear the directory entry associated with a sub file.
- *
- * Input:
- *   - inode: directory inode
- *   - sub_name: sub file name
- *
- * Returns 0 if successful, -1 otherwise.
- *
- * Possible errors:
- *   - inode is not a directory inode.
- *   - Directory does not contain an entry for sub_name.
+ * Read one of the extents of an inode, which may live inline in the inode or
+ * in its overflow extent block.
  */
-int clear_dir_entry(inode_t *inode, char const *sub_name) {
-    pthread_rwlock_wrlock(&inode->rwlock);
-    insert_delay();
-    if (inode->i_node_type != T_DIRECTORY) {
-        pthread_rwlock_unlock(&inode->rwlock);
-        return -1; // not a directory
+static extent_t extent_read(inode_t const *inode, int index) {
+    if (index < INODE_DIRECT_EXTENTS) {
+        return inode->i_extents[index];
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "clear_dir_entry: directory must have a data block");
-
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (!strcmp(dir_entry[i].d_name, sub_name)) {
-            dir_entry[i].d_inumber = -1;
-            memset(dir_entry[i].d_name, 0, MAX_FILE_NAME);
+    extent_t const *overflow = data_block_get(inode->i_extent_block);
+    extent_t ext = overflow[index - INODE_DIRECT_EXTENTS];
+    data_block_put(inode->i_extent_block, false);
+    return ext;
+}
 
-            pthread_rwlock_unlock(&inode->rwlock);
-            return 0;
-        }
+/**
+ * Write one of the extents of an inode (see extent_read).
+ */
+static void extent_write(inode_t *inode, int index, extent_t ext) {
+    if (index < INODE_DIRECT_EXTENTS) {
+        inode->i_extents[index] = ext;
+        return;
     }
-    pthread_rwlock_unlock(&inode->rwlock);
-    return -1; // sub_name not found
+
+    extent_t *overflow = data_block_get(inode->i_extent_block);
+    overflow[index - INODE_DIRECT_EXTENTS] = ext;
+    data_block_put(inode->i_extent_block, true);
 }
 
 /**
- * Store the inumber for a sub file in a directory.
+ * Obtain one of the extents of an inode.
  *
  * Input:
- *   - inode: directory inode
- *   - sub_name: sub file name
- *   - sub_inumber: inumber of the sub inode
+ *   - inode: the inode
+ *   - index: extent index, between 0 and i_extent_count - 1
+ *
+ * Returns the extent.
+ */
+extent_t inode_extent(inode_t const *inode, int index) {
+    ALWAYS_ASSERT(index >= 0 && index < inode->i_extent_count,
+                  "inode_extent: invalid extent index");
+    return extent_read(inode, index);
+}
+
+/**
+ * Append a run of blocks to the data of an inode, merging it with the last
+ * extent when the two are contiguous.
  *
  * Returns 0 if successful, -1 otherwise.
  *
  * Possible errors:
- *   - inode is not a directory inode.
- *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
- *   - Directory is already full of entries.
+ *   - The inode already has MAX_EXTENTS extents.
+ *   - No free data block for the overflow extent block.
  */
-int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
-    pthread_rwlock_wrlock(&inode->rwlock);
-    if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
-        pthread_rwlock_unlock(&inode->rwlock);
-        return -1; // invalid sub_name
+static int inode_append_run(inode_t *inode, int start, int length) {
+    int count = inode->i_extent_count;
+    if (count > 0) {
+        extent_t last = extent_read(inode, count - 1);
+        if (last.e_start + last.e_length == start) {
+            last.e_length += length;
+            extent_write(inode, count - 1, last);
+            return 0;
+        }
     }
 
-    insert_delay(); // simulate storage access delay to inode with inumber
-    if (inode->i_node_type != T_DIRECTORY) {
-        pthread_rwlock_unlock(&inode->rwlock);
-        return -1; // not a directory
+    if (count == MAX_EXTENTS) {
+        return -1; // no room for another extent
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "add_dir_entry: directory must have a data block");
-
-    // Finds and fills the first empty entry
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = '\0';
-            
-            pthread_rwlock_unlock(&inode->rwlock);
-            return 0;
+    if (count == INODE_DIRECT_EXTENTS && inode->i_extent_block == -1) {
+        int b = data_block_alloc();
+        if (b == -1) {
+            return -1; // no space for the overflow extents
         }
+        inode->i_extent_block = b;
     }
 
-    pthread_rwlock_unlock(&inode->rwlock);
-    return -1; // no space for entry
+    extent_write(inode, count, (extent_t){.e_start = start, .e_length = length});
+    inode->i_extent_count++;
+    return 0;
 }
 
 /**
- * Obtain the inumber for a sub file inside a directory.
+ * Grow the data of an inode until it owns a given number of blocks.
+ *
+ * Input:
+ *   - inode: the inode (must be write-locked by the caller)
+ *   - block_count: number of blocks the inode should own
+ *
+ * Returns the number of blocks owned by the inode afterwards, which is lower
+ * than block_count if the data blocks (or the inode's extents) ran out.
+ */
+size_t inode_grow(inode_t *inode, size_t block_count) {
+    while (inode->i_block_count < block_count) {
+        // Ask for the whole remainder as a single run, and settle for shorter
+        // runs when free space is fragmented
+        size_t want = block_count - inode->i_block_count;
+        int b = -1;
+        while (want > 1 && (b = data_block_alloc_n(want)) == -1) {
+            want /= 2;
+        }
+        if (want == 1) {
+            b = data_block_alloc(); // single blocks come from the magazine
+        }
+        if (b == -1) {
+            break; // no space
+        }
+
+        if (inode_append_run(inode, b, (int)want) == -1) {
+            data_block_free_n(b, want);
+            break;
+        }
+        inode->i_block_count += want;
+    }
+
+    return inode->i_block_count;
+}
+
+/**
+ * Give back the data blocks of an inode past a given number of blocks, in
+ * whole runs (the last one kept may be split), e.g. those grown for a write
+ * that did not fit. The size is left alone: it must fit in what is kept.
+ *
+ * Input:
+ *   - inode: the inode (must be write-locked by the caller)
+ *   - block_count: number of blocks the inode should keep
+ */
+void inode_shrink(inode_t *inode, size_t block_count) {
+    ALWAYS_ASSERT(inode->i_size <= block_count * BLOCK_SIZE,
+                  "inode_shrink: blocks in use");
+    while (inode->i_block_count > block_count) {
+        int last = inode->i_extent_count - 1;
+        extent_t ext = extent_read(inode, last);
+        size_t excess = inode->i_block_count - block_count;
+        if ((size_t)ext.e_length > excess) {
+            ext.e_length -= (int)excess;
+            data_block_free_n(ext.e_start + ext.e_length, excess);
+            extent_write(inode, last, ext);
+            inode->i_block_count -= excess;
+            break;
+        }
+        data_block_free_n(ext.e_start, (size_t)ext.e_length);
+        inode->i_block_count -= (size_t)ext.e_length;
+        inode->i_extent_count--;
+    }
+
+    if (inode->i_extent_count <= INODE_DIRECT_EXTENTS &&
+        inode->i_extent_block != -1) {
+        data_block_free(inode->i_extent_block);
+        inode->i_extent_block = -1;
+    }
+}
+
+/**
+ * Free all data blocks of an inode, in whole runs, and set its size to 0.
+ *
+ * Input:
+ *   - inode: the inode (must be write-locked by the caller)
+ */
+void inode_truncate(inode_t *inode) {
+    for (int i = 0; i < inode->i_extent_count; i++) {
+        extent_t ext = extent_read(inode, i);
+        data_block_free_n(ext.e_start, (size_t)ext.e_length);
+    }
+
+    if (inode->i_extent_block != -1) {
+        data_block_free(inode->i_extent_block);
+    }
+
+    inode->i_size = 0;
+    inode->i_block_count = 0;
+    inode->i_extent_count = 0;
+    inode->i_extent_block = -1;
+}
+
+/**
+ * Hash a file name (32-bit FNV-1a).
+ *
+ * Input:
+ *   - name: the name (at most MAX_FILE_NAME characters are hashed)
+ *
+ * Returns the hash.
+ */
+uint32_t name_hash(char const *name) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < MAX_FILE_NAME && name[i] != '\0'; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Obtain a directory block, to be released with dir_bucket_put.
+ */
+static dir_bucket_t *dir_bucket_get(int block_number) {
+    dir_bucket_t *bucket = data_block_get(block_number);
+    ALWAYS_ASSERT(bucket != NULL, "dir_bucket_get: directory block must exist");
+    return bucket;
+}
+
+/**
+ * Release a directory block obtained with dir_bucket_get.
+ */
+static void dir_bucket_put(int block_number, bool dirty) {
+    data_block_put(block_number, dirty);
+}
+
+/**
+ * Initialize a directory block as an empty bucket.
+ */
+static void dir_bucket_init(int block_number, uint32_t prefix, uint32_t depth) {
+    dir_bucket_t *bucket = dir_bucket_get(block_number);
+    bucket->db_prefix = prefix;
+    bucket->db_depth = depth;
+    bucket->db_count = 0;
+    for (size_t i = 0; i < DIR_BUCKET_ENTRIES; i++) {
+        bucket->db_entries[i].d_inumber = -1;
+    }
+    dir_bucket_put(block_number, true);
+}
+
+/**
+ * Find the entry holding a name in a bucket.
+ *
+ * Returns the entry index, or -1 if the name is not in the bucket.
+ */
+static int dir_bucket_find(dir_bucket_t const *bucket, char const *sub_name) {
+    for (size_t i = 0; i < DIR_BUCKET_ENTRIES; i++) {
+        dir_entry_t const *entry = &bucket->db_entries[i];
+        if (entry->d_inumber != -1 &&
+            strncmp(entry->d_name, sub_name, MAX_FILE_NAME) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Grow the bucket table of an index to 2^depth slots, each new slot pointing
+ * to the same bucket as the slot it extends.
+ */
+static void dir_index_resize(dir_index_t *index, uint32_t depth) {
+    size_t old_len = (size_t)1 << index->depth;
+    size_t new_len = (size_t)1 << depth;
+    if (new_len > index->capacity) {
+        int *buckets = realloc(index->buckets, new_len * sizeof(int));
+        ALWAYS_ASSERT(buckets != NULL,
+                      "dir_index_resize: failed to allocate bucket table");
+        index->buckets = buckets;
+        index->capacity = new_len;
+    }
+
+    for (size_t i = old_len; i < new_len; i++) {
+        index->buckets[i] = index->buckets[i & (old_len - 1)];
+    }
+    index->depth = depth;
+}
+
+/**
+ * Point every slot of the bucket table matching a bucket's prefix to it.
+ */
+static void dir_index_map(dir_index_t *index, uint32_t prefix, uint32_t depth,
+                          int block_number) {
+    for (size_t i = prefix; i < ((size_t)1 << index->depth);
+         i += (size_t)1 << depth) {
+        index->buckets[i] = block_number;
+    }
+}
+
+/**
+ * (Re)build the index of a directory from the headers of its blocks.
+ */
+static void dir_index_build(dir_index_t *index, inode_t const *inode) {
+    index->depth = 0;
+    dir_index_resize(index, 0);
+    index->buckets[0] = -1;
+
+    for (int e = 0; e < inode->i_extent_count; e++) {
+        extent_t ext = inode_extent(inode, e);
+        for (int b = ext.e_start; b < ext.e_start + ext.e_length; b++) {
+            dir_bucket_t const *bucket = dir_bucket_get(b);
+            if (bucket->db_depth > index->depth) {
+                dir_index_resize(index, bucket->db_depth);
+            }
+            dir_index_map(index, bucket->db_prefix, bucket->db_depth, b);
+            dir_bucket_put(b, false);
+        }
+    }
+
+    for (size_t i = 0; i < ((size_t)1 << index->depth); i++) {
+        ALWAYS_ASSERT(index->buckets[i] != -1,
+                      "dir_index_build: hash prefix without a bucket");
+    }
+}
+
+/**
+ * Obtain the index of a directory, building it if needed.
+ *
+ * Input:
+ *   - inode: directory inode (read- or write-locked by the caller)
+ */
+static dir_index_t *dir_index_get(inode_t const *inode) {
+    dir_index_t *index = &dir_indexes[inode - inode_table];
+    if (!atomic_load_explicit(&index->valid, memory_order_acquire)) {
+        tfs_mutex_lock(&index->build_lock);
+        if (!atomic_load_explicit(&index->valid, memory_order_relaxed)) {
+            dir_index_build(index, inode);
+            atomic_store_explicit(&index->valid, true, memory_order_release);
+        }
+        tfs_mutex_unlock(&index->build_lock);
+    }
+    return index;
+}
+
+/**
+ * Obtain the block of the bucket where a name hash belongs.
+ */
+static int dir_index_bucket(dir_index_t const *index, uint32_t hash) {
+    return index->buckets[hash & ((1u << index->depth) - 1)];
+}
+
+/**
+ * Split a full bucket of a directory in two, moving the entries with bit
+ * db_depth of their hash set to a new block appended to the directory.
+ *
+ * Input:
+ *   - inode: directory inode (write-locked by the caller)
+ *   - index: the directory's index
+ *   - block_number: the bucket's block
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The bucket already has DIR_MAX_DEPTH bits of depth.
+ *   - No free data blocks.
+ */
+static int dir_bucket_split(inode_t *inode, dir_index_t *index,
+                            int block_number) {
+    dir_bucket_t *bucket = dir_bucket_get(block_number);
+    uint32_t depth = bucket->db_depth;
+    if (depth == DIR_MAX_DEPTH) {
+        dir_bucket_put(block_number, false);
+        return -1; // too many names share this hash prefix
+    }
+
+    size_t block_count = inode->i_block_count;
+    if (inode_grow(inode, block_count + 1) != block_count + 1) {
+        dir_bucket_put(block_number, false);
+        return -1; // no space
+    }
+    inode->i_size += BLOCK_SIZE;
+    extent_t last = inode_extent(inode, inode->i_extent_count - 1);
+    int new_block = last.e_start + last.e_length - 1;
+
+    if (depth == index->depth) {
+        dir_index_resize(index, depth + 1);
+    }
+
+    uint32_t new_prefix = bucket->db_prefix | (1u << depth);
+    dir_bucket_init(new_block, new_prefix, depth + 1);
+    dir_bucket_t *sibling = dir_bucket_get(new_block);
+    bucket->db_depth = depth + 1;
+
+    for (size_t i = 0; i < DIR_BUCKET_ENTRIES; i++) {
+        dir_entry_t *entry = &bucket->db_entries[i];
+        if (entry->d_inumber != -1 && (name_hash(entry->d_name) >> depth) & 1) {
+            sibling->db_entries[sibling->db_count++] = *entry;
+            entry->d_inumber = -1;
+            memset(entry->d_name, 0, MAX_FILE_NAME);
+            bucket->db_count--;
+        }
+    }
+
+    dir_bucket_put(new_block, true);
+    dir_bucket_put(block_number, true);
+
+    dir_index_map(index, new_prefix, depth + 1, new_block);
+    return 0;
+}
+
+/**
+ * Clear the directory entry associated with a sub file.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - Directory does not contain an entry for sub_name.
+ */
+int clear_dir_entry(inode_t *inode, char const *sub_name) {
+    STATS_SCOPE(TFS_OP_CLEAR_DIR_ENTRY);
+    int inumber = (int)(inode - inode_table);
+    STATS_TARGET(inumber, -1);
+    tfs_rwlock_wrlock(&inode->rwlock);
+    insert_delay(inumber, -1);
+    if (inode->i_node_type != T_DIRECTORY) {
+        tfs_rwlock_unlock(&inode->rwlock);
+        return -1; // not a directory
+    }
+
+    // Locates the block where the name belongs
+    dir_index_t const *index = dir_index_get(inode);
+    int block_number = dir_index_bucket(index, name_hash(sub_name));
+    dir_bucket_t *bucket = dir_bucket_get(block_number);
+
+    int i = dir_bucket_find(bucket, sub_name);
+    if (i == -1) {
+        dir_bucket_put(block_number, false);
+        tfs_rwlock_unlock(&inode->rwlock);
+        return -1; // sub_name not found
+    }
+
+    bucket->db_entries[i].d_inumber = -1;
+    memset(bucket->db_entries[i].d_name, 0, MAX_FILE_NAME);
+    bucket->db_count--;
+    dir_bucket_put(block_number, true);
+
+    // every removal of a name (unlink, rmdir, rename) goes through here
+    dcache_invalidate((int)(inode - inode_table), sub_name);
+
+    tfs_rwlock_unlock(&inode->rwlock);
+    return 0;
+}
+
+/**
+ * Store the inumber for a sub file in a directory.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *   - sub_inumber: inumber of the sub inode
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors (in errno):
+ *   - ENOTDIR: inode is not a directory inode.
+ *   - ENOENT: the directory is being removed.
+ *   - EINVAL: sub_name is not a valid file name (length 0 or >
+ *     MAX_FILE_NAME - 1).
+ *   - EEXIST: the directory already contains a file named sub_name.
+ *   - ENOSPC: the bucket for sub_name is full and cannot be split.
+ */
+int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
+    STATS_SCOPE(TFS_OP_ADD_DIR_ENTRY);
+    int inumber = (int)(inode - inode_table);
+    STATS_TARGET(inumber, -1);
+    tfs_rwlock_wrlock(&inode->rwlock);
+    if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
+        tfs_rwlock_unlock(&inode->rwlock);
+        errno = EINVAL;
+        return -1; // invalid sub_name
+    }
+
+    insert_delay(inumber, -1); // simulate storage access delay to inode
+    if (inode->i_node_type != T_DIRECTORY) {
+        tfs_rwlock_unlock(&inode->rwlock);
+        errno = ENOTDIR;
+        return -1; // not a directory
+    }
+    if (inode->hard_links == 0) {
+        tfs_rwlock_unlock(&inode->rwlock);
+        errno = ENOENT;
+        return -1; // directory being removed
+    }
+
+    dir_index_t *index = dir_index_get(inode);
+    uint32_t hash = name_hash(sub_name);
+    while (true) {
+        // Locates the block where the name belongs
+        int block_number = dir_index_bucket(index, hash);
+        dir_bucket_t *bucket = dir_bucket_get(block_number);
+        if (dir_bucket_find(bucket, sub_name) != -1) {
+            dir_bucket_put(block_number, false);
+            tfs_rwlock_unlock(&inode->rwlock);
+            errno = EEXIST;
+            return -1; // name already exists
+        }
+
+        if (bucket->db_count < DIR_BUCKET_ENTRIES) {
+            // Finds and fills an empty entry
+            for (size_t i = 0; i < DIR_BUCKET_ENTRIES; i++) {
+                dir_entry_t *entry = &bucket->db_entries[i];
+                if (entry->d_inumber == -1) {
+                    entry->d_inumber = sub_inumber;
+                    strncpy(entry->d_name, sub_name, MAX_FILE_NAME - 1);
+                    entry->d_name[MAX_FILE_NAME - 1] = '\0';
+                    bucket->db_count++;
+                    break;
+                }
+            }
+            dir_bucket_put(block_number, true);
+            tfs_rwlock_unlock(&inode->rwlock);
+            return 0;
+        }
+        dir_bucket_put(block_number, false);
+
+        if (dir_bucket_split(inode, index, block_number) == -1) {
+            tfs_rwlock_unlock(&inode->rwlock);
+            errno = ENOSPC;
+            return -1; // no space for entry
+        }
+    }
+}
+
+/**
+ * Obtain the inumber for a sub file inside a directory.
+ *
+ * Only the block of the bucket where the name belongs is searched.
  *
  * Input:
  *   - inode: directory inode
@@ -402,79 +1477,424 @@ int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
  *   - Directory does not contain a file named sub_name.
  */
 int find_in_dir(inode_t const *inode, char const *sub_name) {
-    pthread_rwlock_rdlock((pthread_rwlock_t *)&inode->rwlock);
+    STATS_SCOPE(TFS_OP_FIND_IN_DIR);
+    int inumber = (int)(inode - inode_table);
+    STATS_TARGET(inumber, -1);
+    tfs_rwlock_rdlock((tfs_rwlock_t *)&inode->rwlock);
     ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
     ALWAYS_ASSERT(sub_name != NULL, "find_in_dir: sub_name must be non-NULL");
 
-    insert_delay(); // simulate storage access delay to inode with inumber
+    insert_delay(inumber, -1); // simulate storage access delay to inode
     if (inode->i_node_type != T_DIRECTORY) {
-        pthread_rwlock_unlock((pthread_rwlock_t *)&inode->rwlock);
+        tfs_rwlock_unlock((tfs_rwlock_t *)&inode->rwlock);
         return -1; // not a directory
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "find_in_dir: directory inode must have a data block");
+    // Locates the block where the name belongs
+    dir_index_t const *index = dir_index_get(inode);
+    int block_number = dir_index_bucket(index, name_hash(sub_name));
+    dir_bucket_t const *bucket = dir_bucket_get(block_number);
+
+    int i = dir_bucket_find(bucket, sub_name);
+    int sub_inumber = i == -1 ? -1 : bucket->db_entries[i].d_inumber;
+    dir_bucket_put(block_number, false);
+
+    tfs_rwlock_unlock((tfs_rwlock_t *)&inode->rwlock);
+    return sub_inumber;
+}
+
+/**
+ * Check whether a directory has no entries.
+ *
+ * Input:
+ *   - inode: directory inode (locked by the caller)
+ *
+ * Returns true if the directory is empty, false otherwise.
+ */
+bool dir_is_empty(inode_t const *inode) {
+    ALWAYS_ASSERT(inode->i_node_type == T_DIRECTORY,
+                  "dir_is_empty: inode must be a directory");
+
+    for (int e = 0; e < inode->i_extent_count; e++) {
+        extent_t ext = inode_extent(inode, e);
+        for (int b = ext.e_start; b < ext.e_start + ext.e_length; b++) {
+            bool empty = dir_bucket_get(b)->db_count == 0;
+            dir_bucket_put(b, false);
+            if (!empty) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Read a word of the free block bitmap.
+ *
+ * The storage access delay is paid once per bitmap block, like a sequential
+ * scan of the bitmap in secondary memory would.
+ */
+static inline uint64_t bitmap_word(size_t word) {
+    if (word * sizeof(uint64_t) % BLOCK_SIZE == 0) {
+        insert_delay(-1, -1); // simulate storage access delay to free_blocks
+    }
+    return free_blocks[word];
+}
+
+/**
+ * Find the first free block at or after a given block.
+ *
+ * Returns the block number, or DATA_BLOCKS if there is none.
+ */
+static size_t bitmap_find_free(size_t from) {
+    size_t word = from / BITMAP_WORD_BITS;
+    // pretend the bits before 'from' are taken
+    uint64_t free_bits = ~bitmap_word(word) &
+                         (~0ULL << (from % BITMAP_WORD_BITS));
+
+    while (free_bits == 0) {
+        if (++word >= BITMAP_WORDS) {
+            return DATA_BLOCKS;
+        }
+        free_bits = ~bitmap_word(word);
+    }
+    return word * BITMAP_WORD_BITS + (size_t)__builtin_ctzll(free_bits);
+}
+
+/**
+ * Find the first taken block in [from, limit).
+ *
+ * Returns the block number, or limit if all of them are free.
+ */
+static size_t bitmap_find_taken(size_t from, size_t limit) {
+    size_t word = from / BITMAP_WORD_BITS;
+    uint64_t taken_bits =
+        bitmap_word(word) & (~0ULL << (from % BITMAP_WORD_BITS));
+
+    while (taken_bits == 0) {
+        if (++word * BITMAP_WORD_BITS >= limit) {
+            return limit;
+        }
+        taken_bits = bitmap_word(word);
+    }
+
+    size_t taken = word * BITMAP_WORD_BITS + (size_t)__builtin_ctzll(taken_bits);
+    return taken < limit ? taken : limit;
+}
+
+/**
+ * Mark a run of blocks as taken or free, a whole bitmap word at a time.
+ */
+static void bitmap_set_run(size_t start, size_t count, bool taken) {
+    size_t end = start + count;
+    while (start < end) {
+        size_t word = start / BITMAP_WORD_BITS;
+        size_t bit = start % BITMAP_WORD_BITS;
+        size_t n = BITMAP_WORD_BITS - bit;
+        if (n > end - start) {
+            n = end - start;
+        }
+
+        uint64_t mask = (n == BITMAP_WORD_BITS) ? ~0ULL
+                                                : ((1ULL << n) - 1) << bit;
+        if (taken) {
+            ALWAYS_ASSERT((free_blocks[word] & mask) == 0,
+                          "bitmap_set_run: block already taken");
+            free_blocks[word] |= mask;
+        } else {
+            ALWAYS_ASSERT((free_blocks[word] & mask) == mask,
+                          "bitmap_set_run: block already freed");
+            free_blocks[word] &= ~mask;
+        }
+        start += n;
+    }
+}
+
+/**
+ * Find the first run of (at least) count free blocks starting in
+ * [from, limit).
+ *
+ * Returns the first block of the run, or DATA_BLOCKS if there is none.
+ */
+static size_t bitmap_find_run(size_t from, size_t limit, size_t count) {
+    size_t start = from;
+    while (true) {
+        start = bitmap_find_free(start);
+        if (start >= limit || DATA_BLOCKS - start < count) {
+            return DATA_BLOCKS;
+        }
+
+        size_t end = bitmap_find_taken(start, start + count);
+        if (end - start == count) {
+            return start;
+        }
+        start = end; // run too short, resume after the taken block
+    }
+}
+
+/**
+ * Allocate a run of contiguous data blocks.
+ *
+ * The search is next-fit: it starts where the previous allocation ended and
+ * wraps around to the beginning of the bitmap. Runs are always taken from
+ * free_blocks, bypassing the per-thread magazines.
+ *
+ * Input:
+ *   - count: number of blocks in the run
+ *
+ * Returns the block number/index of the first block if successful, -1
+ * otherwise.
+ *
+ * Possible errors:
+ *   - No run of count free data blocks.
+ */
+int data_block_alloc_n(size_t count) {
+    if (count == 0 || count > DATA_BLOCKS) {
+        return -1;
+    }
 
-    // Iterates over the directory entries looking for one that has the target
-    // name
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
+    tfs_rwlock_wrlock(&data_block_lock);
+    size_t hint = free_blocks_hint < DATA_BLOCKS ? free_blocks_hint : 0;
+    size_t start = bitmap_find_run(hint, DATA_BLOCKS, count);
+    if (start == DATA_BLOCKS) {
+        start = bitmap_find_run(0, hint, count);
+    }
+
+    if (start == DATA_BLOCKS) {
+        tfs_rwlock_unlock(&data_block_lock);
+        return -1; // no space
+    }
 
-            int sub_inumber = dir_entry[i].d_inumber;
-            pthread_rwlock_unlock((pthread_rwlock_t *)&inode->rwlock);
-            return sub_inumber;
+    bitmap_set_run(start, count, true);
+    free_blocks_hint = start + count;
+    tfs_rwlock_unlock(&data_block_lock);
+    return (int)start;
+}
+
+/**
+ * Return the blocks of a magazine to free_blocks.
+ *
+ * Input:
+ *   - mag: the magazine (locked by the caller)
+ *   - count: number of blocks to return, taken from the top of the magazine
+ */
+static void magazine_flush(block_magazine_t *mag, int count) {
+    tfs_rwlock_wrlock(&data_block_lock);
+    insert_delay(-1, -1); // simulate storage access delay to free_blocks
+    for (int i = 0; i < count; i++) {
+        bitmap_set_run((size_t)mag->blocks[--mag->count], 1, false);
+    }
+    tfs_rwlock_unlock(&data_block_lock);
+}
+
+/**
+ * Fill a magazine with (up to) BLOCK_MAGAZINE_BATCH free blocks.
+ *
+ * Input:
+ *   - mag: the magazine (locked by the caller)
+ */
+static void magazine_refill(block_magazine_t *mag) {
+    tfs_rwlock_wrlock(&data_block_lock);
+    size_t block = free_blocks_hint < DATA_BLOCKS ? free_blocks_hint : 0;
+    bool wrapped = false;
+    int batch[BLOCK_MAGAZINE_BATCH];
+    int n = 0;
+
+    while (n < BLOCK_MAGAZINE_BATCH) {
+        block = bitmap_find_free(block);
+        if (block == DATA_BLOCKS) {
+            if (wrapped) {
+                break; // no free blocks left
+            }
+            wrapped = true;
+            block = 0;
+            continue;
         }
-    pthread_rwlock_unlock((pthread_rwlock_t *)&inode->rwlock);
-    return -1; // entry not found
+        bitmap_set_run(block, 1, true);
+        batch[n++] = (int)block++;
+    }
+    free_blocks_hint = block;
+    tfs_rwlock_unlock(&data_block_lock);
+
+    // pushed in reverse, so that the lowest blocks are handed out first
+    while (n > 0) {
+        mag->blocks[mag->count++] = batch[--n];
+    }
+}
+
+/**
+ * Take a block from the magazine of some other thread.
+ *
+ * Returns block number/index if successful, -1 otherwise.
+ */
+static int magazine_steal(block_magazine_t const *own) {
+    int block = -1;
+    tfs_mutex_lock(&magazines_lock);
+    for (block_magazine_t *mag = magazines; mag != NULL && block == -1;
+         mag = mag->next) {
+        if (mag == own) {
+            continue;
+        }
+        tfs_mutex_lock(&mag->lock);
+        if (mag->count > 0) {
+            block = mag->blocks[--mag->count];
+        }
+        tfs_mutex_unlock(&mag->lock);
+    }
+    tfs_mutex_unlock(&magazines_lock);
+    return block;
+}
+
+/**
+ * Thread exit destructor: give the magazine's blocks back and unregister it.
+ */
+static void magazine_release(void *arg) {
+    block_magazine_t *mag = arg;
+
+    tfs_mutex_lock(&magazines_lock);
+    for (block_magazine_t **it = &magazines; *it != NULL; it = &(*it)->next) {
+        if (*it == mag) {
+            *it = mag->next;
+            break;
+        }
+    }
+
+    tfs_mutex_lock(&mag->lock);
+    if (mag->count > 0 && free_blocks != NULL) {
+        magazine_flush(mag, mag->count);
+    }
+    tfs_mutex_unlock(&mag->lock);
+    tfs_mutex_unlock(&magazines_lock);
+
+    tfs_mutex_destroy(&mag->lock);
+    free(mag);
+}
+
+static void magazines_init(void) {
+    ALWAYS_ASSERT(pthread_key_create(&magazine_key, magazine_release) == 0,
+                  "magazines_init: failed to create magazine key");
+}
+
+/**
+ * Obtain the magazine of the calling thread, creating it on first use.
+ */
+static block_magazine_t *magazine_get(void) {
+    block_magazine_t *mag = thread_magazine;
+    if (mag != NULL) {
+        return mag;
+    }
+
+    mag = malloc(sizeof(block_magazine_t));
+    ALWAYS_ASSERT(mag != NULL, "magazine_get: failed to allocate magazine");
+    tfs_mutex_init(&mag->lock, LOCK_CLASS_MAGAZINE);
+    mag->count = 0;
+
+    tfs_mutex_lock(&magazines_lock);
+    mag->next = magazines;
+    magazines = mag;
+    tfs_mutex_unlock(&magazines_lock);
+
+    pthread_setspecific(magazine_key, mag);
+    thread_magazine = mag;
+    return mag;
 }
 
 /**
  * Allocate a new data block.
  *
+ * The block comes from the calling thread's magazine, which is refilled from
+ * free_blocks when empty.
+ *
  * Returns block number/index if successful, -1 otherwise.
  *
  * Possible errors:
  *   - No free data blocks.
  */
 int data_block_alloc(void) {
-    pthread_rwlock_wrlock(&data_block_lock);
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        if (i * sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
-        }
+    STATS_SCOPE(TFS_OP_DATA_BLOCK_ALLOC);
+    block_magazine_t *mag = magazine_get();
+    int block = -1;
 
-        if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
-            pthread_rwlock_unlock(&data_block_lock);
-            return (int)i;
-        }
+    tfs_mutex_lock(&mag->lock);
+    if (mag->count == 0) {
+        magazine_refill(mag);
     }
-    pthread_rwlock_unlock(&data_block_lock);
-    return -1;
+    if (mag->count > 0) {
+        block = mag->blocks[--mag->count];
+    }
+    tfs_mutex_unlock(&mag->lock);
+
+    if (block == -1) {
+        block = magazine_steal(mag);
+    }
+    STATS_TARGET(-1, block);
+    return block;
 }
 
 /**
  * Free a data block.
  *
+ * The block goes to the calling thread's magazine; when that is full, half of
+ * it is returned to free_blocks.
+ *
  * Input:
  *   - block_number: the block number/index
  */
 void data_block_free(int block_number) {
-    pthread_rwlock_wrlock(&data_block_lock);
+    STATS_SCOPE(TFS_OP_DATA_BLOCK_FREE);
+    STATS_TARGET(-1, block_number);
     ALWAYS_ASSERT(valid_block_number(block_number),
                   "data_block_free: invalid block number");
+    block_magazine_t *mag = magazine_get();
+    if (!data_blocks_mapped()) {
+        // before anyone can reuse it
+        bcache_discard((size_t)block_number, 1);
+    }
+
+    tfs_mutex_lock(&mag->lock);
+    if (mag->count == BLOCK_MAGAZINE_SIZE) {
+        magazine_flush(mag, BLOCK_MAGAZINE_SIZE / 2);
+    }
+    mag->blocks[mag->count++] = block_number;
+    tfs_mutex_unlock(&mag->lock);
+}
 
-    insert_delay(); // simulate storage access delay to free_blocks
+/**
+ * Free a run of contiguous data blocks.
+ *
+ * Input:
+ *   - block_number: the first block number/index of the run
+ *   - count: number of blocks in the run
+ */
+void data_block_free_n(int block_number, size_t count) {
+    tfs_rwlock_wrlock(&data_block_lock);
+    ALWAYS_ASSERT(count > 0 && valid_block_number(block_number) &&
+                      valid_block_number(block_number + (int)count - 1),
+                  "data_block_free_n: invalid block run");
+
+    // simulate storage access delay to free_blocks
+    insert_delay(-1, block_number);
 
-    free_blocks[block_number] = FREE;
-    pthread_rwlock_unlock(&data_block_lock);
+    if (!data_blocks_mapped()) {
+        bcache_discard((size_t)block_number, count);
+    }
+    bitmap_set_run((size_t)block_number, count, false);
+    tfs_rwlock_unlock(&data_block_lock);
+    device->discard(device, (size_t)block_number, count);
 }
 
 /**
- * Obtain a pointer to the contents of a given block.
+ * Check whether the data blocks are in memory, so that a run of blocks can be
+ * accessed through the pointer to its first block.
+ */
+bool data_blocks_mapped(void) { return device->map(device, 0) != NULL; }
+
+/**
+ * Obtain a pointer to the contents of a given block, which must be released
+ * with data_block_put.
+ *
+ * If the device cannot be mapped, the block is pinned in the buffer cache
+ * (and read into it, if missing, which is when the storage delay is paid).
  *
  * Input:
  *   - block_number: the block number/index
@@ -482,18 +1902,423 @@ void data_block_free(int block_number) {
  * Returns a pointer to the first byte of the block.
  */
 void *data_block_get(int block_number) {
-    pthread_rwlock_rdlock(&data_block_lock);
     ALWAYS_ASSERT(valid_block_number(block_number),
                   "data_block_get: invalid block number");
 
-    insert_delay(); // simulate storage access delay to block
-    pthread_rwlock_unlock(&data_block_lock);
-    return &fs_data[(size_t)block_number * BLOCK_SIZE];
+    void *mapped = device->map(device, (size_t)block_number);
+    if (mapped != NULL) {
+        insert_delay(-1, block_number); // simulate storage access delay
+        return mapped;
+    }
+
+    bool valid;
+    void *data = bcache_pin((size_t)block_number, &valid);
+    if (!valid) {
+        insert_delay(-1, block_number); // only a miss reaches the storage
+        ALWAYS_ASSERT(
+            device->read_block(device, (size_t)block_number, 1, data) == 0,
+            "data_block_get: failed to read block");
+        bcache_ready((size_t)block_number);
+    }
+    return data;
+}
+
+/**
+ * Release a block obtained with data_block_get.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *   - dirty: whether the block was changed
+ */
+void data_block_put(int block_number, bool dirty) {
+    if (device->map(device, (size_t)block_number) != NULL) {
+        return;
+    }
+    bcache_unpin((size_t)block_number, dirty);
+}
+
+/*
+ * The part of a transfer that falls in a single block, for devices behind the
+ * buffer cache.
+ */
+typedef struct {
+    size_t bp_block;
+    size_t bp_within; // offset in the block
+    char *bp_buffer;  // NULL to write zeros
+    size_t bp_len;
+} block_piece_t;
+
+/**
+ * Copy bytes between buffers and up to BCACHE_BATCH_BLOCKS pieces of blocks
+ * (in file order), through the buffer cache.
+ *
+ * Every block is pinned first; those missing from the cache (and not
+ * overwritten entirely) are then read in a single device batch, which alone
+ * pays the storage delay. The blocks written to are left dirty, for the
+ * flusher to write back.
+ */
+static void data_pieces_copy(block_piece_t const *pieces, size_t n,
+                             bool to_block) {
+    char *data[BCACHE_BATCH_BLOCKS];
+    bool fill[BCACHE_BATCH_BLOCKS];
+    block_io_t ios[BCACHE_BATCH_BLOCKS];
+    size_t n_ios = 0;
+
+    // pieces of the same block are adjacent: the block is pinned once (which
+    // also keeps the pins in file order, so that two threads filling blocks
+    // of the same file never wait for each other)
+    for (size_t i = 0; i < n; i++) {
+        size_t block = pieces[i].bp_block;
+        if (i > 0 && block == pieces[i - 1].bp_block) {
+            data[i] = data[i - 1];
+            fill[i] = false;
+            continue;
+        }
+        bool valid;
+        data[i] = bcache_pin(block, &valid);
+        fill[i] = !valid;
+        if (!valid && !(to_block && pieces[i].bp_len == BLOCK_SIZE)) {
+            ios[n_ios++] = (block_io_t){.bio_block = block,
+                                        .bio_count = 1,
+                                        .bio_buffer = data[i],
+                                        .bio_write = false};
+        }
+    }
+    if (n_ios > 0) {
+        // simulate storage access delay to the blocks read
+        insert_delay(-1, (int)ios[0].bio_block);
+        ALWAYS_ASSERT(device->submit(device, ios, n_ios) == 0,
+                      "data_blocks_copyv: failed to read blocks");
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        block_piece_t const *piece = &pieces[i];
+        char *at = data[i] + piece->bp_within;
+        if (!to_block) {
+            memcpy(piece->bp_buffer, at, piece->bp_len);
+            continue;
+        }
+        if (piece->bp_buffer == NULL) {
+            memset(at, 0, piece->bp_len);
+        } else {
+            memcpy(at, piece->bp_buffer, piece->bp_len);
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (fill[i]) {
+            bcache_ready(pieces[i].bp_block);
+        }
+        if (i + 1 == n || pieces[i + 1].bp_block != pieces[i].bp_block) {
+            bcache_unpin(pieces[i].bp_block, to_block);
+        }
+    }
+}
+
+static bool valid_data_range(data_range_t const *range) {
+    return range->dr_len > 0 && valid_block_number(range->dr_block) &&
+           valid_block_number(
+               range->dr_block +
+               (int)((range->dr_offset + range->dr_len - 1) / BLOCK_SIZE));
+}
+
+/**
+ * Copy bytes between buffers and ranges of data blocks (which must not
+ * overlap).
+ *
+ * When the device cannot be mapped, the ranges are split in pieces of blocks,
+ * copied through the buffer cache BCACHE_BATCH_BLOCKS blocks at a time.
+ */
+static void data_blocks_copyv(data_range_t const *ranges, size_t n,
+                              bool to_block) {
+    if (data_blocks_mapped()) {
+        // simulate storage access delay to the runs
+        insert_delay(-1, n > 0 ? ranges[0].dr_block : -1);
+        for (size_t i = 0; i < n; i++) {
+            data_range_t const *range = &ranges[i];
+            char *run = device->map(device, (size_t)range->dr_block);
+            if (!to_block) {
+                memcpy(range->dr_buffer, run + range->dr_offset,
+                       range->dr_len);
+            } else if (range->dr_buffer == NULL) {
+                memset(run + range->dr_offset, 0, range->dr_len);
+            } else {
+                memcpy(run + range->dr_offset, range->dr_buffer,
+                       range->dr_len);
+            }
+        }
+        return;
+    }
+
+    block_piece_t pieces[BCACHE_BATCH_BLOCKS];
+    size_t n_pieces = 0;
+    for (size_t i = 0; i < n; i++) {
+        data_range_t const *range = &ranges[i];
+        size_t block = (size_t)range->dr_block + range->dr_offset / BLOCK_SIZE;
+        size_t within = range->dr_offset % BLOCK_SIZE;
+        char *buffer = range->dr_buffer;
+        size_t len = range->dr_len;
+
+        while (len > 0) {
+            size_t piece_len = BLOCK_SIZE - within;
+            if (piece_len > len) {
+                piece_len = len;
+            }
+            if (n_pieces == BCACHE_BATCH_BLOCKS) {
+                data_pieces_copy(pieces, n_pieces, to_block);
+                n_pieces = 0;
+            }
+            pieces[n_pieces++] = (block_piece_t){.bp_block = block,
+                                                 .bp_within = within,
+                                                 .bp_buffer = buffer,
+                                                 .bp_len = piece_len};
+            if (buffer != NULL) {
+                buffer += piece_len;
+            }
+            len -= piece_len;
+            block++;
+            within = 0;
+        }
+    }
+    if (n_pieces > 0) {
+        data_pieces_copy(pieces, n_pieces, to_block);
+    }
+}
+
+/**
+ * Read bytes from ranges of data blocks, as a single batch.
+ *
+ * Input:
+ *   - ranges: the ranges to read (each run must hold dr_offset + dr_len
+ *     bytes)
+ *   - n: number of ranges
+ */
+void data_blocks_readv(data_range_t const *ranges, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        ALWAYS_ASSERT(valid_data_range(&ranges[i]) &&
+                          ranges[i].dr_buffer != NULL,
+                      "data_blocks_readv: invalid block range");
+    }
+    data_blocks_copyv(ranges, n, false);
+}
+
+/**
+ * Write bytes to ranges of data blocks, as a single batch.
+ *
+ * Input:
+ *   - ranges: the ranges to write (each run must hold dr_offset + dr_len
+ *     bytes); a range whose dr_buffer is NULL is filled with zeros
+ *   - n: number of ranges
+ */
+void data_blocks_writev(data_range_t const *ranges, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        ALWAYS_ASSERT(valid_data_range(&ranges[i]),
+                      "data_blocks_writev: invalid block range");
+    }
+    data_blocks_copyv(ranges, n, true);
+}
+
+/**
+ * Read bytes from a run of data blocks.
+ *
+ * Input:
+ *   - block_number: the first block of the run
+ *   - offset: offset in the run where the read starts
+ *   - buffer: destination buffer
+ *   - len: number of bytes to read (the run must hold offset + len bytes)
+ */
+void data_block_read(int block_number, size_t offset, void *buffer,
+                     size_t len) {
+    data_range_t range = {.dr_block = block_number,
+                          .dr_offset = offset,
+                          .dr_buffer = buffer,
+                          .dr_len = len};
+    data_blocks_readv(&range, 1);
+}
+
+/**
+ * Write bytes to a run of data blocks.
+ *
+ * Input:
+ *   - block_number: the first block of the run
+ *   - offset: offset in the run where the write starts
+ *   - buffer: source buffer, or NULL to write zeros
+ *   - len: number of bytes to write (the run must hold offset + len bytes)
+ */
+void data_block_write(int block_number, size_t offset, void const *buffer,
+                      size_t len) {
+    data_range_t range = {.dr_block = block_number,
+                          .dr_offset = offset,
+                          .dr_buffer = (void *)buffer,
+                          .dr_len = len};
+    data_blocks_writev(&range, 1);
+}
+
+/**
+ * Obtain the chunk of the open file table that holds a file handle.
+ */
+static size_t open_file_chunk(size_t fhandle) {
+    // chunk k starts at handle base * (2^k - 1)
+    size_t q = fhandle / OPEN_FILE_CHUNK_BASE + 1;
+    return (size_t)(63 - __builtin_clzll(q));
+}
+
+/**
+ * Obtain the slot of a file handle in the open file table.
+ *
+ * Returns a pointer to the slot, or NULL if the handle was never handed out.
+ */
+static open_file_slot_t *open_file_slot(int fhandle) {
+    if (fhandle < 0 || (size_t)fhandle >= atomic_load(&open_file_count)) {
+        return NULL;
+    }
+
+    size_t chunk = open_file_chunk((size_t)fhandle);
+    open_file_slot_t *slots = atomic_load(&open_file_chunks[chunk]);
+    if (slots == NULL) {
+        return NULL; // chunk still being allocated
+    }
+    size_t first = OPEN_FILE_CHUNK_BASE * (((size_t)1 << chunk) - 1);
+    return &slots[(size_t)fhandle - first];
+}
+
+/**
+ * Hand out a handle that was never used, allocating its chunk if needed.
+ *
+ * Returns the handle, or -1 if the table cannot grow any further.
+ */
+static int open_file_table_grow(void) {
+    // the count never goes past the table, which open_file_slot relies on
+    size_t fhandle = atomic_load(&open_file_count);
+    do {
+        if (fhandle > INT32_MAX ||
+            open_file_chunk(fhandle) >= OPEN_FILE_CHUNKS) {
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak(&open_file_count, &fhandle,
+                                           fhandle + 1));
+    size_t chunk = open_file_chunk(fhandle);
+
+    if (atomic_load(&open_file_chunks[chunk]) == NULL) {
+        size_t size = OPEN_FILE_CHUNK_BASE << chunk;
+        open_file_slot_t *slots = malloc(size * sizeof(open_file_slot_t));
+        if (slots == NULL) {
+            return -1; // the handle is lost, but the chunk can still be made
+        }
+        for (size_t i = 0; i < size; i++) {
+            atomic_init(&slots[i].of_state, FREE);
+            atomic_init(&slots[i].of_next, -1);
+        }
+
+        open_file_slot_t *expected = NULL;
+        if (!atomic_compare_exchange_strong(&open_file_chunks[chunk],
+                                            &expected, slots)) {
+            free(slots); // another thread got there first
+        }
+    }
+    return (int)fhandle;
+}
+
+/**
+ * Pop a handle from the free handle stack.
+ *
+ * Returns the handle, or -1 if the stack is empty.
+ */
+static int free_handle_pop(void) {
+    uint64_t top = atomic_load(&free_handles_top);
+    int fhandle;
+    do {
+        fhandle = (int)(uint32_t)top - 1;
+        if (fhandle == -1) {
+            return -1;
+        }
+
+        int next = atomic_load(&open_file_slot(fhandle)->of_next);
+        uint64_t new_top = (((top >> 32) + 1) << 32) | (uint32_t)(next + 1);
+        if (atomic_compare_exchange_weak(&free_handles_top, &top, new_top)) {
+            return fhandle;
+        }
+    } while (true);
+}
+
+/**
+ * Push a handle onto the free handle stack.
+ */
+static void free_handle_push(int fhandle) {
+    open_file_slot_t *slot = open_file_slot(fhandle);
+
+    uint64_t top = atomic_load(&free_handles_top);
+    uint64_t new_top;
+    do {
+        atomic_store(&slot->of_next, (int)(uint32_t)top - 1);
+        new_top = (((top >> 32) + 1) << 32) | (uint32_t)(fhandle + 1);
+    } while (!atomic_compare_exchange_weak(&free_handles_top, &top, new_top));
+}
+
+/**
+ * Return the handles of a thread that is exiting to the free handle stack.
+ * Registered as the destructor of handle_cache_key.
+ */
+static void handle_cache_release(void *arg) {
+    handle_cache_t *cache = arg;
+
+    tfs_mutex_lock(&handle_caches_lock);
+    for (handle_cache_t **it = &handle_caches; *it != NULL;
+         it = &(*it)->next) {
+        if (*it == cache) {
+            *it = cache->next;
+            break;
+        }
+    }
+
+    tfs_mutex_lock(&cache->lock);
+    while (cache->count > 0) {
+        free_handle_push(cache->handles[--cache->count]);
+    }
+    tfs_mutex_unlock(&cache->lock);
+    tfs_mutex_unlock(&handle_caches_lock);
+
+    tfs_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+static void handle_caches_init(void) {
+    ALWAYS_ASSERT(
+        pthread_key_create(&handle_cache_key, handle_cache_release) == 0,
+        "handle_caches_init: failed to create handle cache key");
+}
+
+/**
+ * Obtain the calling thread's handle cache, creating it on first use.
+ */
+static handle_cache_t *handle_cache_get(void) {
+    handle_cache_t *cache = thread_handle_cache;
+    if (cache != NULL) {
+        return cache;
+    }
+
+    cache = malloc(sizeof(handle_cache_t));
+    ALWAYS_ASSERT(cache != NULL,
+                  "handle_cache_get: failed to allocate handle cache");
+    tfs_mutex_init(&cache->lock, LOCK_CLASS_HANDLE_CACHE);
+    cache->count = 0;
+
+    tfs_mutex_lock(&handle_caches_lock);
+    cache->next = handle_caches;
+    handle_caches = cache;
+    tfs_mutex_unlock(&handle_caches_lock);
+
+    pthread_setspecific(handle_cache_key, cache);
+    thread_handle_cache = cache;
+    return cache;
 }
 
 /**
  * Add a new entry to the open file table.
  *
+ * The handle comes from the thread's cache, then from the free handle stack;
+ * when both are empty, the table grows.
+ *
  * Input:
  *   - inumber: inode number of the file to open
  *   - offset: initial offset
@@ -501,40 +2326,69 @@ void *data_block_get(int block_number) {
  * Returns file handle if successful, -1 otherwise.
  *
  * Possible errors:
- *   - No space in open file table for a new open file.
+ *   - The open file table cannot grow (malloc failure, or INT32_MAX handles).
  */
 int add_to_open_file_table(int inumber, size_t offset) {
-    pthread_rwlock_wrlock(&fs_state_lock);
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (free_open_file_entries[i] == FREE) {
-            free_open_file_entries[i] = TAKEN;
-            open_file_table[i].of_inumber = inumber;
-            open_file_table[i].of_offset = offset;
-            
-            pthread_rwlock_unlock(&fs_state_lock);
-            return i;
-        }
-    }
-    pthread_rwlock_unlock(&fs_state_lock);
-    return -1;
+    handle_cache_t *cache = handle_cache_get();
+
+    int fhandle = -1;
+    tfs_mutex_lock(&cache->lock);
+    if (cache->count > 0) {
+        fhandle = cache->handles[--cache->count];
+    }
+    tfs_mutex_unlock(&cache->lock);
+
+    if (fhandle == -1) {
+        fhandle = free_handle_pop();
+    }
+    if (fhandle == -1) {
+        fhandle = open_file_table_grow();
+        if (fhandle == -1) {
+            return -1;
+        }
+    }
+
+    open_file_slot_t *slot = open_file_slot(fhandle);
+    ALWAYS_ASSERT(atomic_load(&slot->of_state) == FREE,
+                  "add_to_open_file_table: free handle must not be taken");
+    slot->of_entry.of_inumber = inumber;
+    slot->of_entry.of_offset = offset;
+    slot->of_entry.of_ra_next = offset;
+    slot->of_entry.of_ra_end = offset;
+    slot->of_entry.of_ra_window = 0;
+    atomic_flag_clear(&slot->of_entry.of_ra_busy);
+    atomic_store_explicit(&slot->of_state, TAKEN, memory_order_release);
+    return fhandle;
 }
 
 /**
  * Free an entry from the open file table.
  *
+ * The handle goes to the thread's cache; when that is full, half of it is
+ * moved to the free handle stack first.
+ *
  * Input:
  *   - fhandle: file handle to free/close
  */
 void remove_from_open_file_table(int fhandle) {
-    pthread_rwlock_wrlock(&fs_state_lock);
-    ALWAYS_ASSERT(valid_file_handle(fhandle),
+    open_file_slot_t *slot = open_file_slot(fhandle);
+    ALWAYS_ASSERT(slot != NULL,
                   "remove_from_open_file_table: file handle must be valid");
 
-    ALWAYS_ASSERT(free_open_file_entries[fhandle] == TAKEN,
+    int expected = TAKEN;
+    ALWAYS_ASSERT(atomic_compare_exchange_strong(&slot->of_state, &expected,
+                                                 FREE),
                   "remove_from_open_file_table: file handle must be taken");
 
-    free_open_file_entries[fhandle] = FREE;
-    pthread_rwlock_unlock(&fs_state_lock);
+    handle_cache_t *cache = handle_cache_get();
+    tfs_mutex_lock(&cache->lock);
+    if (cache->count == OPEN_FILE_CACHE_SIZE) {
+        for (int i = 0; i < OPEN_FILE_CACHE_BATCH; i++) {
+            free_handle_push(cache->handles[--cache->count]);
+        }
+    }
+    cache->handles[cache->count++] = fhandle;
+    tfs_mutex_unlock(&cache->lock);
 }
 
 /**
@@ -547,16 +2401,10 @@ void remove_from_open_file_table(int fhandle) {
  * opened.
  */
 open_file_entry_t *get_open_file_entry(int fhandle) {
-    pthread_rwlock_rdlock(&fs_state_lock);
-    if (!valid_file_handle(fhandle)) {
-        pthread_rwlock_unlock(&fs_state_lock);
-        return NULL;
-    }
-
-    if (free_open_file_entries[fhandle] != TAKEN) {
-        pthread_rwlock_unlock(&fs_state_lock);
+    open_file_slot_t *slot = open_file_slot(fhandle);
+    if (slot == NULL ||
+        atomic_load_explicit(&slot->of_state, memory_order_acquire) != TAKEN) {
         return NULL;
     }
-    pthread_rwlock_unlock(&fs_state_lock);
-    return &open_file_table[fhandle];
+    return &slot->of_entry;
 }
@@ -2,9 +2,12 @@
 #define STATE_H
 
 #include "config.h"
+#include "lockprof.h"
 #include "operations.h"
 
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -18,8 +21,30 @@ typedef struct {
     int d_inumber;
 } dir_entry_t;
 
+/**
+ * Directory block
+ *
+ * Directories are extendible hash tables with one bucket per block: a bucket
+ * holds the entries whose name hashes end with the bucket's db_depth-bit
+ * prefix.
+ */
+typedef struct {
+    uint32_t db_prefix; // low db_depth bits of the hashes of its names
+    uint32_t db_depth;
+    uint32_t db_count; // entries in use
+    dir_entry_t db_entries[];
+} dir_bucket_t;
+
 typedef enum { T_FILE, T_DIRECTORY } inode_type;
 
+/**
+ * Extent (run of contiguous data blocks)
+ */
+typedef struct {
+    int e_start;  // first block of the run
+    int e_length; // number of blocks in the run
+} extent_t;
+
 /**
  * Inode
  */
@@ -27,11 +52,13 @@ typedef struct {
     inode_type i_node_type;
 
     size_t i_size;
-    int i_data_block;
+    size_t i_block_count; // data blocks owned, summed over all extents
+    int i_extent_count;
+    extent_t i_extents[INODE_DIRECT_EXTENTS];
+    int i_extent_block; // block holding the overflow extents, -1 if none
     int hard_links;
-    char *sym_path;
-    bool sym_link; 
-    pthread_rwlock_t rwlock; 
+    bool sym_link; // the contents of the file are the path of its target
+    tfs_rwlock_t rwlock;
 } inode_t;
 
 typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
@@ -42,10 +69,33 @@ typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 typedef struct {
     int of_inumber;
     size_t of_offset;
+    // readahead: where the next read goes on in order, how far the data was
+    // read ahead, and the current window (in blocks, 0 after a read out of
+    // order); only updated by the thread holding of_ra_busy
+    atomic_flag of_ra_busy;
+    size_t of_ra_next;
+    size_t of_ra_end;
+    size_t of_ra_window;
 } open_file_entry_t;
 
+/**
+ * A range of bytes in a run of data blocks, part of a batched transfer
+ */
+typedef struct {
+    int dr_block;     // first block of the run
+    size_t dr_offset; // offset in the run where the range starts
+    void *dr_buffer;
+    size_t dr_len;
+} data_range_t;
+
 int state_init(tfs_params);
 int state_destroy(void);
+bool state_loaded(void);
+int state_sync(void);
+int inode_sync(inode_t const *inode);
+int inode_copy_out(inode_t const *inode, int out);
+void inode_readahead(open_file_entry_t *file, inode_t const *inode,
+                     size_t offset, size_t len);
 
 size_t state_block_size(void);
 
@@ -53,13 +103,30 @@ int inode_create(inode_type n_type);
 void inode_delete(int inumber);
 inode_t *inode_get(int inumber);
 
+extent_t inode_extent(inode_t const *inode, int index);
+size_t inode_grow(inode_t *inode, size_t block_count);
+void inode_shrink(inode_t *inode, size_t block_count);
+void inode_truncate(inode_t *inode);
+
 int clear_dir_entry(inode_t *inode, char const *sub_name);
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber);
 int find_in_dir(inode_t const *inode, char const *sub_name);
+bool dir_is_empty(inode_t const *inode);
+uint32_t name_hash(char const *name);
 
 int data_block_alloc(void);
+int data_block_alloc_n(size_t count);
 void data_block_free(int block_number);
+void data_block_free_n(int block_number, size_t count);
+bool data_blocks_mapped(void);
 void *data_block_get(int block_number);
+void data_block_put(int block_number, bool dirty);
+void data_blocks_readv(data_range_t const *ranges, size_t n);
+void data_blocks_writev(data_range_t const *ranges, size_t n);
+void data_block_read(int block_number, size_t offset, void *buffer,
+                     size_t len);
+void data_block_write(int block_number, size_t offset, void const *buffer,
+                      size_t len);
 
 int add_to_open_file_table(int inumber, size_t offset);
 void remove_from_open_file_table(int fhandle);
@@ -0,0 +1,289 @@
+#include "stats.h"
+#include "betterassert.h"
+#include "config.h"
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CACHE_LINE_SIZE (64)
+
+/*
+ * Every thread has its own counters, in an allocation of whole cache lines,
+ * and is the only one to write them: an increment is a plain load and store
+ * (atomic only so that tfs_stats may read them meanwhile). All of them are
+ * kept in a registry, and the counters of threads that exit are folded into
+ * those of the retired threads.
+ */
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t total_ns;
+    _Atomic uint64_t max_ns;
+    _Atomic uint64_t buckets[STATS_HIST_BUCKETS];
+} op_counters_t;
+
+typedef struct thread_stats {
+    op_counters_t ops[TFS_OP_COUNT];
+    struct thread_stats *next;
+} thread_stats_t;
+
+static char const *const op_names[TFS_OP_COUNT] = {
+    [TFS_OP_OPEN] = "open",
+    [TFS_OP_CLOSE] = "close",
+    [TFS_OP_READ] = "read",
+    [TFS_OP_WRITE] = "write",
+    [TFS_OP_PREAD] = "pread",
+    [TFS_OP_PWRITE] = "pwrite",
+    [TFS_OP_READV] = "readv",
+    [TFS_OP_WRITEV] = "writev",
+    [TFS_OP_READ_VIEW] = "read_view",
+    [TFS_OP_RELEASE_VIEW] = "release_view",
+    [TFS_OP_FSYNC] = "fsync",
+    [TFS_OP_SYNC] = "sync",
+    [TFS_OP_LINK] = "link",
+    [TFS_OP_SYM_LINK] = "sym_link",
+    [TFS_OP_UNLINK] = "unlink",
+    [TFS_OP_MKDIR] = "mkdir",
+    [TFS_OP_RMDIR] = "rmdir",
+    [TFS_OP_COPY_FROM_EXTERNAL] = "copy_from_external_fs",
+    [TFS_OP_COPY_TO_EXTERNAL] = "copy_to_external_fs",
+    [TFS_OP_IMPORT_TREE] = "import_tree",
+    [TFS_OP_INODE_CREATE] = "inode_create",
+    [TFS_OP_INODE_DELETE] = "inode_delete",
+    [TFS_OP_INODE_GET] = "inode_get",
+    [TFS_OP_FIND_IN_DIR] = "find_in_dir",
+    [TFS_OP_ADD_DIR_ENTRY] = "add_dir_entry",
+    [TFS_OP_CLEAR_DIR_ENTRY] = "clear_dir_entry",
+    [TFS_OP_DATA_BLOCK_ALLOC] = "data_block_alloc",
+    [TFS_OP_DATA_BLOCK_FREE] = "data_block_free",
+    [TFS_OP_BLOCK_ACCESS] = "block_access",
+};
+
+static atomic_bool enabled;
+static atomic_bool timed; // enabled, or traced
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_stats_t *registry; // every live thread's counters
+static thread_stats_t retired;   // added up counters of the threads that exited
+static _Thread_local thread_stats_t *thread_stats;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t load(_Atomic uint64_t const *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static void store(_Atomic uint64_t *counter, uint64_t value) {
+    atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+
+/**
+ * Add counters to others (with stats_lock held, unless dest is the caller's).
+ */
+static void counters_add(thread_stats_t *dest, thread_stats_t const *src) {
+    for (size_t op = 0; op < TFS_OP_COUNT; op++) {
+        op_counters_t *d = &dest->ops[op];
+        op_counters_t const *s = &src->ops[op];
+        if (load(&s->count) == 0) {
+            continue;
+        }
+        store(&d->count, load(&d->count) + load(&s->count));
+        store(&d->total_ns, load(&d->total_ns) + load(&s->total_ns));
+        if (load(&s->max_ns) > load(&d->max_ns)) {
+            store(&d->max_ns, load(&s->max_ns));
+        }
+        for (size_t b = 0; b < STATS_HIST_BUCKETS; b++) {
+            store(&d->buckets[b], load(&d->buckets[b]) + load(&s->buckets[b]));
+        }
+    }
+}
+
+static void counters_clear(thread_stats_t *ts) {
+    for (size_t op = 0; op < TFS_OP_COUNT; op++) {
+        op_counters_t *c = &ts->ops[op];
+        store(&c->count, 0);
+        store(&c->total_ns, 0);
+        store(&c->max_ns, 0);
+        for (size_t b = 0; b < STATS_HIST_BUCKETS; b++) {
+            store(&c->buckets[b], 0);
+        }
+    }
+}
+
+/**
+ * Thread exit destructor: fold the thread's counters into the retired ones.
+ */
+static void thread_stats_release(void *arg) {
+    thread_stats_t *ts = arg;
+    pthread_mutex_lock(&stats_lock);
+    counters_add(&retired, ts);
+    for (thread_stats_t **it = &registry; *it != NULL; it = &(*it)->next) {
+        if (*it == ts) {
+            *it = ts->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+    free(ts);
+}
+
+static void stats_key_init(void) {
+    ALWAYS_ASSERT(pthread_key_create(&stats_key, thread_stats_release) == 0,
+                  "stats_key_init: failed to create stats key");
+}
+
+/**
+ * Obtain the counters of the calling thread, creating them on first use.
+ */
+static thread_stats_t *thread_stats_get(void) {
+    thread_stats_t *ts = thread_stats;
+    if (ts != NULL) {
+        return ts;
+    }
+
+    size_t size = (sizeof(thread_stats_t) + CACHE_LINE_SIZE - 1) /
+                  CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    ts = aligned_alloc(CACHE_LINE_SIZE, size);
+    ALWAYS_ASSERT(ts != NULL, "thread_stats_get: failed to allocate counters");
+    counters_clear(ts);
+
+    pthread_mutex_lock(&stats_lock);
+    ts->next = registry;
+    registry = ts;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_setspecific(stats_key, ts);
+    thread_stats = ts;
+    return ts;
+}
+
+/**
+ * Start collecting (or not) the statistics, from zero, and timing the
+ * operations if either they are collected or traced.
+ */
+void stats_init(bool enable, bool traced) {
+    pthread_once(&stats_once, stats_key_init);
+    pthread_mutex_lock(&stats_lock);
+    counters_clear(&retired);
+    for (thread_stats_t *ts = registry; ts != NULL; ts = ts->next) {
+        counters_clear(ts);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    atomic_store(&enabled, enable);
+    atomic_store(&timed, enable || traced);
+}
+
+void stats_collect(tfs_stats_t *stats) {
+    thread_stats_t *sum = calloc(1, sizeof(thread_stats_t));
+    ALWAYS_ASSERT(sum != NULL, "stats_collect: failed to allocate counters");
+    pthread_mutex_lock(&stats_lock);
+    counters_add(sum, &retired);
+    for (thread_stats_t *ts = registry; ts != NULL; ts = ts->next) {
+        counters_add(sum, ts);
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    for (size_t op = 0; op < TFS_OP_COUNT; op++) {
+        op_counters_t const *c = &sum->ops[op];
+        tfs_op_stats_t *s = &stats->st_ops[op];
+        s->os_count = load(&c->count);
+        s->os_total_ns = load(&c->total_ns);
+        s->os_max_ns = load(&c->max_ns);
+        for (size_t b = 0; b < STATS_HIST_BUCKETS; b++) {
+            s->os_buckets[b] = load(&c->buckets[b]);
+        }
+    }
+    free(sum);
+}
+
+/**
+ * Time at which an operation starts, or 0 if the operations are not timed.
+ */
+uint64_t stats_start(void) {
+    if (!atomic_load_explicit(&timed, memory_order_relaxed)) {
+        return 0;
+    }
+    return now_ns();
+}
+
+static size_t bucket_of(uint64_t ns) {
+    if (ns < (1u << STATS_HIST_SUB_BITS)) {
+        return (size_t)ns;
+    }
+    unsigned bits = 63 - (unsigned)__builtin_clzll(ns);
+    if (bits >= STATS_HIST_MAX_BITS) {
+        return STATS_HIST_BUCKETS - 1;
+    }
+    unsigned shift = bits - STATS_HIST_SUB_BITS;
+    uint64_t sub = (ns >> shift) & ((1u << STATS_HIST_SUB_BITS) - 1);
+    return ((size_t)(shift + 1) << STATS_HIST_SUB_BITS) + (size_t)sub;
+}
+
+/**
+ * Record the end of an operation (the cleanup of STATS_SCOPE).
+ */
+void stats_leave(stats_scope_t const *scope) {
+    if (scope->ss_start == 0) {
+        return;
+    }
+    uint64_t ns = now_ns() - scope->ss_start;
+    trace_record((uint32_t)scope->ss_op, scope->ss_start, ns,
+                 scope->ss_inumber, scope->ss_block);
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed)) {
+        return;
+    }
+    op_counters_t *c = &thread_stats_get()->ops[scope->ss_op];
+    store(&c->count, load(&c->count) + 1);
+    store(&c->total_ns, load(&c->total_ns) + ns);
+    if (ns > load(&c->max_ns)) {
+        store(&c->max_ns, ns);
+    }
+    _Atomic uint64_t *bucket = &c->buckets[bucket_of(ns)];
+    store(bucket, load(bucket) + 1);
+}
+
+char const *tfs_op_name(tfs_op_t op) {
+    if ((size_t)op >= TFS_OP_COUNT) {
+        return NULL;
+    }
+    return op_names[op];
+}
+
+uint64_t tfs_stats_bucket_ns(size_t bucket) {
+    if (bucket < (1u << STATS_HIST_SUB_BITS)) {
+        return bucket;
+    }
+    size_t shift = (bucket >> STATS_HIST_SUB_BITS) - 1;
+    uint64_t sub = bucket & ((1u << STATS_HIST_SUB_BITS) - 1);
+    return ((1u << STATS_HIST_SUB_BITS) + sub) << shift;
+}
+
+uint64_t tfs_stats_percentile(tfs_op_stats_t const *op, double share) {
+    if (op->os_count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(share * (double)op->os_count);
+    if (rank >= op->os_count) {
+        rank = op->os_count - 1;
+    }
+    uint64_t seen = 0;
+    for (size_t b = 0; b < STATS_HIST_BUCKETS; b++) {
+        seen += op->os_buckets[b];
+        if (seen > rank) {
+            if (b + 1 == STATS_HIST_BUCKETS) {
+                return op->os_max_ns;
+            }
+            uint64_t end = tfs_stats_bucket_ns(b + 1) - 1;
+            return end < op->os_max_ns ? end : op->os_max_ns;
+        }
+    }
+    return op->os_max_ns;
+}
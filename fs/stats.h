@@ -0,0 +1,43 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "operations.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Operation statistics (see tfs_stats): every thread counts, and times into
+ * its own histograms, the operations it makes, with no shared writes; the
+ * threads' statistics are only added up when asked for.
+ */
+
+typedef struct {
+    tfs_op_t ss_op;
+    uint64_t ss_start; // 0 if not timed (collection and tracing disabled)
+    int ss_inumber;    // what the operation is about (traced), or -1
+    int ss_block;
+} stats_scope_t;
+
+void stats_init(bool enabled, bool traced);
+void stats_collect(tfs_stats_t *stats);
+
+uint64_t stats_start(void);
+void stats_leave(stats_scope_t const *scope);
+
+/*
+ * Time the rest of the enclosing block as an operation (whatever way it is
+ * left, returns included).
+ */
+#define STATS_SCOPE(op)                                                        \
+    stats_scope_t stats_scope_ __attribute__((cleanup(stats_leave))) = {       \
+        (op), stats_start(), -1, -1}
+
+/*
+ * Set the inode and data block (or -1) the operation of the enclosing
+ * STATS_SCOPE is about, for its trace event.
+ */
+#define STATS_TARGET(inumber, block)                                           \
+    (stats_scope_.ss_inumber = (inumber), stats_scope_.ss_block = (block))
+
+#endif // STATS_H
@@ -0,0 +1,271 @@
+#include "trace.h"
+#include "betterassert.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Every thread has a ring of fixed size events, which only it writes, with no
+ * locks: an event is claimed (the head moves on), written, and then
+ * committed. tfs_trace_dump copies the committed events of every ring, and
+ * then drops those that the writer may have claimed again meanwhile (that is,
+ * wrapped around to) while they were being copied.
+ *
+ * The rings are kept in a registry (like the counters of tfs_stats), past the
+ * exit of their threads and tfs_destroy, until tfs_init starts over.
+ */
+
+typedef struct {
+    uint64_t ev_start; // nanoseconds since trace_init
+    uint64_t ev_duration;
+    uint32_t ev_kind;
+    int32_t ev_inumber; // -1 if none
+    int64_t ev_block;   // -1 if none
+} trace_event_t;
+
+typedef struct trace_ring {
+    _Atomic uint64_t head;      // events claimed
+    _Atomic uint64_t committed; // events written
+    int tid;
+    struct trace_ring *next;
+    trace_event_t events[];
+} trace_ring_t;
+
+static atomic_bool enabled;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *registry;
+static size_t capacity; // events of every ring (a power of two)
+static uint64_t epoch;
+static int next_tid;
+// rings of an older trace_init are never written again
+static _Atomic uint64_t generation;
+static _Thread_local trace_ring_t *thread_ring;
+static _Thread_local uint64_t thread_generation;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Start tracing (or not), keeping the latest events (rounded up to a power of
+ * two) of every thread, and dropping the events traced before.
+ */
+void trace_init(size_t events) {
+    pthread_mutex_lock(&trace_lock);
+    while (registry != NULL) {
+        trace_ring_t *ring = registry;
+        registry = ring->next;
+        free(ring);
+    }
+    capacity = 1;
+    while (capacity < events) {
+        capacity *= 2;
+    }
+    epoch = now_ns();
+    next_tid = 1;
+    atomic_fetch_add(&generation, 1);
+    pthread_mutex_unlock(&trace_lock);
+    atomic_store(&enabled, events > 0);
+}
+
+/**
+ * Obtain the ring of the calling thread, creating it on first use (since
+ * trace_init).
+ */
+static trace_ring_t *thread_ring_get(void) {
+    uint64_t current = atomic_load_explicit(&generation, memory_order_relaxed);
+    if (thread_ring != NULL && thread_generation == current) {
+        return thread_ring;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    trace_ring_t *ring =
+        malloc(sizeof(trace_ring_t) + capacity * sizeof(trace_event_t));
+    ALWAYS_ASSERT(ring != NULL, "thread_ring_get: failed to allocate ring");
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->committed, 0);
+    ring->tid = next_tid++;
+    ring->next = registry;
+    registry = ring;
+    pthread_mutex_unlock(&trace_lock);
+
+    thread_ring = ring;
+    thread_generation = current;
+    return ring;
+}
+
+/**
+ * Time at which an event starts, or 0 if nothing is traced.
+ */
+uint64_t trace_start(void) {
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed)) {
+        return 0;
+    }
+    return now_ns();
+}
+
+/**
+ * Record an event of the calling thread (if tracing).
+ *
+ * Input:
+ *   - kind: the operation (a tfs_op_t), or TRACE_LOCK_WAIT
+ *   - start: when it started (as given by trace_start or stats_start)
+ *   - duration: how long it took, in nanoseconds
+ *   - inumber: the inode it was about, or -1
+ *   - block: the data block it was about, or -1
+ */
+void trace_record(uint32_t kind, uint64_t start, uint64_t duration,
+                  int inumber, int64_t block) {
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed)) {
+        return;
+    }
+    trace_ring_t *ring = thread_ring_get();
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_relaxed);
+    // the slot may only be seen overwritten once the claim is seen
+    atomic_thread_fence(memory_order_release);
+    ring->events[head & (capacity - 1)] = (trace_event_t){
+        .ev_start = start > epoch ? start - epoch : 0,
+        .ev_duration = duration,
+        .ev_kind = kind,
+        .ev_inumber = inumber,
+        .ev_block = block,
+    };
+    atomic_store_explicit(&ring->committed, head + 1, memory_order_release);
+}
+
+/**
+ * Record a wait for a lock, started at start (0 if nothing is traced), and
+ * over now.
+ */
+void trace_lock_wait(uint64_t start) {
+    if (start == 0) {
+        return;
+    }
+    trace_record(TRACE_LOCK_WAIT, start, now_ns() - start, -1, -1);
+}
+
+static char const *event_name(uint32_t kind) {
+    if (kind == TRACE_LOCK_WAIT) {
+        return "lock_wait";
+    }
+    return tfs_op_name((tfs_op_t)kind);
+}
+
+static char const *event_category(uint32_t kind) {
+    if (kind == TRACE_LOCK_WAIT) {
+        return "lock";
+    } else if (kind == TFS_OP_BLOCK_ACCESS) {
+        return "storage";
+    } else if (kind >= TFS_OP_INODE_CREATE) {
+        return "state";
+    }
+    return "op";
+}
+
+/**
+ * Copy the events of a ring that are sure to be whole.
+ *
+ * Input:
+ *   - ring: the ring
+ *   - out: where to copy them to (capacity events at most), oldest first
+ *   - dropped: incremented by the events lost to the ring wrapping around
+ *
+ * Returns the number of events copied.
+ */
+static size_t ring_copy(trace_ring_t *ring, trace_event_t *out,
+                        uint64_t *dropped) {
+    uint64_t end = atomic_load_explicit(&ring->committed, memory_order_acquire);
+    uint64_t begin = end > capacity ? end - capacity : 0;
+    for (uint64_t i = begin; i < end; i++) {
+        out[i - begin] = ring->events[i & (capacity - 1)];
+    }
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    // claimed again since: may have been torn
+    uint64_t first = head > capacity ? head - capacity : 0;
+    if (first < begin) {
+        first = begin;
+    }
+    *dropped += first;
+    size_t n = first < end ? (size_t)(end - first) : 0;
+    memmove(out, out + (first - begin), n * sizeof(trace_event_t));
+    return n;
+}
+
+static void write_event(FILE *out, pid_t pid, int tid,
+                        trace_event_t const *ev) {
+    fprintf(out,
+            ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+            "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+            event_name(ev->ev_kind), event_category(ev->ev_kind), (int)pid,
+            tid, (double)ev->ev_start / 1e3, (double)ev->ev_duration / 1e3);
+    if (ev->ev_inumber >= 0) {
+        fprintf(out, "\"inumber\":%d", (int)ev->ev_inumber);
+    }
+    if (ev->ev_block >= 0) {
+        fprintf(out, "%s\"block\":%lld", ev->ev_inumber >= 0 ? "," : "",
+                (long long)ev->ev_block);
+    }
+    fprintf(out, "}}");
+}
+
+/**
+ * Write the events of every ring to a file, in the Chrome trace event format
+ * (JSON).
+ *
+ * Returns 0 if successful, -1 otherwise (with errno set).
+ */
+int trace_dump(char const *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        return -1;
+    }
+
+    pid_t pid = getpid();
+    uint64_t dropped = 0;
+    fprintf(out, "{\"traceEvents\":[\n");
+    fprintf(out,
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"args\":{\"name\":\"tecnicofs\"}}",
+            (int)pid);
+    pthread_mutex_lock(&trace_lock);
+    trace_event_t *events = malloc(capacity * sizeof(trace_event_t));
+    ALWAYS_ASSERT(events != NULL, "trace_dump: failed to allocate events");
+    for (trace_ring_t *ring = registry; ring != NULL; ring = ring->next) {
+        fprintf(out,
+                ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                (int)pid, ring->tid, ring->tid);
+        size_t n = ring_copy(ring, events, &dropped);
+        for (size_t i = 0; i < n; i++) {
+            write_event(out, pid, ring->tid, &events[i]);
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    free(events);
+    fprintf(out,
+            "\n],\"displayTimeUnit\":\"ns\","
+            "\"otherData\":{\"dropped_events\":%llu}}\n",
+            (unsigned long long)dropped);
+
+    bool failed = ferror(out) != 0;
+    int saved_errno = errno;
+    if (fclose(out) != 0) {
+        return -1;
+    }
+    if (failed) {
+        errno = saved_errno != 0 ? saved_errno : EIO;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "operations.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Event tracing (see tfs_trace_dump): every thread writes the operations it
+ * makes (the scopes of STATS_SCOPE), and the locks it waits for, into a ring
+ * of its own, keeping the latest tfs_params.trace_events of them.
+ */
+
+// kinds of events: the operations of tfs_op_t, and then these
+#define TRACE_LOCK_WAIT ((uint32_t)TFS_OP_COUNT)
+
+void trace_init(size_t events);
+uint64_t trace_start(void);
+void trace_record(uint32_t kind, uint64_t start, uint64_t duration,
+                  int inumber, int64_t block);
+void trace_lock_wait(uint64_t start);
+int trace_dump(char const *path);
+
+#endif // TRACE_H
@@ -0,0 +1,147 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+ * This test runs concurrent writers and readers on the batching backends: the
+ * io_uring backend (or the thread pool, if io_uring is unavailable) and the
+ * thread pool backend. Each thread grows its own file with vectored writes
+ * whose buffers cover whole blocks and partial ones, so a single call becomes
+ * a batch of several transfers, and the transfers of the threads meet in the
+ * device at the same time. The files are checked with unaligned preads, both
+ * while running and after reloading the image. The io_uring backend is run
+ * once more with its ring broken (so that io_uring_enter fails), which must
+ * fall back to pread/pwrite.
+ * */
+
+#define BLOCK_SIZE 512
+#define THREADS 4
+#define ROUNDS 12
+#define PIECES 5
+#define PIECE (3 * BLOCK_SIZE + 100)
+#define FILE_SIZE (ROUNDS * PIECES * PIECE)
+
+static uint8_t pattern(size_t file, size_t i) {
+    return (uint8_t)(file * 37 + i * 11 + i / 251 + 3);
+}
+
+static void path_of(char *path, size_t file) { sprintf(path, "/f%zu", file); }
+
+static void check_file(size_t file) {
+    char path[16];
+    path_of(path, file);
+    int fh = tfs_open(path, 0);
+    assert(fh != -1);
+
+    static _Thread_local uint8_t buffer[FILE_SIZE];
+    assert(tfs_pread(fh, buffer, sizeof(buffer), 0) == FILE_SIZE);
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        assert(buffer[i] == pattern(file, i));
+    }
+
+    // unaligned pieces, spanning block boundaries
+    for (size_t offset = 7; offset + 5 * BLOCK_SIZE < FILE_SIZE;
+         offset += 4 * BLOCK_SIZE + 13) {
+        uint8_t piece[5 * BLOCK_SIZE];
+        assert(tfs_pread(fh, piece, sizeof(piece), offset) == sizeof(piece));
+        for (size_t i = 0; i < sizeof(piece); i++) {
+            assert(piece[i] == pattern(file, offset + i));
+        }
+    }
+    assert(tfs_close(fh) != -1);
+}
+
+static void *worker(void *arg) {
+    size_t file = (size_t)arg;
+    char path[16];
+    path_of(path, file);
+    int fh = tfs_open(path, TFS_O_CREAT);
+    assert(fh != -1);
+
+    static _Thread_local uint8_t pieces[PIECES][PIECE];
+    size_t pos = 0;
+    for (size_t r = 0; r < ROUNDS; r++) {
+        struct iovec iov[PIECES];
+        for (size_t p = 0; p < PIECES; p++) {
+            for (size_t i = 0; i < PIECE; i++) {
+                pieces[p][i] = pattern(file, pos + p * PIECE + i);
+            }
+            iov[p] = (struct iovec){.iov_base = pieces[p], .iov_len = PIECE};
+        }
+        assert(tfs_writev(fh, iov, PIECES) == PIECES * PIECE);
+        pos += PIECES * PIECE;
+    }
+    assert(tfs_close(fh) != -1);
+
+    check_file(file);
+    return NULL;
+}
+
+// put /dev/null in place of the io_uring instances of this process (if any)
+static void break_rings(void) {
+    DIR *dir = opendir("/proc/self/fd");
+    assert(dir != NULL);
+    int null_fd = open("/dev/null", O_RDWR);
+    assert(null_fd != -1);
+    for (struct dirent *ent = readdir(dir); ent != NULL; ent = readdir(dir)) {
+        char target[64] = {0};
+        ssize_t len =
+            readlinkat(dirfd(dir), ent->d_name, target, sizeof(target) - 1);
+        if (len != -1 && strstr(target, "io_uring") != NULL) {
+            assert(dup2(null_fd, atoi(ent->d_name)) != -1);
+        }
+    }
+    close(null_fd);
+    closedir(dir);
+}
+
+static void run_workload(tfs_backend_t backend, bool broken) {
+    char image_path[] = "/tmp/tfs_async_XXXXXX";
+    int fd = mkstemp(image_path);
+    assert(fd != -1);
+    close(fd);
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = 2 * THREADS * FILE_SIZE / BLOCK_SIZE;
+    params.image_path = image_path;
+    params.backend = backend;
+
+    assert(tfs_init(&params) != -1);
+    if (broken) {
+        break_rings();
+    }
+    pthread_t tid[THREADS];
+    for (size_t t = 0; t < THREADS; t++) {
+        assert(pthread_create(&tid[t], NULL, worker, (void *)t) == 0);
+    }
+    for (size_t t = 0; t < THREADS; t++) {
+        assert(pthread_join(tid[t], NULL) == 0);
+    }
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init(&params) != -1);
+    for (size_t t = 0; t < THREADS; t++) {
+        check_file(t);
+    }
+    assert(tfs_destroy() != -1);
+    unlink(image_path);
+}
+
+int main() {
+    run_workload(TFS_BACKEND_URING, false);
+    run_workload(TFS_BACKEND_THREAD_POOL, false);
+    run_workload(TFS_BACKEND_URING, true);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,185 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * This test runs the same workload on every block device backend: the file
+ * backend (blocks accessed through pread/pwrite, so directory and extent
+ * blocks go through frames), and the latency model over both. The workload
+ * grows a directory over several blocks, writes files with more extents than
+ * fit in the inode, leaves a gap of zeros, and takes read views. With the file
+ * backend, the FS is also reloaded from the image (after a failed tfs_init on
+ * it). Finally, the latency model must actually delay accesses.
+ * */
+
+#define BLOCK_SIZE 512
+#define FILES 60
+#define CHUNK 700
+#define CHUNKS 20
+
+static uint8_t pattern(size_t file, size_t i) {
+    return (uint8_t)(file * 31 + i * 7 + 1);
+}
+
+static void path_of(char *path, size_t file) {
+    sprintf(path, "/d/f%zu", file);
+}
+
+static void write_files(void) {
+    assert(tfs_mkdir("/d") != -1);
+
+    int handles[FILES];
+    for (size_t f = 0; f < FILES; f++) {
+        char path[32];
+        path_of(path, f);
+        handles[f] = tfs_open(path, TFS_O_CREAT);
+        assert(handles[f] != -1);
+    }
+
+    // the two first files grow in alternating chunks, so that their blocks
+    // interleave and they overflow the inline extents
+    uint8_t buffer[CHUNK];
+    for (size_t c = 0; c < CHUNKS; c++) {
+        for (size_t f = 0; f < 2; f++) {
+            for (size_t i = 0; i < CHUNK; i++) {
+                buffer[i] = pattern(f, c * CHUNK + i);
+            }
+            assert(tfs_write(handles[f], buffer, CHUNK) == CHUNK);
+        }
+    }
+
+    // the others hold a byte after a gap of zeros
+    for (size_t f = 2; f < FILES; f++) {
+        uint8_t b = pattern(f, 0);
+        assert(tfs_pwrite(handles[f], &b, 1, BLOCK_SIZE + f) == 1);
+        assert(tfs_close(handles[f]) != -1);
+    }
+    assert(tfs_close(handles[0]) != -1);
+    assert(tfs_close(handles[1]) != -1);
+}
+
+static void check_files(void) {
+    for (size_t f = 0; f < 2; f++) {
+        char path[32];
+        path_of(path, f);
+        int fh = tfs_open(path, 0);
+        assert(fh != -1);
+
+        static uint8_t buffer[CHUNK * CHUNKS];
+        assert(tfs_read(fh, buffer, sizeof(buffer)) == sizeof(buffer));
+        for (size_t i = 0; i < sizeof(buffer); i++) {
+            assert(buffer[i] == pattern(f, i));
+        }
+
+        tfs_view_t view;
+        assert(tfs_read_view(fh, 10, sizeof(buffer), &view) ==
+               sizeof(buffer) - 10);
+        size_t pos = 10;
+        for (int r = 0; r < view.v_run_count; r++) {
+            uint8_t const *run = view.v_runs[r].vr_base;
+            for (size_t i = 0; i < view.v_runs[r].vr_len; i++) {
+                assert(run[i] == pattern(f, pos + i));
+            }
+            pos += view.v_runs[r].vr_len;
+        }
+        assert(pos == sizeof(buffer));
+        tfs_release_view(&view);
+        assert(tfs_close(fh) != -1);
+    }
+
+    for (size_t f = 2; f < FILES; f++) {
+        char path[32];
+        path_of(path, f);
+        int fh = tfs_open(path, 0);
+        assert(fh != -1);
+        uint8_t buffer[BLOCK_SIZE + FILES + 1];
+        size_t size = BLOCK_SIZE + f + 1;
+        assert(tfs_read(fh, buffer, sizeof(buffer)) == (ssize_t)size);
+        for (size_t i = 0; i < size - 1; i++) {
+            assert(buffer[i] == 0);
+        }
+        assert(buffer[size - 1] == pattern(f, 0));
+        assert(tfs_close(fh) != -1);
+    }
+}
+
+static void run_workload(tfs_params const *params, bool reload) {
+    assert(tfs_init(params) != -1);
+    write_files();
+    check_files();
+    assert(tfs_sync() != -1);
+    assert(tfs_destroy() != -1);
+
+    if (reload) {
+        assert(tfs_init(params) != -1);
+        check_files();
+        assert(tfs_destroy() != -1);
+    }
+}
+
+static double elapsed(struct timespec const *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) +
+           (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main() {
+    char image_path[] = "/tmp/tfs_backend_XXXXXX";
+    int fd = mkstemp(image_path);
+    assert(fd != -1);
+    close(fd);
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_inode_count = FILES + 2;
+
+    // the file backend needs an image
+    params.backend = TFS_BACKEND_FILE;
+    assert(tfs_init(&params) == -1);
+
+    params.image_path = image_path;
+    // a failure after the image is set up leaves neither it nor the state
+    // behind
+    params.backend = (tfs_backend_t)99;
+    assert(tfs_init(&params) == -1);
+    params.backend = TFS_BACKEND_FILE;
+    run_workload(&params, true);
+    unlink(image_path);
+
+    // latency model, over the file and the in-memory backends
+    params.device_latency_ns = 1000;
+    params.device_bandwidth = 1ULL << 32;
+    strcpy(image_path, "/tmp/tfs_backend_XXXXXX");
+    fd = mkstemp(image_path);
+    assert(fd != -1);
+    close(fd);
+    run_workload(&params, false);
+    unlink(image_path);
+
+    params.backend = TFS_BACKEND_RAM;
+    params.image_path = NULL;
+    run_workload(&params, false);
+
+    // every access waits for the modelled latency
+    params.device_latency_ns = 2 * 1000 * 1000;
+    params.device_bandwidth = 0;
+    assert(tfs_init(&params) != -1);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int fh = tfs_open("/f", TFS_O_CREAT);
+    assert(fh != -1);
+    assert(elapsed(&start) >= 0.002);
+    assert(tfs_close(fh) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * This test checks the buffer cache in front of the file backend, with a
+ * budget far smaller than the data:
+ *   - files larger than the cache are written and read back intact;
+ *   - a small file read over and over is served from the cache;
+ *   - scans of a large file do not push that small file out;
+ *   - threads reading and writing their own files (and sharing one) through
+ *     the small cache see their own data.
+ * */
+
+#define BLOCK_SIZE 512
+#define CACHE_BLOCKS 64
+#define HOT_BLOCKS 8
+#define SCAN_BLOCKS 400
+#define THREADS 4
+#define THREAD_BLOCKS 40
+// blocks are touched once per pass, or twice (by consecutive calls)
+#define ALIGNED (4 * BLOCK_SIZE)
+#define UNALIGNED (3 * BLOCK_SIZE + 17)
+
+static uint8_t pattern(size_t file, size_t i) {
+    return (uint8_t)(file * 13 + i * 5 + i / 509);
+}
+
+static void write_file(char const *path, size_t file, size_t size,
+                       size_t chunk) {
+    int fh = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(fh != -1);
+    uint8_t buffer[4 * BLOCK_SIZE];
+    for (size_t pos = 0; pos < size;) {
+        size_t n = chunk;
+        if (n > size - pos) {
+            n = size - pos;
+        }
+        for (size_t i = 0; i < n; i++) {
+            buffer[i] = pattern(file, pos + i);
+        }
+        assert(tfs_write(fh, buffer, n) == (ssize_t)n);
+        pos += n;
+    }
+    assert(tfs_close(fh) != -1);
+}
+
+static void check_file(char const *path, size_t file, size_t size,
+                       size_t chunk) {
+    int fh = tfs_open(path, 0);
+    assert(fh != -1);
+    uint8_t buffer[4 * BLOCK_SIZE];
+    for (size_t pos = 0; pos < size;) {
+        ssize_t r = tfs_read(fh, buffer, chunk);
+        assert(r > 0);
+        for (size_t i = 0; i < (size_t)r; i++) {
+            assert(buffer[i] == pattern(file, pos + i));
+        }
+        pos += (size_t)r;
+    }
+    assert(tfs_read(fh, buffer, chunk) == 0);
+    assert(tfs_close(fh) != -1);
+}
+
+static void *worker(void *arg) {
+    size_t t = (size_t)arg;
+    char path[16];
+    sprintf(path, "/t%zu", t);
+    for (int round = 0; round < 3; round++) {
+        write_file(path, 10 + t, THREAD_BLOCKS * BLOCK_SIZE - t, UNALIGNED);
+        check_file(path, 10 + t, THREAD_BLOCKS * BLOCK_SIZE - t, UNALIGNED);
+        check_file("/scan", 2, SCAN_BLOCKS * BLOCK_SIZE, ALIGNED);
+    }
+    return NULL;
+}
+
+int main() {
+    char image_path[] = "/tmp/tfs_bcache_XXXXXX";
+    int fd = mkstemp(image_path);
+    assert(fd != -1);
+    close(fd);
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = 1024;
+    params.image_path = image_path;
+    params.backend = TFS_BACKEND_FILE;
+    params.cache_size = CACHE_BLOCKS * BLOCK_SIZE;
+    assert(tfs_init(&params) != -1);
+
+    tfs_cache_stats_t stats;
+    tfs_cache_stats(&stats);
+    assert(stats.cs_capacity == CACHE_BLOCKS);
+
+    // larger than the cache
+    write_file("/scan", 2, SCAN_BLOCKS * BLOCK_SIZE, ALIGNED);
+    check_file("/scan", 2, SCAN_BLOCKS * BLOCK_SIZE, ALIGNED);
+    tfs_cache_stats(&stats);
+    assert(stats.cs_resident <= CACHE_BLOCKS);
+    // with the flusher caught up, the scan leaves no dirty blocks behind
+    assert(tfs_sync() != -1);
+
+    // a small file, read over and over, stays in the cache
+    write_file("/hot", 1, HOT_BLOCKS * BLOCK_SIZE, ALIGNED);
+    for (int i = 0; i < 3; i++) {
+        check_file("/hot", 1, HOT_BLOCKS * BLOCK_SIZE, ALIGNED);
+    }
+    tfs_cache_stats_t before;
+    tfs_cache_stats(&before);
+    check_file("/hot", 1, HOT_BLOCKS * BLOCK_SIZE, ALIGNED);
+    tfs_cache_stats(&stats);
+    assert(stats.cs_misses == before.cs_misses);
+    assert(stats.cs_hits > before.cs_hits);
+
+    // once reused, even scans of a file that does not fit leave it there
+    for (int i = 0; i < 3; i++) {
+        check_file("/scan", 2, SCAN_BLOCKS * BLOCK_SIZE, ALIGNED);
+        check_file("/hot", 1, HOT_BLOCKS * BLOCK_SIZE, ALIGNED);
+    }
+    check_file("/scan", 2, SCAN_BLOCKS * BLOCK_SIZE, ALIGNED);
+    tfs_cache_stats(&before);
+    check_file("/hot", 1, HOT_BLOCKS * BLOCK_SIZE, ALIGNED);
+    tfs_cache_stats(&stats);
+    assert(stats.cs_misses == before.cs_misses);
+
+    pthread_t tid[THREADS];
+    for (size_t t = 0; t < THREADS; t++) {
+        assert(pthread_create(&tid[t], NULL, worker, (void *)t) == 0);
+    }
+    for (size_t t = 0; t < THREADS; t++) {
+        assert(pthread_join(tid[t], NULL) == 0);
+    }
+    assert(tfs_destroy() != -1);
+
+    // everything reached the image
+    assert(tfs_init(&params) != -1);
+    check_file("/hot", 1, HOT_BLOCKS * BLOCK_SIZE, ALIGNED);
+    check_file("/scan", 2, SCAN_BLOCKS * BLOCK_SIZE, ALIGNED);
+    for (size_t t = 0; t < THREADS; t++) {
+        char path[16];
+        sprintf(path, "/t%zu", t);
+        check_file(path, 10 + t, THREAD_BLOCKS * BLOCK_SIZE - t, UNALIGNED);
+    }
+    assert(tfs_destroy() != -1);
+    unlink(image_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,137 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * This test copies files far larger than a block (and than a copy chunk) from
+ * the OS' file system, with a block size other than the default one:
+ *   - the whole file is copied, and reads back intact;
+ *   - copying over a larger file leaves only the new contents;
+ *   - a source that cannot be mapped (a FIFO) is streamed;
+ *   - a file that does not fit fails with ENOSPC, and gives its blocks back;
+ *   - missing sources and destinations fail with ENOENT.
+ * */
+
+#define BLOCK_SIZE 512
+#define BLOCK_COUNT 8192
+#define LARGE_SIZE (3 * 1024 * 1024 + 123)
+#define SMALL_SIZE (5 * BLOCK_SIZE + 7)
+#define FIFO_SIZE (100 * 1000)
+
+static uint8_t pattern(size_t file, size_t i) {
+    return (uint8_t)(file * 31 + i * 13 + i / 1021);
+}
+
+static void make_source(char const *path, size_t file, size_t size) {
+    FILE *out = fopen(path, "w");
+    assert(out != NULL);
+    for (size_t i = 0; i < size; i++) {
+        assert(fputc(pattern(file, i), out) != EOF);
+    }
+    assert(fclose(out) == 0);
+}
+
+static void check_copy(char const *path, size_t file, size_t size) {
+    int fh = tfs_open(path, 0);
+    assert(fh != -1);
+    uint8_t buffer[7777];
+    size_t pos = 0;
+    ssize_t r;
+    while ((r = tfs_read(fh, buffer, sizeof(buffer))) > 0) {
+        for (size_t i = 0; i < (size_t)r; i++) {
+            assert(buffer[i] == pattern(file, pos + i));
+        }
+        pos += (size_t)r;
+    }
+    assert(r == 0);
+    assert(pos == size);
+    assert(tfs_close(fh) != -1);
+}
+
+int main() {
+    char large[] = "/tmp/tfs_copy_large_XXXXXX";
+    char small[] = "/tmp/tfs_copy_small_XXXXXX";
+    char huge[] = "/tmp/tfs_copy_huge_XXXXXX";
+    char fifo[] = "/tmp/tfs_copy_fifo_XXXXXX";
+    int fd;
+    assert((fd = mkstemp(large)) != -1 && close(fd) == 0);
+    assert((fd = mkstemp(small)) != -1 && close(fd) == 0);
+    assert((fd = mkstemp(huge)) != -1 && close(fd) == 0);
+    assert((fd = mkstemp(fifo)) != -1 && close(fd) == 0);
+    make_source(large, 1, LARGE_SIZE);
+    make_source(small, 2, SMALL_SIZE);
+    make_source(huge, 3, (BLOCK_COUNT + 1) * BLOCK_SIZE);
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = BLOCK_COUNT;
+    assert(tfs_init(&params) != -1);
+
+    assert(tfs_copy_from_external_fs(large, "/large") == 0);
+    check_copy("/large", 1, LARGE_SIZE);
+
+    // over a larger file, and back (which needs the blocks freed)
+    assert(tfs_copy_from_external_fs(small, "/large") == 0);
+    check_copy("/large", 2, SMALL_SIZE);
+    assert(tfs_copy_from_external_fs(large, "/large") == 0);
+    check_copy("/large", 1, LARGE_SIZE);
+    assert(tfs_copy_from_external_fs(small, "/f") == 0);
+    check_copy("/f", 2, SMALL_SIZE);
+
+    // a FIFO, fed by a child process
+    assert(unlink(fifo) == 0 && mkfifo(fifo, 0600) == 0);
+    pid_t child = fork();
+    assert(child != -1);
+    if (child == 0) {
+        FILE *out = fopen(fifo, "w");
+        for (size_t i = 0; out != NULL && i < FIFO_SIZE; i++) {
+            fputc(pattern(4, i), out);
+        }
+        _exit(out != NULL && fclose(out) == 0 ? 0 : 1);
+    }
+    assert(tfs_copy_from_external_fs(fifo, "/fifo") == 0);
+    int status;
+    assert(waitpid(child, &status, 0) == child && status == 0);
+    check_copy("/fifo", 4, FIFO_SIZE);
+    assert(tfs_unlink("/fifo") == 0);
+
+    // no room: nothing is left behind
+    assert(tfs_unlink("/large") == 0);
+    errno = 0;
+    assert(tfs_copy_from_external_fs(huge, "/huge") == -1);
+    assert(errno == ENOSPC);
+    assert(tfs_open("/huge", 0) == -1);
+    assert(tfs_copy_from_external_fs(huge, "/f") == -1);
+    assert(errno == ENOSPC);
+    check_copy("/f", 2, 0);
+    assert(tfs_copy_from_external_fs(large, "/large") == 0);
+    check_copy("/large", 1, LARGE_SIZE);
+
+    errno = 0;
+    assert(tfs_copy_from_external_fs("/tmp/tfs_copy_missing", "/g") == -1);
+    assert(errno == ENOENT);
+    errno = 0;
+    assert(tfs_copy_from_external_fs(small, "/missing/g") == -1);
+    assert(errno == ENOENT);
+    errno = 0;
+    assert(tfs_copy_from_external_fs("/tmp", "/g") == -1);
+    assert(errno == EISDIR);
+
+    assert(tfs_destroy() != -1);
+    unlink(large);
+    unlink(small);
+    unlink(huge);
+    unlink(fifo);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
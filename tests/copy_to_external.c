@@ -0,0 +1,110 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * This test copies files out of TécnicoFS, on every backend (blocks in memory,
+ * in the mapped image, and in the image file behind the buffer cache, with and
+ * without a latency model):
+ *   - files spread over many extents (written in turns), with a partial last
+ *     block, come out intact, including changes still in the buffer cache;
+ *   - an empty file comes out empty, over a longer host file;
+ *   - a missing source, or a destination in a missing directory, fail with
+ *     ENOENT.
+ * */
+
+#define BLOCK_SIZE 512
+#define PIECE (3 * BLOCK_SIZE)
+#define PIECES 40
+#define TAIL 77
+
+static uint8_t pattern(size_t file, size_t i) {
+    return (uint8_t)(file * 41 + i * 3 + i / 509);
+}
+
+static void check_host_file(char const *path, size_t file, size_t size) {
+    FILE *in = fopen(path, "r");
+    assert(in != NULL);
+    size_t i = 0;
+    int c;
+    while ((c = fgetc(in)) != EOF) {
+        assert(i < size && (uint8_t)c == pattern(file, i));
+        i++;
+    }
+    assert(i == size);
+    assert(fclose(in) == 0);
+}
+
+static void run(tfs_backend_t backend, bool image, uint64_t latency_ns) {
+    char image_path[] = "/tmp/tfs_export_image_XXXXXX";
+    char out_path[] = "/tmp/tfs_export_out_XXXXXX";
+    int fd = mkstemp(image_path);
+    assert(fd != -1 && close(fd) == 0);
+    fd = mkstemp(out_path);
+    assert(fd != -1 && close(fd) == 0);
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = 1024;
+    params.image_path = image ? image_path : NULL;
+    params.backend = backend;
+    params.device_latency_ns = latency_ns;
+    assert(tfs_init(&params) != -1);
+
+    // pieces written in turns: the files get an extent per piece
+    int fa = tfs_open("/a", TFS_O_CREAT);
+    int fb = tfs_open("/b", TFS_O_CREAT);
+    assert(fa != -1 && fb != -1);
+    uint8_t piece[PIECE];
+    for (size_t p = 0; p < PIECES; p++) {
+        size_t len = p + 1 < PIECES ? PIECE : TAIL;
+        for (size_t i = 0; i < len; i++) {
+            piece[i] = pattern(1, p * PIECE + i);
+        }
+        assert(tfs_write(fa, piece, len) == (ssize_t)len);
+        for (size_t i = 0; i < len; i++) {
+            piece[i] = pattern(2, p * PIECE + i);
+        }
+        assert(tfs_write(fb, piece, len) == (ssize_t)len);
+    }
+    assert(tfs_close(fa) != -1 && tfs_close(fb) != -1);
+    int fe = tfs_open("/empty", TFS_O_CREAT);
+    assert(fe != -1 && tfs_close(fe) != -1);
+
+    size_t size = (PIECES - 1) * PIECE + TAIL;
+    assert(tfs_copy_to_external_fs("/a", out_path) == 0);
+    check_host_file(out_path, 1, size);
+    assert(tfs_copy_to_external_fs("/b", out_path) == 0);
+    check_host_file(out_path, 2, size);
+    assert(tfs_copy_to_external_fs("/empty", out_path) == 0);
+    check_host_file(out_path, 0, 0);
+
+    errno = 0;
+    assert(tfs_copy_to_external_fs("/missing", out_path) == -1);
+    assert(errno == ENOENT);
+    errno = 0;
+    assert(tfs_copy_to_external_fs("/a", "/tmp/tfs_missing_dir/out") == -1);
+    assert(errno == ENOENT);
+
+    assert(tfs_destroy() != -1);
+    unlink(image_path);
+    unlink(out_path);
+}
+
+int main() {
+    run(TFS_BACKEND_RAM, false, 0);
+    run(TFS_BACKEND_RAM, true, 0);
+    run(TFS_BACKEND_FILE, true, 0);
+    run(TFS_BACKEND_URING, true, 0);
+    run(TFS_BACKEND_FILE, true, 1000);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include "fs/operations.h"
+#include "fs/state.h"
+#include <assert.h>
+#include <stdio.h>
+
+/*
+ * This test checks the block allocator: runs of contiguous blocks are handed
+ * out next-fit, runs spanning several bitmap words are found, freed holes are
+ * reused once the search wraps around, and single blocks cached in the
+ * thread's magazine are still handed out when no run is left.
+ * */
+
+#define BLOCKS 200
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCKS;
+    // the root directory takes block 0, through a magazine holding the first
+    // BLOCK_MAGAZINE_BATCH blocks
+    assert(tfs_init(&params) != -1);
+    int base = BLOCK_MAGAZINE_BATCH;
+
+    int a = data_block_alloc_n(10);
+    assert(a == base);
+    int b = data_block_alloc_n(100); // crosses two bitmap words
+    assert(b == base + 10);
+    int c = data_block_alloc_n(1);
+    assert(c == base + 110);
+
+    // a hole of 10 blocks behind the hint: too small for 20, reused for 5
+    data_block_free_n(a, 10);
+    int d = data_block_alloc_n(20);
+    assert(d == base + 111);
+    int left = BLOCKS - (base + 131);
+    assert(data_block_alloc_n((size_t)left + 1) == -1);
+    int e = data_block_alloc_n((size_t)left);
+    assert(e == base + 131);
+    int f = data_block_alloc_n(5); // wraps around into the hole
+    assert(f == base);
+
+    // no run is left, although single blocks are
+    assert(data_block_alloc_n(6) == -1);
+    for (int i = 0; i < 5 + BLOCK_MAGAZINE_BATCH - 1; i++) {
+        assert(data_block_alloc() != -1);
+    }
+    assert(data_block_alloc() == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
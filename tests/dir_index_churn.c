@@ -0,0 +1,61 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+
+/*
+ * This test creates and removes files in the root directory in many rounds,
+ * so that lookups go through a directory hash index holding many tombstones
+ * (and that gets rebuilt), checking that every name is found exactly while it
+ * exists.
+ * */
+
+#define FILES 20
+#define ROUNDS 50
+#define MAX_PATH_SIZE 32
+
+static void format_path(char *path, int round, int i) {
+    snprintf(path, MAX_PATH_SIZE, "/r%d_f%d", round, i);
+}
+
+static void assert_exists(int round, int i, int exists) {
+    char path[MAX_PATH_SIZE];
+    format_path(path, round, i);
+    int f = tfs_open(path, 0);
+    assert((f != -1) == exists);
+    if (f != -1) {
+        assert(tfs_close(f) != -1);
+    }
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    char path[MAX_PATH_SIZE];
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < FILES; i++) {
+            format_path(path, round, i);
+            int f = tfs_open(path, TFS_O_CREAT);
+            assert(f != -1);
+            assert(tfs_close(f) != -1);
+        }
+
+        for (int i = 0; i < FILES; i++) {
+            assert_exists(round, i, 1);
+            if (round > 0) {
+                assert_exists(round - 1, i, 0);
+            }
+        }
+
+        for (int i = 0; i < FILES; i++) {
+            format_path(path, round, i);
+            assert(tfs_unlink(path) != -1);
+            assert_exists(round, i, 0);
+        }
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+
+/*
+ * This test fills the root directory with many more names than fit in a
+ * single block, forcing its buckets to split, and checks that every name can
+ * be found, removed and added again.
+ * */
+
+#define FILES 2000
+#define MAX_PATH_SIZE 32
+
+static void format_path(char *path, int i) {
+    snprintf(path, MAX_PATH_SIZE, "/file_%d", i);
+}
+
+static int exists(int i) {
+    char path[MAX_PATH_SIZE];
+    format_path(path, i);
+    int f = tfs_open(path, 0);
+    if (f == -1) {
+        return 0;
+    }
+    assert(tfs_close(f) != -1);
+    return 1;
+}
+
+static void create(int i) {
+    char path[MAX_PATH_SIZE];
+    format_path(path, i);
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = FILES + 1;
+    assert(tfs_init(&params) != -1);
+
+    for (int i = 0; i < FILES; i++) {
+        create(i);
+    }
+    for (int i = 0; i < FILES; i++) {
+        assert(exists(i));
+    }
+
+    // remove the even names
+    char path[MAX_PATH_SIZE];
+    for (int i = 0; i < FILES; i += 2) {
+        format_path(path, i);
+        assert(tfs_unlink(path) != -1);
+    }
+    for (int i = 0; i < FILES; i++) {
+        assert(exists(i) == i % 2);
+    }
+
+    // and add them back
+    for (int i = 0; i < FILES; i += 2) {
+        create(i);
+    }
+    for (int i = 0; i < FILES; i++) {
+        assert(exists(i));
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
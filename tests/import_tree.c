@@ -0,0 +1,173 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * This test imports a host directory tree into TécnicoFS with a pool of
+ * threads:
+ *   - every regular file, in nested directories, is imported intact (empty
+ *     files, files of a block, and files of many blocks);
+ *   - symbolic links are skipped;
+ *   - importing again over the imported tree replaces the files;
+ *   - a missing host directory fails with ENOENT, and bad arguments with
+ *     EINVAL.
+ * */
+
+#define BLOCK_SIZE 512
+#define DIRS 8
+#define FILES_PER_DIR 25
+#define THREADS 4
+
+static uint8_t pattern(size_t file, size_t i) {
+    return (uint8_t)(file * 37 + i * 11 + i / 503);
+}
+
+static size_t file_size(size_t file) {
+    return file % 7 == 0 ? 0 : (file * 131) % (9 * BLOCK_SIZE);
+}
+
+static void make_file(char const *path, size_t file) {
+    FILE *out = fopen(path, "w");
+    assert(out != NULL);
+    for (size_t i = 0; i < file_size(file); i++) {
+        assert(fputc(pattern(file, i), out) != EOF);
+    }
+    assert(fclose(out) == 0);
+}
+
+static void check_file(char const *path, size_t file) {
+    int fh = tfs_open(path, 0);
+    assert(fh != -1);
+    uint8_t buffer[10 * BLOCK_SIZE];
+    ssize_t r = tfs_read(fh, buffer, sizeof(buffer));
+    assert(r == (ssize_t)file_size(file));
+    for (size_t i = 0; i < (size_t)r; i++) {
+        assert(buffer[i] == pattern(file, i));
+    }
+    assert(tfs_close(fh) != -1);
+}
+
+// host: <root>/d<d>/f<f>, with d<odd> nested in a "sub" directory
+static void path_of(char *path, size_t size, char const *root, size_t file) {
+    size_t d = file / FILES_PER_DIR;
+    snprintf(path, size, "%s%s/d%zu/f%zu", root, d % 2 == 1 ? "/sub" : "", d,
+             file % FILES_PER_DIR);
+}
+
+static void make_tree(char const *root, size_t shift) {
+    char path[256];
+    for (size_t d = 0; d < DIRS; d++) {
+        snprintf(path, sizeof(path), "%s%s/d%zu", root,
+                 d % 2 == 1 ? "/sub" : "", d);
+        assert(mkdir(path, 0700) == 0 || errno == EEXIST);
+        for (size_t f = 0; f < FILES_PER_DIR; f++) {
+            size_t file = d * FILES_PER_DIR + f;
+            path_of(path, sizeof(path), root, file);
+            make_file(path, file + shift);
+        }
+    }
+}
+
+static void check_tree(size_t shift) {
+    char path[256];
+    for (size_t file = 0; file < DIRS * FILES_PER_DIR; file++) {
+        path_of(path, sizeof(path), "/data", file);
+        check_file(path, file + shift);
+    }
+}
+
+static void remove_tree(char const *root) {
+    char path[256];
+    for (size_t file = 0; file < DIRS * FILES_PER_DIR; file++) {
+        path_of(path, sizeof(path), root, file);
+        assert(unlink(path) == 0);
+    }
+    for (size_t d = 0; d < DIRS; d++) {
+        snprintf(path, sizeof(path), "%s%s/d%zu", root,
+                 d % 2 == 1 ? "/sub" : "", d);
+        assert(rmdir(path) == 0);
+    }
+    snprintf(path, sizeof(path), "%s/link", root);
+    assert(unlink(path) == 0);
+    snprintf(path, sizeof(path), "%s/sub", root);
+    assert(rmdir(path) == 0);
+    assert(rmdir(root) == 0);
+}
+
+int main() {
+    char root[] = "/tmp/tfs_import_XXXXXX";
+    assert(mkdtemp(root) != NULL);
+    char path[256];
+    snprintf(path, sizeof(path), "%s/sub", root);
+    assert(mkdir(path, 0700) == 0);
+    make_tree(root, 0);
+    snprintf(path, sizeof(path), "%s/link", root);
+    assert(symlink("d0/f1", path) == 0);
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = 4096;
+    params.max_inode_count = 512;
+    assert(tfs_init(&params) != -1);
+    assert(tfs_mkdir("/data") != -1);
+
+    tfs_import_stats_t stats;
+    assert(tfs_import_tree(root, "/data", THREADS, &stats) == 0);
+    assert(stats.is_files == DIRS * FILES_PER_DIR);
+    assert(stats.is_dirs == DIRS + 1);
+    assert(stats.is_skipped == 1);
+    assert(stats.is_failed == 0);
+    uint64_t bytes = 0;
+    for (size_t file = 0; file < DIRS * FILES_PER_DIR; file++) {
+        bytes += file_size(file);
+    }
+    assert(stats.is_bytes == bytes);
+    assert(stats.is_total_seconds >= stats.is_walk_seconds);
+    assert(stats.is_files_per_second > 0);
+    check_tree(0);
+    assert(tfs_open("/data/link", 0) == -1);
+
+    // again, with other contents and a trailing slash
+    make_tree(root, 1);
+    snprintf(path, sizeof(path), "%s/", root);
+    assert(tfs_import_tree(path, "/data", 1, &stats) == 0);
+    assert(stats.is_files == DIRS * FILES_PER_DIR);
+    assert(stats.is_dirs == 0);
+    check_tree(1);
+
+    // a file where a directory goes fails, and leaves no handle open (the
+    // handle closed last is the one handed out next)
+    assert(tfs_mkdir("/clash") != -1);
+    int fh = tfs_open("/clash/sub", TFS_O_CREAT);
+    assert(fh != -1 && tfs_close(fh) != -1);
+    errno = 0;
+    assert(tfs_import_tree(root, "/clash", THREADS, &stats) == -1);
+    assert(stats.is_failed > 0);
+    assert(errno == EEXIST);
+    assert(tfs_open("/clash/sub", 0) == fh);
+    assert(tfs_close(fh) != -1);
+
+    errno = 0;
+    assert(tfs_import_tree("/tmp/tfs_import_missing", "/data", THREADS,
+                           NULL) == -1);
+    assert(errno == ENOENT);
+    errno = 0;
+    assert(tfs_import_tree(root, "data", THREADS, NULL) == -1);
+    assert(errno == EINVAL);
+    errno = 0;
+    assert(tfs_import_tree(root, "/data", 0, NULL) == -1);
+    assert(errno == EINVAL);
+
+    assert(tfs_destroy() != -1);
+    remove_tree(root);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * This test checks the report of the lock profiler at tfs_destroy: threads
+ * writing and reading one file (so that its inode lock is contended), and
+ * creating and removing files of their own, get a report of every class of
+ * locks, and of the hottest inodes, when built with TFS_LOCK_PROFILE (make
+ * LOCK_PROFILE=yes); otherwise, nothing is reported.
+ * */
+
+#define THREADS 4
+#define ROUNDS 200
+
+static void *worker(void *arg) {
+    size_t t = (size_t)arg;
+    int fh = tfs_open("/shared", 0);
+    assert(fh != -1);
+    char path[16];
+    sprintf(path, "/t%zu", t);
+    char buffer[256];
+    memset(buffer, (int)t, sizeof(buffer));
+    for (int r = 0; r < ROUNDS; r++) {
+        assert(tfs_pwrite(fh, buffer, sizeof(buffer), 0) == sizeof(buffer));
+        assert(tfs_pread(fh, buffer, sizeof(buffer), 0) == sizeof(buffer));
+        int own = tfs_open(path, TFS_O_CREAT);
+        assert(own != -1);
+        assert(tfs_write(own, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(tfs_close(own) != -1);
+        assert(tfs_unlink(path) != -1);
+    }
+    assert(tfs_close(fh) != -1);
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+    int fh = tfs_open("/shared", TFS_O_CREAT);
+    assert(fh != -1 && tfs_close(fh) != -1);
+    pthread_t tid[THREADS];
+    for (size_t t = 0; t < THREADS; t++) {
+        assert(pthread_create(&tid[t], NULL, worker, (void *)t) == 0);
+    }
+    for (size_t t = 0; t < THREADS; t++) {
+        assert(pthread_join(tid[t], NULL) == 0);
+    }
+
+    // the report goes to stderr: catch it in a file
+    char report_path[] = "/tmp/tfs_lock_profile_XXXXXX";
+    int fd = mkstemp(report_path);
+    assert(fd != -1);
+    fflush(stderr);
+    int saved_stderr = dup(STDERR_FILENO);
+    assert(saved_stderr != -1 && dup2(fd, STDERR_FILENO) != -1);
+    assert(tfs_destroy() != -1);
+    fflush(stderr);
+    assert(dup2(saved_stderr, STDERR_FILENO) != -1);
+    close(saved_stderr);
+
+    static char report[64 * 1024];
+    ssize_t len = pread(fd, report, sizeof(report) - 1, 0);
+    assert(len >= 0);
+    report[len] = '\0';
+    close(fd);
+    unlink(report_path);
+
+#ifdef TFS_LOCK_PROFILE
+    assert(strstr(report, "Lock contention, by lock class:") != NULL);
+    assert(strstr(report, "  inode ") != NULL);
+    assert(strstr(report, "  data_blocks ") != NULL);
+    assert(strstr(report, "  dcache_shard ") != NULL);
+#else
+    assert(len == 0);
+#endif
+
+    printf("Successful test.\n");
+
+    return 0;
+}
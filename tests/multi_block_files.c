@@ -0,0 +1,87 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * This test writes files spanning many data blocks. Two files are grown in
+ * alternating chunks, so their blocks interleave and each of them ends up with
+ * more extents than fit in the inode (exercising the overflow extent block).
+ * Afterwards, both files are unlinked and a single file filling the whole FS
+ * is written, checking that every run was freed.
+ * */
+
+#define BLOCK_SIZE 1024
+#define CHUNK (BLOCK_SIZE + 100)
+#define CHUNKS 40
+
+char const path_a[] = "/a";
+char const path_b[] = "/b";
+char const path_big[] = "/big";
+
+static uint8_t pattern(char const *path, size_t i) {
+    return (uint8_t)((size_t)path[1] + i * 7);
+}
+
+static void write_chunk(int f, char const *path, size_t chunk) {
+    uint8_t buffer[CHUNK];
+    for (size_t i = 0; i < CHUNK; i++) {
+        buffer[i] = pattern(path, chunk * CHUNK + i);
+    }
+    assert(tfs_write(f, buffer, CHUNK) == CHUNK);
+}
+
+static void assert_contents_ok(char const *path) {
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+
+    static uint8_t buffer[CHUNK * CHUNKS + 1];
+    assert(tfs_read(f, buffer, sizeof(buffer)) == CHUNK * CHUNKS);
+    for (size_t i = 0; i < CHUNK * CHUNKS; i++) {
+        assert(buffer[i] == pattern(path, i));
+    }
+
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 128;
+    assert(tfs_init(&params) != -1);
+
+    int fa = tfs_open(path_a, TFS_O_CREAT);
+    int fb = tfs_open(path_b, TFS_O_CREAT);
+    assert(fa != -1 && fb != -1);
+
+    for (size_t c = 0; c < CHUNKS; c++) {
+        write_chunk(fa, path_a, c);
+        write_chunk(fb, path_b, c);
+    }
+
+    assert(tfs_close(fa) != -1);
+    assert(tfs_close(fb) != -1);
+
+    assert_contents_ok(path_a);
+    assert_contents_ok(path_b);
+
+    assert(tfs_unlink(path_a) != -1);
+    assert(tfs_unlink(path_b) != -1);
+
+    // every block but the root directory's must be free again
+    int f = tfs_open(path_big, TFS_O_CREAT);
+    assert(f != -1);
+    uint8_t block[BLOCK_SIZE];
+    memset(block, 'x', sizeof(block));
+    for (size_t i = 0; i < params.max_block_count - 1; i++) {
+        assert(tfs_write(f, block, sizeof(block)) == sizeof(block));
+    }
+    assert(tfs_write(f, block, sizeof(block)) == -1); // FS is full
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
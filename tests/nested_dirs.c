@@ -0,0 +1,80 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * This test checks nested directories: files are created and read through
+ * several levels of directories, non-empty directories cannot be removed, and
+ * names that were looked up (and so cached) stop resolving once they are
+ * unlinked or their directory is removed.
+ * */
+
+char const file_contents[] = "nested contents";
+
+static void write_file(char const *path) {
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, file_contents, sizeof(file_contents)) ==
+           sizeof(file_contents));
+    assert(tfs_close(f) != -1);
+}
+
+static void assert_contents_ok(char const *path) {
+    char buffer[sizeof(file_contents)];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, file_contents, sizeof(buffer)) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    assert(tfs_mkdir("/a") != -1);
+    assert(tfs_mkdir("/a/b") != -1);
+    assert(tfs_mkdir("/a") == -1 && errno == EEXIST);
+    assert(tfs_mkdir("/x/y") == -1 && errno == ENOENT);
+    assert(tfs_mkdir("a") == -1 && errno == EINVAL);
+    assert(tfs_open("/a", 0) == -1);       // directories cannot be opened
+    assert(tfs_open("/a/f", 0) == -1);     // does not exist yet
+
+    write_file("/a/b/f");
+    write_file("/a/f");
+    assert_contents_ok("/a/b/f");
+    assert_contents_ok("/a/f");
+    assert(tfs_open("/a/b/f/g", TFS_O_CREAT) == -1); // f is not a directory
+    assert(tfs_mkdir("/a/b/f/g") == -1 && errno == ENOTDIR);
+
+    // links across directories
+    assert(tfs_link("/a/b/f", "/g") != -1);
+    assert(tfs_sym_link("/a/f", "/a/b/s") != -1);
+    assert_contents_ok("/g");
+    assert_contents_ok("/a/b/s");
+    // no links to directories (not even inside them)
+    assert(tfs_sym_link("/a/b", "/a/b/d") == -1);
+    assert(tfs_sym_link("/a", "/l") == -1);
+    assert(tfs_link("/a/b", "/a/b/d") == -1);
+
+    assert(tfs_rmdir("/a/b") == -1); // not empty
+    assert(tfs_unlink("/a/b") == -1); // directories need tfs_rmdir
+    assert(tfs_unlink("/a/b/f") != -1);
+    assert(tfs_open("/a/b/f", 0) == -1);
+    assert_contents_ok("/g");
+    assert(tfs_unlink("/a/b/s") != -1);
+    assert(tfs_rmdir("/a/b") != -1);
+    assert(tfs_open("/a/b/f", 0) == -1);
+    assert(tfs_rmdir("/a/b") == -1);
+
+    // the name can be reused for a file
+    write_file("/a/b");
+    assert_contents_ok("/a/b");
+
+    printf("Successful test.\n");
+
+    assert(tfs_destroy() != -1);
+
+    return 0;
+}
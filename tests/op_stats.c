@@ -0,0 +1,119 @@
+#include "fs/config.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * This test checks the operation statistics of tfs_stats:
+ *   - nothing is counted unless collect_stats is set;
+ *   - the opens, writes and reads of threads (which exit before the
+ *     statistics are read) are all counted, and so are the state primitives
+ *     and block accesses under them;
+ *   - the histograms add up to the counts, and their percentiles are in
+ *     order, and within the maximum;
+ *   - tfs_init starts over from zero.
+ * */
+
+#define THREADS 4
+#define ROUNDS 50
+
+static void *worker(void *arg) {
+    size_t t = (size_t)arg;
+    char path[16];
+    sprintf(path, "/f%zu", t);
+    char buffer[64];
+    memset(buffer, (int)t, sizeof(buffer));
+    for (int r = 0; r < ROUNDS; r++) {
+        int fh = tfs_open(path, TFS_O_CREAT);
+        assert(fh != -1);
+        assert(tfs_write(fh, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(tfs_close(fh) != -1);
+        fh = tfs_open(path, 0);
+        assert(fh != -1);
+        assert(tfs_read(fh, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(tfs_close(fh) != -1);
+    }
+    return NULL;
+}
+
+static void run_threads(void) {
+    pthread_t tid[THREADS];
+    for (size_t t = 0; t < THREADS; t++) {
+        assert(pthread_create(&tid[t], NULL, worker, (void *)t) == 0);
+    }
+    for (size_t t = 0; t < THREADS; t++) {
+        assert(pthread_join(tid[t], NULL) == 0);
+    }
+}
+
+static void check_histogram(tfs_op_stats_t const *op) {
+    uint64_t sum = 0;
+    for (size_t b = 0; b < STATS_HIST_BUCKETS; b++) {
+        sum += op->os_buckets[b];
+        if (b > 0) {
+            assert(tfs_stats_bucket_ns(b) > tfs_stats_bucket_ns(b - 1));
+        }
+    }
+    assert(sum == op->os_count);
+    uint64_t p50 = tfs_stats_percentile(op, 0.5);
+    uint64_t p99 = tfs_stats_percentile(op, 0.99);
+    uint64_t p999 = tfs_stats_percentile(op, 0.999);
+    assert(p50 <= p99 && p99 <= p999 && p999 <= op->os_max_ns);
+    assert(op->os_total_ns <= op->os_count * op->os_max_ns);
+}
+
+int main() {
+    static tfs_stats_t stats;
+
+    tfs_params params = tfs_default_params();
+    assert(tfs_init(&params) != -1);
+    run_threads();
+    tfs_stats(&stats);
+    for (tfs_op_t op = 0; op < TFS_OP_COUNT; op++) {
+        assert(stats.st_ops[op].os_count == 0);
+    }
+    assert(tfs_destroy() != -1);
+
+    params.collect_stats = true;
+    assert(tfs_init(&params) != -1);
+    run_threads();
+    tfs_stats(&stats);
+    assert(stats.st_ops[TFS_OP_OPEN].os_count == 2 * THREADS * ROUNDS);
+    assert(stats.st_ops[TFS_OP_CLOSE].os_count == 2 * THREADS * ROUNDS);
+    assert(stats.st_ops[TFS_OP_WRITE].os_count == THREADS * ROUNDS);
+    assert(stats.st_ops[TFS_OP_READ].os_count == THREADS * ROUNDS);
+    assert(stats.st_ops[TFS_OP_UNLINK].os_count == 0);
+    // the files, and the root directory (by tfs_init)
+    assert(stats.st_ops[TFS_OP_INODE_CREATE].os_count == THREADS + 1);
+    assert(stats.st_ops[TFS_OP_ADD_DIR_ENTRY].os_count == THREADS);
+    assert(stats.st_ops[TFS_OP_INODE_GET].os_count > 0);
+    assert(stats.st_ops[TFS_OP_DATA_BLOCK_ALLOC].os_count > 0);
+    assert(stats.st_ops[TFS_OP_BLOCK_ACCESS].os_count >
+           stats.st_ops[TFS_OP_INODE_GET].os_count);
+    for (tfs_op_t op = 0; op < TFS_OP_COUNT; op++) {
+        assert(tfs_op_name(op) != NULL);
+        check_histogram(&stats.st_ops[op]);
+    }
+    assert(strcmp(tfs_op_name(TFS_OP_INODE_GET), "inode_get") == 0);
+    assert(tfs_op_name(TFS_OP_COUNT) == NULL);
+
+    // the calling thread counts too, and the statistics outlive tfs_destroy
+    assert(tfs_unlink("/f0") != -1);
+    assert(tfs_destroy() != -1);
+    tfs_stats(&stats);
+    assert(stats.st_ops[TFS_OP_UNLINK].os_count == 1);
+    assert(stats.st_ops[TFS_OP_INODE_DELETE].os_count == 1);
+
+    assert(tfs_init(&params) != -1);
+    tfs_stats(&stats);
+    assert(stats.st_ops[TFS_OP_OPEN].os_count == 0);
+    assert(stats.st_ops[TFS_OP_UNLINK].os_count == 0);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * This test backs the FS with an image file: a tree of directories, files,
+ * hard links and symbolic links is created, the FS is destroyed, and a new
+ * instance reusing the image must see all of it (and keep working). Images
+ * with another geometry, or that are not images at all, are rejected.
+ * */
+
+char const contents[] = "this survives a restart";
+
+static void assert_contents_ok(char const *path) {
+    char buffer[sizeof(contents)];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, contents, sizeof(buffer)) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    char image_path[] = "/tmp/tfs_image_XXXXXX";
+    int fd = mkstemp(image_path); // an empty file is formatted
+    assert(fd != -1);
+    close(fd);
+
+    tfs_params params = tfs_default_params();
+    params.image_path = image_path;
+    assert(tfs_init(&params) != -1);
+
+    assert(tfs_mkdir("/dir") != -1);
+    int f = tfs_open("/dir/file", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(f) != -1);
+    assert(tfs_link("/dir/file", "/hard") != -1);
+    {
+        // the symlink must not depend on the memory of the caller's path
+        char target[] = "/dir/file";
+        assert(tfs_sym_link(target, "/soft") != -1);
+        memset(target, 0, sizeof(target));
+    }
+    assert(tfs_sync() != -1);
+    assert(tfs_destroy() != -1);
+
+    // another geometry is rejected
+    tfs_params other = params;
+    other.max_block_count *= 2;
+    assert(tfs_init(&other) == -1);
+
+    assert(tfs_init(&params) != -1);
+    assert_contents_ok("/dir/file");
+    assert_contents_ok("/hard");
+    assert_contents_ok("/soft");
+    assert(tfs_mkdir("/dir") == -1);
+
+    // the allocators resume from the image
+    assert(tfs_unlink("/hard") != -1);
+    assert(tfs_unlink("/dir/file") != -1);
+    assert(tfs_open("/soft", 0) == -1);
+    f = tfs_open("/dir/new", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init(&params) != -1);
+    assert_contents_ok("/dir/new");
+    assert(tfs_open("/dir/file", 0) == -1);
+    assert(tfs_destroy() != -1);
+
+    // a file that is not an image is rejected
+    FILE *garbage = fopen(image_path, "w");
+    assert(garbage != NULL);
+    fputs("not an image", garbage);
+    fclose(garbage);
+    assert(tfs_init(&params) == -1);
+
+    unlink(image_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,51 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * This test checks that a write that does not fit gives back the blocks it
+ * grew the file for: a pwrite past the free space fails, and leaves the file
+ * as it was and the free space to the other files, again and again.
+ * */
+
+#define BLOCK_SIZE 512
+#define BLOCK_COUNT 64
+#define FILE_BLOCKS 40
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = BLOCK_COUNT;
+    assert(tfs_init(&params) != -1);
+
+    uint8_t buffer[BLOCK_SIZE];
+    memset(buffer, 'a', sizeof(buffer));
+    int fh = tfs_open("/a", TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_write(fh, buffer, sizeof(buffer)) == sizeof(buffer));
+
+    for (int round = 0; round < 3; round++) {
+        // most of the free space would have to be grown for it
+        assert(tfs_pwrite(fh, buffer, sizeof(buffer),
+                          (BLOCK_COUNT + 1) * BLOCK_SIZE) == -1);
+
+        int other = tfs_open("/b", TFS_O_CREAT | TFS_O_TRUNC);
+        assert(other != -1);
+        for (int b = 0; b < FILE_BLOCKS; b++) {
+            assert(tfs_write(other, buffer, sizeof(buffer)) == sizeof(buffer));
+        }
+        assert(tfs_close(other) != -1);
+    }
+
+    uint8_t read_back[BLOCK_SIZE * 2];
+    assert(tfs_pread(fh, read_back, sizeof(read_back), 0) == BLOCK_SIZE);
+    assert(memcmp(read_back, buffer, BLOCK_SIZE) == 0);
+    assert(tfs_close(fh) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
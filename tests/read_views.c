@@ -0,0 +1,85 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * This test leases read-only views of a file made of several runs of blocks,
+ * checking that the runs cover exactly the requested range (clipped at the end
+ * of the file) with the file's contents, and that views can be held by
+ * several readers at once.
+ * */
+
+#define BLOCK_SIZE 1024
+#define CHUNK 1500
+#define CHUNKS 6
+
+char const path_a[] = "/a";
+char const path_b[] = "/b";
+
+static char pattern(size_t i) { return (char)('A' + i % 23); }
+
+static void check_view(tfs_view_t const *view, size_t offset, size_t len) {
+    assert(view->v_len == len);
+    size_t covered = 0;
+    for (int i = 0; i < view->v_run_count; i++) {
+        char const *run = view->v_runs[i].vr_base;
+        for (size_t j = 0; j < view->v_runs[i].vr_len; j++) {
+            assert(run[j] == pattern(offset + covered + j));
+        }
+        covered += view->v_runs[i].vr_len;
+    }
+    assert(covered == len);
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    // interleave the two files, so that each is made of several runs
+    int fa = tfs_open(path_a, TFS_O_CREAT);
+    int fb = tfs_open(path_b, TFS_O_CREAT);
+    assert(fa != -1 && fb != -1);
+    char buffer[CHUNK];
+    for (size_t c = 0; c < CHUNKS; c++) {
+        for (size_t i = 0; i < CHUNK; i++) {
+            buffer[i] = pattern(c * CHUNK + i);
+        }
+        assert(tfs_write(fa, buffer, CHUNK) == CHUNK);
+        assert(tfs_write(fb, buffer, CHUNK) == CHUNK);
+    }
+
+    tfs_view_t view;
+    assert(tfs_read_view(fa, 0, CHUNK * CHUNKS, &view) == CHUNK * CHUNKS);
+    assert(view.v_run_count > 1);
+    check_view(&view, 0, CHUNK * CHUNKS);
+
+    // a second reader (of a view crossing runs, clipped at the end of the
+    // file) while the first view is held
+    size_t offset = BLOCK_SIZE + 10;
+    size_t len = CHUNK * CHUNKS - offset;
+    tfs_view_t other;
+    assert(tfs_read_view(fa, offset, len + 100, &other) == (ssize_t)len);
+    check_view(&other, offset, len);
+    char c;
+    assert(tfs_pread(fa, &c, 1, 0) == 1);
+    tfs_release_view(&other);
+    tfs_release_view(&view);
+    assert(view.v_runs == NULL && view.v_run_count == 0);
+
+    // empty views hold nothing
+    assert(tfs_read_view(fb, CHUNK * CHUNKS, 10, &view) == 0);
+    tfs_release_view(&view);
+    assert(tfs_read_view(-1, 0, 10, &view) == -1);
+    tfs_release_view(&view);
+
+    // the file can be written again once the views are released
+    assert(tfs_write(fa, buffer, 1) == 1);
+
+    assert(tfs_close(fa) != -1);
+    assert(tfs_close(fb) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,178 @@
+#include "fs/config.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * This test checks the readahead of sequential reads, on the file backend
+ * behind a latency model (so that the buffer cache is used):
+ *   - small reads going through a file in order find their blocks read ahead;
+ *   - reads out of order (strided preads) reset the window, and read nothing
+ *     ahead;
+ *   - a window of 0 disables it;
+ *   - threads reading their own files in order through a cache smaller than
+ *     the files see their own data.
+ * */
+
+#define BLOCK_SIZE 512
+#define FILE_BLOCKS 192
+#define CHUNK 100
+#define STRIDE 8
+#define THREADS 4
+#define THREAD_BLOCKS 96
+
+static uint8_t pattern(size_t file, size_t i) {
+    return (uint8_t)(file * 29 + i * 7 + i / 487);
+}
+
+static void write_file(char const *path, size_t file, size_t size) {
+    int fh = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(fh != -1);
+    uint8_t buffer[4 * BLOCK_SIZE];
+    for (size_t pos = 0; pos < size;) {
+        size_t n = sizeof(buffer);
+        if (n > size - pos) {
+            n = size - pos;
+        }
+        for (size_t i = 0; i < n; i++) {
+            buffer[i] = pattern(file, pos + i);
+        }
+        assert(tfs_write(fh, buffer, n) == (ssize_t)n);
+        pos += n;
+    }
+    assert(tfs_close(fh) != -1);
+}
+
+static void read_in_order(char const *path, size_t file, size_t size) {
+    int fh = tfs_open(path, 0);
+    assert(fh != -1);
+    uint8_t buffer[CHUNK];
+    for (size_t pos = 0; pos < size;) {
+        ssize_t r = tfs_read(fh, buffer, sizeof(buffer));
+        assert(r > 0);
+        for (size_t i = 0; i < (size_t)r; i++) {
+            assert(buffer[i] == pattern(file, pos + i));
+        }
+        pos += (size_t)r;
+    }
+    assert(tfs_read(fh, buffer, sizeof(buffer)) == 0);
+    assert(tfs_close(fh) != -1);
+}
+
+// the blocks read into the cache for the data of /f (the directory is read
+// beforehand)
+static void data_stats(tfs_cache_stats_t *stats,
+                       tfs_cache_stats_t const *before) {
+    tfs_cache_stats(stats);
+    stats->cs_misses -= before->cs_misses;
+    stats->cs_readahead -= before->cs_readahead;
+}
+
+static void *worker(void *arg) {
+    size_t t = (size_t)arg;
+    char path[16];
+    sprintf(path, "/t%zu", t);
+    for (int round = 0; round < 3; round++) {
+        read_in_order(path, 10 + t, THREAD_BLOCKS * BLOCK_SIZE - t);
+    }
+    return NULL;
+}
+
+static tfs_params test_params(char const *image_path) {
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = 1024;
+    params.image_path = image_path;
+    params.backend = TFS_BACKEND_FILE;
+    params.device_latency_ns = 100000;
+    params.cache_size = 256 * BLOCK_SIZE;
+    params.readahead_window = 64;
+    return params;
+}
+
+int main() {
+    char image_path[] = "/tmp/tfs_readahead_XXXXXX";
+    int fd = mkstemp(image_path);
+    assert(fd != -1);
+    close(fd);
+
+    tfs_params params = test_params(image_path);
+    assert(tfs_init(&params) != -1);
+    write_file("/f", 1, FILE_BLOCKS * BLOCK_SIZE);
+    for (size_t t = 0; t < THREADS; t++) {
+        char path[16];
+        sprintf(path, "/t%zu", t);
+        write_file(path, 10 + t, THREAD_BLOCKS * BLOCK_SIZE - t);
+    }
+    assert(tfs_destroy() != -1);
+
+    // in order: only the first block is missing when read
+    tfs_cache_stats_t before, stats;
+    assert(tfs_init(&params) != -1);
+    int fh = tfs_open("/f", 0);
+    assert(fh != -1);
+    tfs_cache_stats(&before);
+    read_in_order("/f", 1, FILE_BLOCKS * BLOCK_SIZE);
+    data_stats(&stats, &before);
+    assert(stats.cs_readahead == FILE_BLOCKS - 1);
+    assert(stats.cs_misses == 1);
+    assert(tfs_close(fh) != -1);
+    assert(tfs_destroy() != -1);
+
+    // out of order: the first read looks sequential, none of the others do
+    assert(tfs_init(&params) != -1);
+    fh = tfs_open("/f", 0);
+    assert(fh != -1);
+    tfs_cache_stats(&before);
+    for (size_t block = 0; block < FILE_BLOCKS; block += STRIDE) {
+        uint8_t buffer[CHUNK];
+        size_t offset = block * BLOCK_SIZE;
+        assert(tfs_pread(fh, buffer, sizeof(buffer), offset) == CHUNK);
+        for (size_t i = 0; i < CHUNK; i++) {
+            assert(buffer[i] == pattern(1, offset + i));
+        }
+    }
+    data_stats(&stats, &before);
+    assert(tfs_close(fh) != -1);
+    assert(stats.cs_readahead == READAHEAD_MIN_BLOCKS);
+    assert(stats.cs_misses == FILE_BLOCKS / STRIDE);
+    assert(tfs_destroy() != -1);
+
+    // disabled
+    params.readahead_window = 0;
+    assert(tfs_init(&params) != -1);
+    fh = tfs_open("/f", 0);
+    assert(fh != -1);
+    tfs_cache_stats(&before);
+    read_in_order("/f", 1, FILE_BLOCKS * BLOCK_SIZE);
+    data_stats(&stats, &before);
+    assert(tfs_close(fh) != -1);
+    assert(stats.cs_readahead == 0);
+    assert(stats.cs_misses == FILE_BLOCKS);
+    assert(tfs_destroy() != -1);
+
+    // a cache smaller than what the threads read
+    params = test_params(image_path);
+    params.cache_size = 64 * BLOCK_SIZE;
+    assert(tfs_init(&params) != -1);
+    pthread_t tid[THREADS];
+    for (size_t t = 0; t < THREADS; t++) {
+        assert(pthread_create(&tid[t], NULL, worker, (void *)t) == 0);
+    }
+    for (size_t t = 0; t < THREADS; t++) {
+        assert(pthread_join(tid[t], NULL) == 0);
+    }
+    tfs_cache_stats(&stats);
+    assert(stats.cs_readahead > 0);
+    assert(tfs_destroy() != -1);
+    unlink(image_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
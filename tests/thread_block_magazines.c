@@ -0,0 +1,77 @@
+#include "fs/operations.h"
+#include "fs/state.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+
+/*
+ * This program creates NUM_THREADS threads that concurrently allocate every
+ * data block in the file system (through their per-thread magazines, stealing
+ * from each other at the end) and then free them. The blocks left in the
+ * magazines of the threads must be given back when the threads exit.
+ * */
+
+#define NUM_THREADS 4
+#define BLOCKS 300
+
+static int allocated[NUM_THREADS];
+static pthread_barrier_t barrier;
+
+void *thread_alloc_fn(void *arg) {
+    int id = *(int *)arg;
+    static int blocks[NUM_THREADS][BLOCKS];
+    int n = 0;
+
+    int b;
+    while ((b = data_block_alloc()) != -1) {
+        assert(n < BLOCKS);
+        blocks[id][n++] = b;
+    }
+    allocated[id] = n;
+
+    // nothing may be freed before every thread ran out of blocks
+    pthread_barrier_wait(&barrier);
+    for (int i = 0; i < n; i++) {
+        data_block_free(blocks[id][i]);
+    }
+    return NULL;
+}
+
+int main() {
+    pthread_t tid[NUM_THREADS];
+    int ids[NUM_THREADS];
+
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCKS;
+    assert(tfs_init(&params) != -1);
+    pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tid[i], NULL, thread_alloc_fn, &ids[i]) == 0);
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(tid[i], NULL);
+    }
+
+    // every block but the root directory's was handed out exactly once
+    int total = 0;
+    for (int i = 0; i < NUM_THREADS; i++) {
+        total += allocated[i];
+    }
+    assert(total == BLOCKS - 1);
+
+    // and all of them are free again
+    for (int i = 0; i < BLOCKS - 1; i++) {
+        assert(data_block_alloc() != -1);
+    }
+    assert(data_block_alloc() == -1);
+
+    pthread_barrier_destroy(&barrier);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,69 @@
+#include "fs/operations.h"
+#include "fs/state.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+/*
+ * This program creates NUM_THREADS threads that concurrently create and delete
+ * inodes. No inode may be handed out to two threads at once, and every inode
+ * must be free again at the end.
+ * */
+
+#define NUM_THREADS 4
+#define NUM_OPERATIONS 2000
+#define INODES 16
+#define HELD 3
+
+static atomic_bool in_use[INODES];
+
+void *thread_inode_fn(void *arg) {
+    (void)arg; // ignore unused parameters
+
+    for (int i = 0; i < NUM_OPERATIONS; i++) {
+        int held[HELD];
+        int n = 0;
+        for (; n < HELD; n++) {
+            held[n] = inode_create(T_FILE);
+            if (held[n] == -1) {
+                break; // other threads hold the remaining inodes
+            }
+            assert(!atomic_exchange(&in_use[held[n]], true));
+        }
+
+        while (n > 0) {
+            n--;
+            assert(atomic_exchange(&in_use[held[n]], false));
+            inode_delete(held[n]);
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    pthread_t tid[NUM_THREADS];
+
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = INODES;
+    assert(tfs_init(&params) != -1); // the root directory takes inode 0
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        assert(pthread_create(&tid[i], NULL, thread_inode_fn, NULL) == 0);
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(tid[i], NULL);
+    }
+
+    for (int i = 1; i < INODES; i++) {
+        assert(inode_create(T_FILE) != -1);
+    }
+    assert(inode_create(T_FILE) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
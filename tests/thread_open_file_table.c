@@ -0,0 +1,85 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * This program creates NUM_THREADS threads that concurrently open and close
+ * the same file, each of them holding many more handles than the initial size
+ * of the open file table. No handle may be handed out twice at once, and every
+ * open handle must keep its own offset.
+ * */
+
+#define NUM_THREADS 4
+#define ROUNDS 50
+#define HELD 40
+#define MAX_HANDLES 4096
+
+char const path[] = "/f";
+char const contents[] = "0123456789";
+
+static atomic_bool in_use[MAX_HANDLES];
+
+void *thread_open_fn(void *arg) {
+    (void)arg; // ignore unused parameters
+
+    for (int r = 0; r < ROUNDS; r++) {
+        int held[HELD];
+        for (int i = 0; i < HELD; i++) {
+            held[i] = tfs_open(path, 0);
+            assert(held[i] != -1 && held[i] < MAX_HANDLES);
+            assert(!atomic_exchange(&in_use[held[i]], true));
+
+            // advance each handle by a different amount
+            char buffer[sizeof(contents)];
+            size_t len = (size_t)i % sizeof(contents);
+            assert(tfs_read(held[i], buffer, len) == (ssize_t)len);
+        }
+
+        for (int i = 0; i < HELD; i++) {
+            char c;
+            size_t pos = (size_t)i % sizeof(contents);
+            if (pos < sizeof(contents) - 1) {
+                assert(tfs_read(held[i], &c, 1) == 1);
+                assert(c == contents[pos]);
+            }
+            assert(atomic_exchange(&in_use[held[i]], false));
+            assert(tfs_close(held[i]) != -1);
+            assert(tfs_close(held[i]) == -1);
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    pthread_t tid[NUM_THREADS];
+
+    tfs_params params = tfs_default_params();
+    params.max_open_files_count = 4;
+    assert(tfs_init(&params) != -1);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, sizeof(contents) - 1) ==
+           sizeof(contents) - 1);
+    assert(tfs_close(f) != -1);
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        assert(pthread_create(&tid[i], NULL, thread_open_fn, NULL) == 0);
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(tid[i], NULL);
+    }
+
+    assert(tfs_close(MAX_HANDLES * 1024) == -1);
+    assert(tfs_close(-1) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * This program writes a file with tfs_pwrite, at offsets out of order and with
+ * a gap, and then has NUM_THREADS threads read it at random offsets through a
+ * single shared handle with tfs_pread. The offset of the handle must not move.
+ * */
+
+#define NUM_THREADS 4
+#define NUM_READS 2000
+#define CHUNK 300
+#define CHUNKS 20
+#define GAP_CHUNK 7 // this chunk is never written, and must read as zeros
+#define FILE_SIZE (CHUNK * CHUNKS)
+
+char const path[] = "/f";
+
+static int fhandle;
+
+static uint8_t expected(size_t pos) {
+    if (pos / CHUNK == GAP_CHUNK) {
+        return 0;
+    }
+    return (uint8_t)(pos % 251 + 1);
+}
+
+void *thread_pread_fn(void *arg) {
+    unsigned seed = (unsigned)(uintptr_t)arg;
+
+    for (int i = 0; i < NUM_READS; i++) {
+        size_t offset = (size_t)rand_r(&seed) % (FILE_SIZE + 10);
+        size_t len = (size_t)rand_r(&seed) % (2 * CHUNK);
+        uint8_t buffer[2 * CHUNK];
+
+        ssize_t r = tfs_pread(fhandle, buffer, len, offset);
+        size_t want = offset >= FILE_SIZE ? 0 : FILE_SIZE - offset;
+        if (want > len) {
+            want = len;
+        }
+        assert(r == (ssize_t)want);
+        for (size_t j = 0; j < want; j++) {
+            assert(buffer[j] == expected(offset + j));
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    pthread_t tid[NUM_THREADS];
+
+    assert(tfs_init(NULL) != -1);
+
+    fhandle = tfs_open(path, TFS_O_CREAT);
+    assert(fhandle != -1);
+
+    // back to front, so every write but the first one lands inside the file
+    for (size_t c = CHUNKS; c-- > 0;) {
+        if (c == GAP_CHUNK) {
+            continue;
+        }
+        uint8_t buffer[CHUNK];
+        for (size_t j = 0; j < CHUNK; j++) {
+            buffer[j] = expected(c * CHUNK + j);
+        }
+        assert(tfs_pwrite(fhandle, buffer, CHUNK, c * CHUNK) == CHUNK);
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        assert(pthread_create(&tid[i], NULL, thread_pread_fn,
+                              (void *)(uintptr_t)(i + 1)) == 0);
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(tid[i], NULL);
+    }
+
+    // the handle offset is still at the start
+    uint8_t c;
+    assert(tfs_read(fhandle, &c, 1) == 1);
+    assert(c == expected(0));
+
+    assert(tfs_close(fhandle) != -1);
+    assert(tfs_pread(fhandle, &c, 1, 0) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,137 @@
+#include "fs/operations.h"
+#include "fs/state.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * This test checks the traces of tfs_trace_dump:
+ *   - nothing is traced unless trace_events is set;
+ *   - the operations of threads (which exit before the dump), the state
+ *     primitives and storage accesses under them, and a wait for a lock held
+ *     by another thread, are all in the trace, with the inodes they are about;
+ *   - a thread keeps its latest trace_events events, and counts the others as
+ *     dropped.
+ * */
+
+#define THREADS 4
+#define ROUNDS 20
+#define TRACE_EVENTS 64
+#define LOCK_HOLD_MS 100
+
+static char trace[4 * 1024 * 1024];
+
+static void dump(void) {
+    char path[] = "/tmp/tfs_trace_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    assert(tfs_trace_dump(path) != -1);
+    ssize_t len = pread(fd, trace, sizeof(trace) - 1, 0);
+    assert(len > 0 && (size_t)len < sizeof(trace) - 1);
+    trace[len] = '\0';
+    close(fd);
+    unlink(path);
+    assert(strncmp(trace, "{\"traceEvents\":[", 16) == 0);
+    assert(strstr(trace, "\"displayTimeUnit\":\"ns\"") != NULL);
+}
+
+static size_t count(char const *needle) {
+    size_t n = 0;
+    for (char const *at = strstr(trace, needle); at != NULL;
+         at = strstr(at + 1, needle)) {
+        n++;
+    }
+    return n;
+}
+
+static void *worker(void *arg) {
+    size_t t = (size_t)arg;
+    char path[16];
+    sprintf(path, "/f%zu", t);
+    char buffer[64];
+    memset(buffer, (int)t, sizeof(buffer));
+    for (int r = 0; r < ROUNDS; r++) {
+        int fh = tfs_open(path, TFS_O_CREAT);
+        assert(fh != -1);
+        assert(tfs_write(fh, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(tfs_close(fh) != -1);
+    }
+    return NULL;
+}
+
+static void *creator(void *arg) {
+    (void)arg;
+    int fh = tfs_open("/waited", TFS_O_CREAT); // waits for the root's lock
+    assert(fh != -1);
+    assert(tfs_close(fh) != -1);
+    return NULL;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    assert(tfs_init(&params) != -1);
+    assert(tfs_open("/f", TFS_O_CREAT) != -1);
+    dump();
+    assert(count("\"ph\":\"X\"") == 0);
+    assert(strstr(trace, "\"dropped_events\":0") != NULL);
+    assert(tfs_destroy() != -1);
+
+    params.trace_events = TRACE_EVENTS;
+    assert(tfs_init(&params) != -1);
+    pthread_t tid[THREADS];
+    for (size_t t = 0; t < THREADS; t++) {
+        assert(pthread_create(&tid[t], NULL, worker, (void *)t) == 0);
+    }
+    for (size_t t = 0; t < THREADS; t++) {
+        assert(pthread_join(tid[t], NULL) == 0);
+    }
+
+    // hold the root directory's lock while another thread creates a file
+    inode_t *root = inode_get(ROOT_DIR_INUM);
+    tfs_rwlock_wrlock(&root->rwlock);
+    pthread_t waiter;
+    assert(pthread_create(&waiter, NULL, creator, NULL) == 0);
+    struct timespec hold = {.tv_sec = 0,
+                            .tv_nsec = LOCK_HOLD_MS * 1000 * 1000};
+    nanosleep(&hold, NULL);
+    tfs_rwlock_unlock(&root->rwlock);
+    assert(pthread_join(waiter, NULL) == 0);
+
+    // the trace outlives tfs_destroy
+    assert(tfs_destroy() != -1);
+    dump();
+
+    // every thread (the workers, the waiter and this one) has its track
+    assert(count("\"name\":\"thread_name\"") == THREADS + 2);
+    size_t events = count("\"ph\":\"X\"");
+    assert(events > 0 && events <= (THREADS + 2) * TRACE_EVENTS);
+    // the workers made more events than they keep
+    assert(strstr(trace, "\"dropped_events\":0") == NULL);
+    assert(strstr(trace, "\"name\":\"close\",\"cat\":\"op\"") != NULL);
+    assert(strstr(trace, "\"name\":\"inode_get\",\"cat\":\"state\"") != NULL);
+    assert(strstr(trace, "\"name\":\"block_access\",\"cat\":\"storage\"") !=
+           NULL);
+    assert(strstr(trace, "\"name\":\"lock_wait\",\"cat\":\"lock\"") != NULL);
+    assert(strstr(trace, "\"inumber\":0") != NULL);
+
+    // the wait lasted (about) as long as the lock was held
+    char const *wait = strstr(trace, "\"name\":\"lock_wait\"");
+    double longest = 0;
+    for (; wait != NULL; wait = strstr(wait + 1, "\"name\":\"lock_wait\"")) {
+        char const *dur = strstr(wait, "\"dur\":");
+        assert(dur != NULL);
+        double us = strtod(dur + 6, NULL);
+        longest = us > longest ? us : longest;
+    }
+    assert(longest >= LOCK_HOLD_MS * 1000 / 2);
+
+    assert(tfs_trace_dump("/nonexistent/trace.json") == -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+
+/*
+ * This test writes records made of a header, a payload and a trailer with
+ * tfs_writev, reads them back into differently split buffers with tfs_readv,
+ * and checks the partial completion when the FS runs out of space.
+ * */
+
+#define BLOCK_SIZE 1024
+#define BLOCKS 16
+#define RECORDS 10
+#define PAYLOAD 700
+
+char const path[] = "/records";
+char const header[] = "HDR:";
+char const trailer[] = ":END\n";
+#define RECORD (sizeof(header) - 1 + PAYLOAD + sizeof(trailer) - 1)
+
+static void fill_payload(char *payload, int record) {
+    for (size_t i = 0; i < PAYLOAD; i++) {
+        payload[i] = (char)('a' + (record + (int)i) % 26);
+    }
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = BLOCKS;
+    assert(tfs_init(&params) != -1);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    char payload[PAYLOAD];
+    for (int r = 0; r < RECORDS; r++) {
+        fill_payload(payload, r);
+        struct iovec iov[] = {
+            {(void *)header, sizeof(header) - 1},
+            {NULL, 0}, // empty buffers are skipped
+            {payload, PAYLOAD},
+            {(void *)trailer, sizeof(trailer) - 1},
+        };
+        assert(tfs_writev(f, iov, 4) == RECORD);
+    }
+    assert(tfs_close(f) != -1);
+
+    // read the records back, splitting each of them in two halves
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    for (int r = 0; r < RECORDS; r++) {
+        char first[RECORD / 2];
+        char second[RECORD - RECORD / 2];
+        struct iovec iov[] = {{first, sizeof(first)},
+                              {second, sizeof(second)}};
+        assert(tfs_readv(f, iov, 2) == RECORD);
+
+        char record[RECORD];
+        memcpy(record, first, sizeof(first));
+        memcpy(record + sizeof(first), second, sizeof(second));
+        fill_payload(payload, r);
+        assert(memcmp(record, header, sizeof(header) - 1) == 0);
+        assert(memcmp(record + sizeof(header) - 1, payload, PAYLOAD) == 0);
+        assert(memcmp(record + sizeof(header) - 1 + PAYLOAD, trailer,
+                      sizeof(trailer) - 1) == 0);
+    }
+    char c;
+    struct iovec one = {&c, 1};
+    assert(tfs_readv(f, &one, 1) == 0); // end of file
+    assert(tfs_readv(f, &one, -1) == -1);
+    assert(tfs_readv(f, &one, TFS_IOV_MAX + 1) == -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_readv(f, &one, 1) == -1);
+
+    // the root directory takes one block, so 15 are left for the file: a
+    // record that does not fit is written up to the end of the last block
+    f = tfs_open(path, TFS_O_APPEND);
+    assert(f != -1);
+    fill_payload(payload, 0);
+    struct iovec iov[1 + 2 * RECORDS] = {{(void *)header, sizeof(header) - 1}};
+    for (int i = 1; i <= 2 * RECORDS; i++) {
+        iov[i] = (struct iovec){payload, PAYLOAD};
+    }
+    size_t room = (BLOCKS - 1) * BLOCK_SIZE - RECORDS * RECORD;
+    assert(room < sizeof(header) - 1 + 2 * RECORDS * PAYLOAD);
+    assert(tfs_writev(f, iov, 1 + 2 * RECORDS) == (ssize_t)room);
+    assert(tfs_writev(f, iov, 1 + 2 * RECORDS) == -1); // no space at all
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,165 @@
+#include "fs/config.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * This test checks the write-back of the buffer cache (file backend):
+ *   - writes leave their blocks dirty in the cache;
+ *   - tfs_fsync writes back the blocks of its file only, tfs_sync all of them;
+ *   - the flusher writes back blocks once they are old enough, and right away
+ *     when too much of the cache is dirty;
+ *   - data written by concurrent threads (overwritten, and freed by unlinks)
+ *     is intact after reloading the image.
+ * */
+
+#define BLOCK_SIZE 512
+#define CACHE_BLOCKS 256
+#define FILE_BLOCKS 16
+#define THREADS 4
+#define ROUNDS 20
+
+static uint8_t pattern(size_t file, size_t i) {
+    return (uint8_t)(file * 17 + i * 3 + i / 499);
+}
+
+static void write_file(char const *path, size_t file, size_t size) {
+    int fh = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(fh != -1);
+    uint8_t buffer[700];
+    for (size_t pos = 0; pos < size;) {
+        size_t n = sizeof(buffer);
+        if (n > size - pos) {
+            n = size - pos;
+        }
+        for (size_t i = 0; i < n; i++) {
+            buffer[i] = pattern(file, pos + i);
+        }
+        assert(tfs_write(fh, buffer, n) == (ssize_t)n);
+        pos += n;
+    }
+    assert(tfs_close(fh) != -1);
+}
+
+static void check_file(char const *path, size_t file, size_t size) {
+    int fh = tfs_open(path, 0);
+    assert(fh != -1);
+    static _Thread_local uint8_t buffer[CACHE_BLOCKS * BLOCK_SIZE];
+    assert(size < sizeof(buffer));
+    assert(tfs_read(fh, buffer, sizeof(buffer)) == (ssize_t)size);
+    for (size_t i = 0; i < size; i++) {
+        assert(buffer[i] == pattern(file, i));
+    }
+    assert(tfs_close(fh) != -1);
+}
+
+static size_t dirty_blocks(void) {
+    tfs_cache_stats_t stats;
+    tfs_cache_stats(&stats);
+    return stats.cs_dirty;
+}
+
+static void sleep_ms(long ms) {
+    struct timespec ts = {.tv_sec = ms / 1000,
+                          .tv_nsec = (ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+static void *worker(void *arg) {
+    size_t t = (size_t)arg;
+    char path[16];
+    sprintf(path, "/t%zu", t);
+    for (size_t r = 0; r < ROUNDS; r++) {
+        size_t file = 100 + t * ROUNDS + r;
+        write_file(path, file, FILE_BLOCKS * BLOCK_SIZE + r);
+        check_file(path, file, FILE_BLOCKS * BLOCK_SIZE + r);
+        if (r % 3 == 0) {
+            assert(tfs_unlink(path) != -1);
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    char image_path[] = "/tmp/tfs_writeback_XXXXXX";
+    int fd = mkstemp(image_path);
+    assert(fd != -1);
+    close(fd);
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = 1024;
+    params.image_path = image_path;
+    params.backend = TFS_BACKEND_FILE;
+    params.cache_size = CACHE_BLOCKS * BLOCK_SIZE;
+    assert(tfs_init(&params) != -1);
+
+    // writes stay in the cache (well below the ratio and the age)
+    write_file("/a", 1, FILE_BLOCKS * BLOCK_SIZE);
+    write_file("/b", 2, FILE_BLOCKS * BLOCK_SIZE);
+    assert(dirty_blocks() >= 2 * FILE_BLOCKS);
+
+    int fh = tfs_open("/a", 0);
+    assert(fh != -1);
+    size_t before = dirty_blocks();
+    assert(tfs_fsync(fh) != -1);
+    assert(dirty_blocks() <= before - FILE_BLOCKS);
+    assert(dirty_blocks() >= FILE_BLOCKS);
+    assert(tfs_close(fh) != -1);
+    assert(tfs_fsync(fh) == -1);
+
+    assert(tfs_sync() != -1);
+    assert(dirty_blocks() == 0);
+
+    // the flusher writes back old blocks
+    write_file("/a", 3, FILE_BLOCKS * BLOCK_SIZE);
+    assert(dirty_blocks() >= FILE_BLOCKS);
+    for (int i = 0; i < 20 && dirty_blocks() > 0; i++) {
+        sleep_ms(BCACHE_DIRTY_AGE_MS / 5);
+    }
+    assert(dirty_blocks() == 0);
+
+    // and does not wait for them to be old when too many are dirty
+    size_t limit = CACHE_BLOCKS * BCACHE_DIRTY_RATIO / 100;
+    write_file("/big", 4, 2 * limit * BLOCK_SIZE);
+    for (int i = 0; i < 10 && dirty_blocks() > limit; i++) {
+        sleep_ms(BCACHE_DIRTY_AGE_MS / 20);
+    }
+    assert(dirty_blocks() <= limit);
+    check_file("/a", 3, FILE_BLOCKS * BLOCK_SIZE);
+    check_file("/b", 2, FILE_BLOCKS * BLOCK_SIZE);
+    check_file("/big", 4, 2 * limit * BLOCK_SIZE);
+
+    pthread_t tid[THREADS];
+    for (size_t t = 0; t < THREADS; t++) {
+        assert(pthread_create(&tid[t], NULL, worker, (void *)t) == 0);
+    }
+    for (size_t t = 0; t < THREADS; t++) {
+        assert(pthread_join(tid[t], NULL) == 0);
+    }
+    assert(tfs_destroy() != -1);
+
+    // everything reached the image
+    assert(tfs_init(&params) != -1);
+    check_file("/a", 3, FILE_BLOCKS * BLOCK_SIZE);
+    check_file("/b", 2, FILE_BLOCKS * BLOCK_SIZE);
+    check_file("/big", 4, 2 * limit * BLOCK_SIZE);
+    for (size_t t = 0; t < THREADS; t++) {
+        char path[16];
+        sprintf(path, "/t%zu", t);
+        size_t r = ROUNDS - 1;
+        check_file(path, 100 + t * ROUNDS + r, FILE_BLOCKS * BLOCK_SIZE + r);
+    }
+    assert(tfs_destroy() != -1);
+    unlink(image_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}